@@ -0,0 +1,82 @@
+local m = require("mem")
+local Vector = require("vector")
+
+local C = terralib.includecstring [[
+#include <stdlib.h>
+]]
+
+
+-- Bump allocator: hands out memory from a list of large chunks, and releases
+--    everything at once in O(1) via reset(). Chunks are kept around across resets,
+--    so once warmed up, allocation never touches malloc.
+-- The arena never runs destructors; owners of the objects placed in it must do that.
+local defaultChunkSize = 64*1024
+-- Every allocation is aligned to this many bytes (malloc's guarantee on x86-64)
+local alignment = 16
+
+local struct Arena
+{
+	chunks: Vector(&uint8),
+	chunkSizes: Vector(uint64),
+	chunkSize: uint64,
+	currChunk: uint,
+	offset: uint64
+}
+
+terra Arena:__construct(chunkSize: uint64) : {}
+	m.init(self.chunks)
+	m.init(self.chunkSizes)
+	self.chunkSize = chunkSize
+	self.currChunk = 0
+	self.offset = 0
+end
+
+terra Arena:__construct() : {}
+	self:__construct(defaultChunkSize)
+end
+
+terra Arena:__copy(other: &Arena) : {}
+	-- Memory handed out by an arena is owned by it, so copies start out empty
+	self:__construct(other.chunkSize)
+end
+
+terra Arena:__destruct() : {}
+	for i=0,self.chunks.size do
+		C.free(self.chunks(i))
+	end
+	m.destruct(self.chunks)
+	m.destruct(self.chunkSizes)
+end
+
+terra Arena:alloc(size: uint64) : &opaque
+	size = (size + alignment-1) and not [uint64](alignment-1)
+	-- Find the first chunk (starting at the current one) with room left
+	while self.currChunk < self.chunks.size do
+		if self.offset + size <= self.chunkSizes(self.currChunk) then
+			var ptr = self.chunks(self.currChunk) + self.offset
+			self.offset = self.offset + size
+			return ptr
+		end
+		self.currChunk = self.currChunk + 1
+		self.offset = 0
+	end
+	-- Out of chunks; grab a new one (big enough for oversized requests)
+	var newSize = self.chunkSize
+	if size > newSize then newSize = size end
+	var chunk = [&uint8](C.malloc(newSize))
+	self.chunks:push(chunk)
+	self.chunkSizes:push(newSize)
+	self.currChunk = self.chunks.size-1
+	self.offset = size
+	return chunk
+end
+
+terra Arena:reset() : {}
+	self.currChunk = 0
+	self.offset = 0
+end
+
+m.addConstructors(Arena)
+
+
+return Arena
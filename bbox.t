@@ -36,6 +36,10 @@ local BBox = templatize(function(VecT)
 		return @point > self.mins and @point < self.maxs
 	end
 
+	terra BBoxT:intersects(other: &BBoxT)
+		return self.mins <= other.maxs and self.maxs >= other.mins
+	end
+
 	m.addConstructors(BBoxT)
 	return BBoxT
 
@@ -0,0 +1,218 @@
+local m = require("mem")
+local Vector = require("vector")
+local templatize = require("templatize")
+local BBox = require("bbox")
+local Vec = require("linalg").Vec
+
+local C = terralib.includecstring [[
+#include <stdlib.h>
+]]
+
+
+-- Bounding volume hierarchy over a list of boxes, for finding every box that
+--    contains a given point.
+-- Built as a linear BVH: boxes are sorted along a Morton curve through their
+--    centroids, and the tree is formed by splitting at the highest bit in which
+--    the Morton codes of a range differ. This costs one sort per build, which is
+--    cheap enough to rebuild the tree from scratch every render.
+local BVH = templatize(function(VecT)
+
+	assert(VecT.__generatorTemplate == Vec)
+
+	local dim = VecT.Dimension
+	local BBoxT = BBox(VecT)
+
+	-- Morton codes are 64 bits, split evenly among dimensions
+	local bitsPerDim = math.min(21, math.floor(64 / dim))
+	local quantScale = 2^bitsPerDim - 1
+	local maxLeafSize = 4
+	-- Splits either consume a Morton bit or halve a run of identical codes,
+	--    so the tree can never get deeper than this
+	local maxDepth = 64 + 32
+
+	local struct Entry
+	{
+		code: uint64,
+		index: uint
+	}
+
+	local terra compareEntries(a: &opaque, b: &opaque) : int
+		var ea = [&Entry](a)
+		var eb = [&Entry](b)
+		if ea.code < eb.code then return -1
+		elseif ea.code > eb.code then return 1
+		-- Break ties by index, so builds are deterministic
+		elseif ea.index < eb.index then return -1
+		elseif ea.index > eb.index then return 1
+		else return 0 end
+	end
+
+	-- Interior nodes have count == 0
+	local struct Node
+	{
+		bounds: BBoxT,
+		left: uint,
+		right: uint,
+		start: uint,
+		count: uint
+	}
+
+	local struct BVHT
+	{
+		nodes: Vector(Node),
+		entries: Vector(Entry),
+		-- Box indices and boxes, in Morton order
+		items: Vector(uint),
+		itemBounds: Vector(BBoxT)
+	}
+
+	terra BVHT:__construct() : {}
+		m.init(self.nodes)
+		m.init(self.entries)
+		m.init(self.items)
+		m.init(self.itemBounds)
+	end
+
+	terra BVHT:__destruct() : {}
+		m.destruct(self.nodes)
+		m.destruct(self.entries)
+		m.destruct(self.items)
+		m.destruct(self.itemBounds)
+	end
+
+	terra BVHT:clear() : {}
+		self.nodes:clear()
+		self.entries:clear()
+		self.items:clear()
+		self.itemBounds:clear()
+	end
+
+	local terra mortonCode(q: uint64[dim]) : uint64
+		var code = [uint64](0)
+		for b=0,bitsPerDim do
+			for d=0,dim do
+				code = code or (((q[d] >> b) and 1) << (b*dim + d))
+			end
+		end
+		return code
+	end
+
+	-- First index in [lo, hi) at which the codes' highest differing bit is set
+	terra BVHT:findSplit(lo: uint, hi: uint) : uint
+		var first = self.entries(lo).code
+		var last = self.entries(hi-1).code
+		if first == last then return (lo + hi) / 2 end
+		var diff = first ^ last
+		var bit = [uint64](1) << 63
+		while (diff and bit) == 0 do bit = bit >> 1 end
+		var a = lo
+		var b = hi - 1
+		while a < b do
+			var mid = (a + b) / 2
+			if (self.entries(mid).code and bit) ~= 0 then b = mid else a = mid + 1 end
+		end
+		return a
+	end
+
+	terra BVHT:buildRange(lo: uint, hi: uint) : uint
+		var nodeIndex = self.nodes.size
+		var node : Node
+		node.bounds = BBoxT.stackAlloc()
+		node.left = 0
+		node.right = 0
+		node.start = lo
+		node.count = 0
+		self.nodes:push(node)
+		if hi - lo <= maxLeafSize then
+			node.count = hi - lo
+			for i=lo,hi do node.bounds:expand(self.itemBounds:getPointer(i)) end
+		else
+			var split = self:findSplit(lo, hi)
+			node.left = self:buildRange(lo, split)
+			node.right = self:buildRange(split, hi)
+			node.bounds:expand(&self.nodes:getPointer(node.left).bounds)
+			node.bounds:expand(&self.nodes:getPointer(node.right).bounds)
+		end
+		self.nodes(nodeIndex) = node
+		return nodeIndex
+	end
+
+	terra BVHT:build(boxes: &Vector(BBoxT)) : {}
+		self:clear()
+		var n = boxes.size
+		if n == 0 then return end
+		-- Quantize box centroids relative to the bounds of all centroids
+		var centroidBounds = BBoxT.stackAlloc()
+		for i=0,n do
+			var b = boxes:getPointer(i)
+			var c = 0.5*(b.mins + b.maxs)
+			centroidBounds:expand(&c)
+		end
+		for i=0,n do
+			var b = boxes:getPointer(i)
+			var c = 0.5*(b.mins + b.maxs)
+			var q : uint64[dim]
+			for d=0,dim do
+				var extent = centroidBounds.maxs(d) - centroidBounds.mins(d)
+				var t = 0.0
+				if extent > 0.0 then t = (c(d) - centroidBounds.mins(d)) / extent end
+				-- (Unbounded boxes may give NaNs here)
+				if not (t >= 0.0) then t = 0.0 end
+				if t > 1.0 then t = 1.0 end
+				q[d] = [uint64](t * quantScale)
+			end
+			self.entries:push(Entry { mortonCode(q), i })
+		end
+		C.qsort(self.entries:getPointer(0), n, sizeof(Entry), compareEntries)
+		for i=0,n do
+			var index = self.entries(i).index
+			self.items:push(index)
+			self.itemBounds:push(boxes(index))
+		end
+		self:buildRange(0, n)
+	end
+
+	-- Find the indices of all boxes that (strictly) contain 'point', in increasing order
+	terra BVHT:query(point: &VecT, hits: &Vector(uint)) : {}
+		hits:clear()
+		if self.nodes.size == 0 then return end
+		var stack : uint[maxDepth+1]
+		stack[0] = 0
+		var sp = 1
+		while sp > 0 do
+			sp = sp - 1
+			var node = self.nodes:getPointer(stack[sp])
+			if node.bounds:contains(point) then
+				if node.count > 0 then
+					for k=node.start,node.start+node.count do
+						if self.itemBounds:getPointer(k):contains(point) then
+							hits:push(self.items(k))
+						end
+					end
+				else
+					stack[sp] = node.left
+					stack[sp+1] = node.right
+					sp = sp + 2
+				end
+			end
+		end
+		-- Hits come out in Morton order; restore box order (insertion sort, since
+		--    only a handful of boxes overlap any one point)
+		for i=1,hits.size do
+			var x = hits(i)
+			var j = i
+			while j > 0 and hits(j-1) > x do
+				hits(j) = hits(j-1)
+				j = j - 1
+			end
+			hits(j) = x
+		end
+	end
+
+	m.addConstructors(BVHT)
+	return BVHT
+
+end)
+
+
+return BVH
@@ -170,6 +170,27 @@ local Image = templatize(function(dataType, numChannels)
 	end
 	util.inline(ImageT.methods.setPixelColor)
 
+	-- Whole-row access, for bulk conversions: fetch a row once with scanLine, then
+	--    address its pixels with getRowPixelColor/setRowPixelColor
+	terra ImageT:scanLine(j: uint) : &dataType
+		return [&dataType](FI.FreeImage_GetScanLine(self.fibitmap, j))
+	end
+	util.inline(ImageT.methods.scanLine)
+
+	terra ImageT.methods.getRowPixelColor(row: &dataType, i: uint) : ColorVec
+		var cvec = ColorVec.stackAlloc()
+		var pixelData = row + numChannels*i
+		[ColorVec.entryExpList(cvec)] = [arrayElems(pixelData, numChannels)]
+		return cvec
+	end
+	util.inline(ImageT.methods.getRowPixelColor)
+
+	terra ImageT.methods.setRowPixelColor(row: &dataType, i: uint, color: ColorVec) : {}
+		var pixelData = row + numChannels*i
+		[arrayElems(pixelData, numChannels)] = [ColorVec.entryExpList(color)]
+	end
+	util.inline(ImageT.methods.setRowPixelColor)
+
 	m.addConstructors(ImageT)
 	return ImageT
 
@@ -59,8 +59,6 @@ local function circlesModule(inferenceTime, doSmoothing)
 		local CircleT = Circle(real)
 		local SampledFunctionType = SampledFunction(Vec2d, Color1, SfnOpts.ClampFns.None(), SfnOpts.AccumFns.Over())
 		local ShapeType = shapes.ImplicitShape(Vec2, Color1)
-		local CircleShape = shapes.SphereImplicitShape(Vec2, Color1)
-		local ColoredShape = shapes.ConstantColorImplicitShape(Vec2, Color1)
 		local Sampler = ImplicitSampler(SampledFunctionType, ShapeType)
 
 		local RetType = CirclesRetType(real)
@@ -96,9 +94,7 @@ local function circlesModule(inferenceTime, doSmoothing)
 				sampler:clear()
 				for i=0,retval.circles.size do
 					var c = retval.circles:getPointer(i)
-					var cShape = CircleShape.heapAlloc(c.center, c.radius)
-					var coloredShape = ColoredShape.heapAlloc(cShape, Color1.stackAlloc(1.0))
-					sampler:addShape(coloredShape)
+					sampler:addSphere(c.center, c.radius, Color1.stackAlloc(1.0), 1.0)
 				end
 				[(not smooth) and (`sampler:sampleSharp(pattern)) or (`sampler:sampleSmooth(pattern, retval.smoothParam))]
 			end
@@ -28,8 +28,6 @@ local function colorDotModule(inferenceTime, doSmoothing)
 		local Color3 = Color(real, 3)
 		local SampledFunctionType = SampledFunction(Vec2d, Color3, SfnOpts.ClampFns.None(), SfnOpts.AccumFns.Over())
 		local ShapeType = shapes.ImplicitShape(Vec2, Color3)
-		local CircleShape = shapes.SphereImplicitShape(Vec2, Color3)
-		local ColoredShape = shapes.ConstantColorImplicitShape(Vec2, Color3)
 		local Sampler = ImplicitSampler(SampledFunctionType, ShapeType)
 
 		-- Shorthand for common non-structural ERPs
@@ -53,9 +51,7 @@ local function colorDotModule(inferenceTime, doSmoothing)
 
 		local terra render(retval: &Color3, sampler: &Sampler, pattern: &Vector(Vec2d))
 			sampler:clear()
-			var cShape = CircleShape.heapAlloc(Vec2.stackAlloc(center), radius)
-			var coloredShape = ColoredShape.heapAlloc(cShape, @retval)
-			sampler:addShape(coloredShape)
+			sampler:addSphere(Vec2.stackAlloc(center), radius, @retval, 1.0)
 			sampler:sampleSharp(pattern)
 		end
 
@@ -53,8 +53,6 @@ local function grammarModule(inferenceTime, doSmoothing)
 		local Color1 = Color(real, 1)
 		local SampledFunctionType = SampledFunction(Vec2d, Color1, SfnOpts.ClampFns.None(), SfnOpts.AccumFns.Over())
 		local ShapeType = shapes.ImplicitShape(Vec2, Color1)
-		local Capsule = shapes.CapsuleImplicitShape(Vec2, Color1)
-		local ColoredShape = shapes.ConstantColorImplicitShape(Vec2, Color1)
 		local Sampler = ImplicitSampler(SampledFunctionType, ShapeType)
 
 		local RetType = GrammarRetType(real)
@@ -127,9 +125,7 @@ local function grammarModule(inferenceTime, doSmoothing)
 				sampler:clear()
 				for i=0,retval.segs.size do
 					var seg = retval.segs:getPointer(i)
-					var capsule = Capsule.heapAlloc(seg.start, seg.stop, lineThickness)
-					var coloredCapsule = ColoredShape.heapAlloc(capsule, Color1.stackAlloc(1.0))
-					sampler:addShape(coloredCapsule)
+					sampler:addCapsule(seg.start, seg.stop, lineThickness, Color1.stackAlloc(1.0), 1.0)
 				end
 				[(not smooth) and (`sampler:sampleSharp(pattern)) or (`sampler:sampleSmooth(pattern, retval.smoothParam))]
 			end
@@ -57,8 +57,6 @@ local function particlesModule(inferenceTime, doSmoothing)
 		local Color3 = Color(real, 3)
 		local SampledFunctionType = SampledFunction(Vec2d, Color3, SfnOpts.ClampFns.None(), SfnOpts.AccumFns.Over())
 		local ShapeType = shapes.ImplicitShape(Vec2, Color3)
-		local Capsule = shapes.CapsuleImplicitShape(Vec2, Color3)
-		local ColoredShape = shapes.ConstantColorImplicitShape(Vec2, Color3)
 		local Sampler = ImplicitSampler(SampledFunctionType, ShapeType)
 
 		local RetType = ParticlesRetType(real)
@@ -227,14 +225,17 @@ local function particlesModule(inferenceTime, doSmoothing)
 		end)
 
 		-- Rendering
+		-- Streamlines overlap heavily, so composite front-to-back. With a saturation
+		--    below 1, samples are skipped once they are that fully covered, which is
+		--    faster but changes the likelihood slightly (so it is off by default).
+		local coverageSaturation = 1.0
 		local function genRenderFn(smooth)
 			return terra(retval: &RetType, sampler: &Sampler, pattern: &Vector(Vec2d))
 				sampler:clear()
+				sampler:setFrontToBack(true, coverageSaturation)
 				for i=0,retval.segs.size do
 					var seg = retval.segs:getPointer(i)
-					var capsule = Capsule.heapAlloc(seg.start, seg.stop, lineWidth)
-					var coloredCapsule = ColoredShape.heapAlloc(capsule, seg.color)
-					sampler:addShape(coloredCapsule)
+					sampler:addCapsule(seg.start, seg.stop, lineWidth, seg.color, 1.0)
 				end
 				[util.optionally(smooth, function() return quote
 					sampler:sampleSmooth(pattern, retval.smoothParam)
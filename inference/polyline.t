@@ -52,8 +52,6 @@ local function polylineModule(inferenceTime, doSmoothing)
 		local Color1 = Color(real, 1)
 		local SampledFunctionType = SampledFunction(Vec2d, Color1, SfnOpts.ClampFns.None(), SfnOpts.AccumFns.Over())
 		local ShapeType = shapes.ImplicitShape(Vec2, Color1)
-		local Capsule = shapes.CapsuleImplicitShape(Vec2, Color1)
-		local ColoredShape = shapes.ConstantColorImplicitShape(Vec2, Color1)
 		local Sampler = ImplicitSampler(SampledFunctionType, ShapeType)
 
 		local RetType = PolylinesRetType(real)
@@ -116,9 +114,7 @@ local function polylineModule(inferenceTime, doSmoothing)
 			return terra(retval: &RetType, sampler: &Sampler, pattern: &Vector(Vec2d))
 				sampler:clear()
 				for i=0,retval.points.size-1 do
-					var capsule = Capsule.heapAlloc(retval.points:get(i), retval.points:get(i+1), lineThickness)
-					var coloredCapsule = ColoredShape.heapAlloc(capsule, Color1.stackAlloc(1.0))
-					sampler:addShape(coloredCapsule)
+					sampler:addCapsule(retval.points:get(i), retval.points:get(i+1), lineThickness, Color1.stackAlloc(1.0), 1.0)
 				end
 				[(not smooth) and (`sampler:sampleSharp(pattern)) or (`sampler:sampleSmooth(pattern, retval.smoothParam))]
 			end
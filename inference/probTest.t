@@ -17,6 +17,7 @@ local RGBImage = im.Image(uint8, 3)
 local patterns = require("samplePatterns")
 local ImgGridPattern = patterns.RegularGridSamplingPattern(Vec2d)
 
+local SfnOpts = require("sampledFnOptions")
 local SampledFunction = require("sampledFunction")
 local SampledFunction2d1d = SampledFunction(Vec2d, Color1d)
 
@@ -30,10 +31,16 @@ local colorDotModule = require("colorDot")
 local stainedGlassModule = require("stainedGlass")
 
 local loadTargetImage = require("targetImageLikelihood").loadTargetImage
+local loadTargetImagePyramid = require("targetImageLikelihood").loadTargetImagePyramid
 local mseLikelihoodModule = require("targetImageLikelihood").mseLikelihoodModule
+local TargetPatterns = require("targetImageLikelihood").TargetPatterns
 
 local GradientAscent = require("gradientAscent")
 
+local numHardwareThreads = require("threadPool").numHardwareThreads
+
+local instr = require("instrumentation")
+
 local C = terralib.includecstring [[
 #include <stdio.h>
 #include <string.h>
@@ -48,8 +55,11 @@ local function bayesProgram(priorModule, likelihoodModule)
 		local prior = priorModule().prior
 		local likelihood = likelihoodModule().likelihood
 		return terra()
+			instr.markTapeStart(real)
+			var priorStart = instr.startTimer()
 			var structure = prior()
-			factor(likelihood(&structure))
+			instr.stopTimer("priorTime", priorStart)
+			factor(instr.markTapeEnd(likelihood(&structure)))
 			return structure
 		end
 	end
@@ -73,6 +83,8 @@ end
 
 
 -- Render a video of the sequence of accepted states
+-- Frames are rendered on the pixel grid, or, for targets sampled off the grid, on the
+--    target's own pattern (as the likelihood sees them) and reconstructed from there.
 local function renderVideo(pmodule, targetData, valueSeq, directory, name, doSmooth)
 	io.write("Rendering video...")
 	io.flush()
@@ -89,6 +101,15 @@ local function renderVideo(pmodule, targetData, valueSeq, directory, name, doSmo
 	-- 1000/1 = numValues/x
 	local numValues = valueSeq.size
 	local frameSkip = math.ceil(numValues / 1000.0)
+	local onGrid = (targetData.patternKind == TargetPatterns.Grid)
+	-- (Importance patterns are sparse away from edges, so they need a wider filter)
+	local interpFn = SfnOpts.SampleInterpFns.NearestNeighbor()
+	if targetData.patternKind == TargetPatterns.Importance then
+		interpFn = SfnOpts.SampleInterpFns.Gaussian(1.5)
+	elseif not onGrid then
+		interpFn = SfnOpts.SampleInterpFns.Tent(1.5)
+	end
+	local target = targetData.target
 	local function renderFrames(valueSeq, basename)
 		return quote
 			var samples = SampledFunctionType.stackAlloc()
@@ -96,7 +117,9 @@ local function renderVideo(pmodule, targetData, valueSeq, directory, name, doSmo
 				Vec2d.stackAlloc(0.0),
 				Vec2d.stackAlloc(1.0),
 				Vec2u.stackAlloc(width, height))
+			var pattern = [onGrid and (`grid:getSamplePattern()) or (`target.samplingPattern)]
 			var sampler = SamplerType.stackAlloc(&samples)
+			sampler:setNumThreads(numHardwareThreads())
 			var framename : int8[1024]
 			var image = RGBImage.stackAlloc(width, height)
 			var zeros = Vec2d.stackAlloc(0.0)
@@ -106,11 +129,11 @@ local function renderVideo(pmodule, targetData, valueSeq, directory, name, doSmo
 			for i=0,[valueSeq].size,incr do
 				var val = [valueSeq]:getPointer(i)
 				[doSmooth and 
-					(`M.sampleSmooth(&val.value, &sampler, grid:getSamplePattern()))
+					(`M.sampleSmooth(&val.value, &sampler, pattern))
 				or
-					(`M.sampleSharp(&val.value, &sampler, grid:getSamplePattern()))
+					(`M.sampleSharp(&val.value, &sampler, pattern))
 				]
-				[SampledFunctionType.saveToImage(RGBImage)](&samples, &image, zeros, ones)
+				[SampledFunctionType.saveToImage(RGBImage, interpFn)](&samples, &image, zeros, ones)
 				C.sprintf(framename, [basename], framenumber)
 				framenumber = framenumber + 1
 				image:save(im.Format.PNG, framename)
@@ -136,12 +159,30 @@ local numsamps = 1000
 local doGlobalAnnealing = false
 local initialGlobalTemp = 10
 local doLocalErrorTempering = false
+local doFusedScoring = false
+-- Re-render only what changed since the previous likelihood evaluation (successive
+--    proposals usually only move a few shapes)
+local doIncrementalRendering = false
 local hmcUsePrimalLP = false
 local alwaysDoSmoothing = false
 local outputSmoothRender = true
 local constraintStrength = 200000
 -- local constraintStrength = 2000
 local expandFactor = 1
+-- Where to sample the target (and renders): the pixel grid, one of the jittered,
+--    low-discrepancy, or blue-noise patterns, or a weighted pattern concentrated
+--    around edges in the target (see TargetPatterns)
+local targetPattern = TargetPatterns.Grid
+-- Score against coarser (box-filtered) copies of the target early on, switching
+--    to finer ones as inference proceeds (1 = always use the full-res target)
+local numPyramidLevels = 1
+-- Render and score only this fraction of the target's pixels (a new random subset
+--    every iteration) in exchange for noisier gradients (1 = use every pixel)
+local miniBatchFraction = 1.0
+-- Count the work done by likelihood evaluations (see instrumentation.t); with
+--    a filename, also write per-iteration counts to that CSV file
+local doInstrumentation = false
+local instrumentationCSV = nil
 
 local doHMC = true
 
@@ -198,6 +239,7 @@ local scheduleFunction = macro(function(iter, currTrace)
 		inferenceTime = [double](iter) / numsamps
 		[util.optionally(doGlobalAnnealing, genAnnealingCode, currTrace, inferenceTime)]
 		[util.optionally(doLocalErrorTempering, genLocalErrorTemperingCode, currTrace, oldInfTime, inferenceTime)]
+		instr.endIteration(iter)
 	end
 end)
 
@@ -210,14 +252,32 @@ end
 local pmodule = priorModule.codeModule(inferenceTime, alwaysSmooth)
 
 constraintStrength = expandFactor*expandFactor*constraintStrength
-local targetData = loadTargetImage(pmodule().SampledFunctionType, targetImgName, expandFactor)
+local targetData = nil
+if numPyramidLevels > 1 then
+	assert(targetPattern == TargetPatterns.Grid, "Target pyramids only support the Grid target pattern")
+	targetData = loadTargetImagePyramid(pmodule().SampledFunctionType, targetImgName, numPyramidLevels, expandFactor)
+else
+	targetData = loadTargetImage(pmodule().SampledFunctionType, targetImgName, expandFactor, targetPattern)
+end
 local lmodule = mseLikelihoodModule(pmodule, targetData, constraintStrength,
-	inferenceTime, zeroTargetLLSum, doLocalErrorTempering)
+	inferenceTime, zeroTargetLLSum, doLocalErrorTempering, doFusedScoring, miniBatchFraction,
+	doIncrementalRendering)
 local program = bayesProgram(pmodule, lmodule)
 
 local kernel = Schedule(kernel, scheduleFunction)
 
+if doInstrumentation then
+	instr.enable()
+	if instrumentationCSV then instr.openCSV(instrumentationCSV) end
+end
 local values = doMCMC(program, kernel, numsamps)
+if doInstrumentation then
+	instr.closeCSV()
+	print("Likelihood instrumentation totals:")
+	local totals = instr.totals()
+	for _,name in ipairs(instr.counterNames) do print(string.format("  %s: %d", name, totals[name])) end
+	for _,name in ipairs(instr.timerNames) do print(string.format("  %s: %g s", name, totals[name])) end
+end
 -- local values = doForwardSample(program, numsamps)
 
 local basename = arg[1] or "movie"
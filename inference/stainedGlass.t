@@ -435,12 +435,11 @@ local function stainedGlassModule(inferenceTime, doSmoothing)
 				end
 				CNearTree.CNearTreeCompleteDelayedInsert(nearTree)
 
-				var shape = [smooth and
-					(`StainedGlassShape.heapAlloc(&retval.points, retval.smoothParam))
+				[smooth and
+					(`sampler:emplaceShape(StainedGlassShape, &retval.points, retval.smoothParam))
 				or
-					(`StainedGlassShape.heapAlloc(&retval.points, 0.0))
+					(`sampler:emplaceShape(StainedGlassShape, &retval.points, 0.0))
 				]
-				sampler:addShape(shape)
 				sampler:sampleSharp(pattern)
 			end
 		end
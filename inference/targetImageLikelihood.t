@@ -1,10 +1,14 @@
 local m = require("mem")
 local util = require("util")
 local ad = require("ad")
+local simd = require("simd")
+local SfnOpts = require("sampledFnOptions")
+local instr = require("instrumentation")
 
 local im = require("image")
 local RGBImage = im.Image(uint8, 3)
 
+local Vector = require("vector")
 local Vec = require("linalg").Vec
 local Vec2d = Vec(double, 2)
 local Vec2u = Vec(uint, 2)
@@ -12,40 +16,621 @@ local Vec2u = Vec(uint, 2)
 local patterns = require("samplePatterns")
 local ImgGridPattern = patterns.RegularGridSamplingPattern(Vec2d)
 
+local C = terralib.includecstring [[
+#include <math.h>
+]]
+
 ------------------------
 
+-- Sample patterns that a target image can be resampled onto (see loadTargetImage).
+-- All of them use (about, for PoissonDisk) as many samples as the pixel grid does, and
+--    fixed seeds, so that runs are reproducible.
+local TargetPatterns =
+{
+	Grid = "Grid",
+	JitteredGrid = "JitteredGrid",
+	Halton = "Halton",
+	PoissonDisk = "PoissonDisk",
+	-- Dense near edges, sparse in flat regions, with per-sample weights
+	--    (see buildImportancePattern)
+	Importance = "Importance"
+}
+local targetPatternSeed = 1
+
+-- Parameters of the Importance target pattern
+local ImportanceParams =
+{
+	-- Fraction of the pixel grid's sample count to use
+	sampleFraction = 0.25,
+	-- Relative sample density of flat regions (edges have density 1)
+	floorDensity = 0.1,
+	-- How far (in pixels) the extra density around edges reaches
+	edgeRadius = 3
+}
+
+-- Value of a w x h (column-major) array at (x, y), clamping to the border
+local terra clampedAt(values: &double, w: int, h: int, x: int, y: int) : double
+	if x < 0 then x = 0 elseif x >= w then x = w-1 end
+	if y < 0 then y = 0 elseif y >= h then y = h-1 end
+	return values[x*h + y]
+end
+util.inline(clampedAt)
+
+-- Per-pixel importance of an image: Sobel gradient magnitude of its luminance, spread
+--    out to nearby pixels with a linear falloff over 'edgeRadius' pixels (so that
+--    samples also land close to, not just on, edges), normalized to [0, 1].
+local terra imageImportance(image: &RGBImage, edgeRadius: int, importance: &Vector(double)) : {}
+	var w = [int](image:width())
+	var h = [int](image:height())
+	var lum = [Vector(double)].stackAlloc()
+	lum:resize(w*h)
+	for x=0,w do
+		for y=0,h do
+			var c = image:getPixelColor(x, y)
+			var sum = 0.0
+			for k=0,[RGBImage.ColorVec.Dimension] do sum = sum + c.entries[k] end
+			lum(x*h + y) = sum / (255.0*[RGBImage.ColorVec.Dimension])
+		end
+	end
+	var L = lum:getPointer(0)
+	var grad = [Vector(double)].stackAlloc()
+	grad:resize(w*h)
+	for x=0,w do
+		for y=0,h do
+			var gx = (clampedAt(L,w,h,x+1,y-1) + 2.0*clampedAt(L,w,h,x+1,y) + clampedAt(L,w,h,x+1,y+1)) -
+					 (clampedAt(L,w,h,x-1,y-1) + 2.0*clampedAt(L,w,h,x-1,y) + clampedAt(L,w,h,x-1,y+1))
+			var gy = (clampedAt(L,w,h,x-1,y+1) + 2.0*clampedAt(L,w,h,x,y+1) + clampedAt(L,w,h,x+1,y+1)) -
+					 (clampedAt(L,w,h,x-1,y-1) + 2.0*clampedAt(L,w,h,x,y-1) + clampedAt(L,w,h,x+1,y-1))
+			grad(x*h + y) = C.sqrt(gx*gx + gy*gy)
+		end
+	end
+	importance:resize(w*h)
+	var maxImportance = 0.0
+	for x=0,w do
+		for y=0,h do
+			var imp = 0.0
+			for dx=-edgeRadius,edgeRadius+1 do
+				for dy=-edgeRadius,edgeRadius+1 do
+					var qx = x + dx
+					var qy = y + dy
+					if qx >= 0 and qx < w and qy >= 0 and qy < h then
+						var falloff = 1.0 - C.sqrt(dx*dx + dy*dy) / (edgeRadius + 1.0)
+						if falloff > 0.0 then imp = C.fmax(imp, falloff*grad(qx*h + qy)) end
+					end
+				end
+			end
+			importance:set(x*h + y, imp)
+			maxImportance = C.fmax(maxImportance, imp)
+		end
+	end
+	if maxImportance > 0.0 then
+		for i=0,w*h do importance:set(i, importance:get(i) / maxImportance) end
+	end
+	m.destruct(lum)
+	m.destruct(grad)
+end
+
+-- Place samples over a numCells x numCells grid covering [mincoord, maxcoord]^2, with
+--    density proportional to the image's importance (floored at 'floorDensity'; cells
+--    outside of the image are flat). Samples are chosen by systematic sampling along
+--    the cells' cumulative density, and jittered within their cells.
+-- Each sample's weight is the reciprocal of its density relative to the mean density,
+--    so a weighted mean of per-sample errors is an unbiased estimate of the unweighted
+--    mean over every cell (see weightedMseComps).
+local terra buildImportancePattern(image: &RGBImage, mincoord: double, maxcoord: double,
+								   numCells: uint, seed: uint64,
+								   points: &Vector(Vec2d), weights: &Vector(double)) : {}
+	var importance = [Vector(double)].stackAlloc()
+	imageImportance(image, [ImportanceParams.edgeRadius], &importance)
+	var w = [int](image:width())
+	var h = [int](image:height())
+	var cellSize = (maxcoord - mincoord) / numCells
+	var density = [Vector(double)].stackAlloc()
+	density:resize(numCells*numCells)
+	var totalDensity = 0.0
+	for i=0,numCells do
+		for j=0,numCells do
+			-- Image pixel under this cell's centroid (images span [0,1]^2)
+			var x = [int](C.floor((mincoord + (i+0.5)*cellSize) * w))
+			var y = [int](C.floor((mincoord + (j+0.5)*cellSize) * h))
+			var imp = 0.0
+			if x >= 0 and x < w and y >= 0 and y < h then imp = importance(x*h + y) end
+			var d = [ImportanceParams.floorDensity] + (1.0 - [ImportanceParams.floorDensity])*imp
+			density(i*numCells + j) = d
+			totalDensity = totalDensity + d
+		end
+	end
+	var numSamples = [uint](C.ceil([ImportanceParams.sampleFraction] * density.size))
+	var meanDensity = totalDensity / density.size
+	var random = [patterns.Random].stackAlloc(seed)
+	points:clear()
+	weights:clear()
+	var step = totalDensity / numSamples
+	var next = random:uniform() * step
+	var cumulative = 0.0
+	for c=0,density.size do
+		var d = density(c)
+		cumulative = cumulative + d
+		while next < cumulative and points.size < numSamples do
+			var i = c / numCells
+			var j = c % numCells
+			points:push(Vec2d.stackAlloc(mincoord + (i + random:uniform())*cellSize,
+										 mincoord + (j + random:uniform())*cellSize))
+			weights:push(meanDensity / d)
+			next = next + step
+		end
+	end
+	m.destruct(importance)
+	m.destruct(density)
+end
+
+-- Build the samples of a target pattern over the square [mincoord, maxcoord]^2, with
+--    numCells cells per side, and give them to 'target' (a pointer)
+-- (Importance patterns also need the image, and a Vector for their weights)
+local function setTargetPattern(patternKind, target, mincoord, maxcoord, numCells, image, weights)
+	local mins = `Vec2d.stackAlloc([mincoord])
+	local maxs = `Vec2d.stackAlloc([maxcoord])
+	local function own(PatternType, ...)
+		local args = {...}
+		return quote
+			var pattern = PatternType.stackAlloc([args])
+			[target]:ownSamplingPattern(pattern:getSamplePattern())
+			m.destruct(pattern)
+		end
+	end
+	if patternKind == TargetPatterns.Grid then
+		return quote
+			var grid = ImgGridPattern.stackAlloc(mins, maxs, Vec2u.stackAlloc([numCells], [numCells]))
+			[target]:shareSamplingPattern(grid:getSharedPattern())
+			m.destruct(grid)
+		end
+	elseif patternKind == TargetPatterns.JitteredGrid then
+		return own(patterns.JitteredGridSamplingPattern(Vec2d),
+			mins, maxs, `Vec2u.stackAlloc([numCells], [numCells]), targetPatternSeed)
+	elseif patternKind == TargetPatterns.Halton then
+		return own(patterns.HaltonSamplingPattern(Vec2d),
+			mins, maxs, `[numCells]*[numCells], targetPatternSeed)
+	elseif patternKind == TargetPatterns.PoissonDisk then
+		local PoissonDisk = patterns.PoissonDiskSamplingPattern(Vec2d)
+		local side = `[maxcoord] - [mincoord]
+		return own(PoissonDisk, mins, maxs,
+			`PoissonDisk.radiusFor([side]*[side], [numCells]*[numCells]), targetPatternSeed)
+	elseif patternKind == TargetPatterns.Importance then
+		return quote
+			var points = [Vector(Vec2d)].stackAlloc()
+			buildImportancePattern([image], [mincoord], [maxcoord], [numCells], targetPatternSeed,
+								   &points, [weights])
+			[target]:ownSamplingPattern(&points)
+			m.destruct(points)
+		end
+	else
+		error("loadTargetImage: unknown target pattern " .. tostring(patternKind))
+	end
+end
+
 -- Load up the target image. This only needs to be done once, since
 --    the type of this object is not dependent upon the 'real' type
 -- 'expandFactor' says how much we want to expand the sample grid around the image sample
 --    locations. e.g. a value of 3 will place the actual image at the center of a 3x3 grid of 
 --    sample locations, with the outer 8 blocks having zero values at every sample point.
-local function loadTargetImage(SampledFunctionType, filename, expandFactor)
+-- 'patternKind' (one of TargetPatterns, Grid by default) chooses the sample locations.
+--    Patterns that don't keep every sample inside its own pixel's cell are resampled
+--    from the image bilinearly. Importance patterns come with per-sample weights
+--    ('weights' in the returned table), which mseLikelihoodModule applies.
+local function loadTargetImage(SampledFunctionType, filename, expandFactor, patternKind)
 	expandFactor = expandFactor or 1
+	patternKind = patternKind or TargetPatterns.Grid
+	local interpFn = (patternKind == TargetPatterns.Grid or patternKind == TargetPatterns.Importance)
+					 and SfnOpts.ImageInterpFns.NearestNeighbor() or SfnOpts.ImageInterpFns.Bilinear()
 	local target = m.gc(terralib.new(SampledFunctionType))
+	local weights = (patternKind == TargetPatterns.Importance) and m.gc(terralib.new(Vector(double))) or nil
 	local terra loadTarget(targetFilename: rawstring)
 		target:__construct()
+		[util.optionally(weights, function() return quote m.init(weights) end end)]
 		var image = RGBImage.stackAlloc(im.Format.PNG, targetFilename)
 		var imgWidth = image:width()
 		var imgHeight = image:height()
 		-- For now (for simplicity) we just handle square images
 		if imgWidth ~= imgHeight then util.fatalError("Target image width ~= height\n") end
 		var expandWidth = imgWidth * expandFactor
-		var exandHeight = imgHeight * expandFactor
 		var mincoord = 0.5 - expandFactor*0.5
 		var maxcoord = 0.5 + expandFactor*0.5
-		var grid = ImgGridPattern.stackAlloc(
-			Vec2d.stackAlloc(mincoord),
-			Vec2d.stackAlloc(maxcoord),
-			Vec2u.stackAlloc(expandWidth, exandHeight))
-		target:ownSamplingPattern(grid:getSamplePattern())
-		[SampledFunctionType.loadFromImage(RGBImage)](&target, &image,
+		[setTargetPattern(patternKind, `&target, mincoord, maxcoord, expandWidth, `&image, weights and `&weights)]
+		[SampledFunctionType.loadFromImage(RGBImage, interpFn)](&target, &image,
 			Vec2d.stackAlloc(0.0), Vec2d.stackAlloc(1.0))
-		m.destruct(grid)
 		m.destruct(image)
-		return imgWidth, imgHeight
+		return imgWidth, imgHeight, target:numSamples()
+	end
+	local width, height, numSamples = loadTarget(filename)
+	return
+	{
+		target = target,
+		width = width,
+		height = height,
+		numSamples = numSamples,
+		patternKind = patternKind,
+		weights = weights,
+		-- Grid description (cells per side, and coordinate range)
+		cells = width*expandFactor,
+		mincoord = 0.5 - expandFactor*0.5,
+		maxcoord = 0.5 + expandFactor*0.5
+	}
+end
+
+-- Halve the resolution of a target, averaging 2x2 blocks of samples
+local function downsampleTarget(SampledFunctionType, fineData)
+	local fine = fineData.target
+	local coarse = m.gc(terralib.new(SampledFunctionType))
+	local fineCells = fineData.cells
+	local cells = fineCells / 2
+	local terra downsample()
+		coarse:__construct()
+		var grid = ImgGridPattern.stackAlloc(
+			Vec2d.stackAlloc(fineData.mincoord),
+			Vec2d.stackAlloc(fineData.maxcoord),
+			Vec2u.stackAlloc(cells, cells))
+		coarse:shareSamplingPattern(grid:getSharedPattern())
+		-- (Grid samples are ordered with the last dimension varying fastest)
+		for i=0,cells do
+			for j=0,cells do
+				var f0 = (2*i)*fineCells + 2*j
+				var f1 = f0 + fineCells
+				var color = 0.25*(fine:getSample(f0) + fine:getSample(f0+1) +
+								  fine:getSample(f1) + fine:getSample(f1+1))
+				coarse:setSample(i*cells + j, color)
+			end
+		end
+		m.destruct(grid)
+	end
+	downsample()
+	return
+	{
+		target = coarse,
+		width = fineData.width / 2,
+		height = fineData.height / 2,
+		numSamples = cells*cells,
+		patternKind = TargetPatterns.Grid,
+		cells = cells,
+		mincoord = fineData.mincoord,
+		maxcoord = fineData.maxcoord
+	}
+end
+
+-- Don't build pyramid levels with fewer cells per side than this
+local minPyramidCells = 16
+
+-- Load a target image along with up to numLevels-1 successively halved (box-filtered)
+--    copies of it, for coarse-to-fine scoring (see mseLikelihoodModule).
+-- Stops early if a level would be too small, or has an odd number of cells per side.
+local function loadTargetImagePyramid(SampledFunctionType, filename, numLevels, expandFactor)
+	local full = loadTargetImage(SampledFunctionType, filename, expandFactor)
+	local levels = {full}
+	for k=2,numLevels do
+		local fine = levels[#levels]
+		if fine.cells % 2 ~= 0 or fine.cells/2 < minPyramidCells then break end
+		table.insert(levels, downsampleTarget(SampledFunctionType, fine))
+	end
+	full.levels = levels
+	return full
+end
+
+-- Seed for drawing mini-batches (see makeMiniBatch)
+local miniBatchSeed = 42
+
+-- A stratified random subset of a fraction of the samples of a target, redrawn
+--    whenever inference time changes (i.e. once per iteration, so that every
+--    gradient evaluation within an iteration sees the same subset).
+-- 'generation' counts the draws, so that samplers know when to forget what they
+--    cached about the previous subset (see ImplicitSampler:patternChanged).
+local function makeMiniBatch(targetData, fraction, inferenceTime)
+	local full = targetData.target
+	local TargetType = terralib.typeof(full)
+	local SubsetPattern = patterns.StratifiedSubsetPattern(TargetType.SpaceVec)
+	local size = math.max(1, math.floor(fraction * targetData.numSamples))
+	local pattern = m.gc(terralib.new(SubsetPattern))
+	local target = m.gc(terralib.new(TargetType))
+	local generation = global(uint)
+	local drawTime = global(double)
+	local terra init()
+		pattern:__construct(miniBatchSeed)
+		target:__construct()
+		generation = 0
+		drawTime = -1.0
+	end
+	init()
+	local terra update() : {}
+		if inferenceTime ~= drawTime then
+			drawTime = inferenceTime
+			pattern:draw(full.samplingPattern, size)
+			target:setSamplingPattern(pattern:getSamplePattern())
+			for k=0,size do
+				target:setSample(k, full:getSample(pattern:getSourceIndex(k)))
+			end
+			generation = generation + 1
+		end
+	end
+	return
+	{
+		target = target,
+		update = update,
+		generation = generation
+	}
+end
+
+-- AD primitive which returns 'acc + err', where 'err' is a (precomputed, plain double)
+--    sum of squared errors over a chunk of color values x1..xK, and gives each x_k the
+--    partial derivative g_k. Lets the MSE put one tape node per chunk of color values
+--    on the tape, instead of several nodes per value.
+local errChunkSize = 8
+local val = ad.val
+local accumadj = ad.def.accumadj
+local addErrTerms
+do
+	local K = errChunkSize
+	local acc = symbol(double, "acc")
+	local err = symbol(double, "err")
+	local xs = {}
+	local gs = {}
+	for k=1,K do
+		table.insert(xs, symbol(double, "x"..k))
+		table.insert(gs, symbol(double, "g"..k))
+	end
+	local fwd = terra([acc], [err], [xs], [gs]) : double
+		return [acc] + [err]
+	end
+	addErrTerms = instr.countedPrimitive(ad.def.makePrimitive(fwd, function(...)
+		local v = symbol(ad.num, "v")
+		local args = {}
+		for _,T in ipairs({...}) do table.insert(args, symbol(T)) end
+		return terra([v], [args])
+			accumadj([v], [args[1]](), 1.0)
+			escape
+				for k=1,K do
+					emit quote accumadj([v], [args[2+k]](), val([args[2+K+k]]())) end
+				end
+			end
+		end
+	end))
+end
+
+-- Running sum of squared errors, fed to addErrTerms one chunk at a time
+local struct ErrChain
+{
+	acc: ad.num,
+	err: double,
+	count: uint,
+	xs: ad.num[errChunkSize],
+	gs: double[errChunkSize]
+}
+terra ErrChain:__construct() : {}
+	self.acc = 0.0
+	self.err = 0.0
+	self.count = 0
+end
+terra ErrChain:flush() : {}
+	if self.count == 0 then return end
+	-- Pad the chunk with zero-gradient repeats of its first value
+	for k=self.count,errChunkSize do
+		self.xs[k] = self.xs[0]
+		self.gs[k] = 0.0
+	end
+	escape
+		local xs = {}
+		local gs = {}
+		for k=0,errChunkSize-1 do
+			table.insert(xs, `self.xs[k])
+			table.insert(gs, `self.gs[k])
+		end
+		emit quote self.acc = addErrTerms(self.acc, self.err, [xs], [gs]) end
+	end
+	self.err = 0.0
+	self.count = 0
+end
+-- Add color value 'x' with partial derivative 'g' (its error is added to 'err' separately)
+terra ErrChain:addGradient(x: ad.num, g: double) : {}
+	self.xs[self.count] = x
+	self.gs[self.count] = g
+	self.count = self.count + 1
+	if self.count == errChunkSize then self:flush() end
+end
+util.inline(ErrChain.methods.addGradient)
+-- Add the squared error of 'x' against 't', scaled by 'w'
+terra ErrChain:addWeighted(x: ad.num, t: double, w: double) : {}
+	var d = val(x) - t
+	self.xs[self.count] = x
+	self.gs[self.count] = 2.0*w*d
+	self.err = self.err + w*d*d
+	self.count = self.count + 1
+	if self.count == errChunkSize then self:flush() end
+end
+util.inline(ErrChain.methods.addWeighted)
+m.addConstructors(ErrChain)
+
+local function checkSamePattern(srcPointer, tgtPointer)
+	return quote
+		if [srcPointer].samplingPattern ~= [tgtPointer].samplingPattern and
+		   [srcPointer]:patternFingerprint() ~= [tgtPointer]:patternFingerprint() then
+			util.fatalError("Attempt to compare two sample sets drawn from different sampling patterns.\n")
+		end
+	end
+end
+
+-- Squared errors of 'n' samples stored plane-major (one contiguous array of doubles per
+--    color channel; 'srcPlanes' and 'tgtPlanes' are lists of pointer expressions),
+--    simd.width samples at a time. Errors of samples whose target is zero go into
+--    'accumZero', the rest into 'accumNonZero'.
+local function errCompsPlanes(srcPlanes, tgtPlanes, n, accumZero, accumNonZero)
+	local numChannels = #srcPlanes
+	local W = simd.width
+	local srcs, tgts = {}, {}
+	for c=1,numChannels do
+		table.insert(srcs, symbol(&double, "src"..c))
+		table.insert(tgts, symbol(&double, "tgt"..c))
+	end
+	local function channelSq(i, errv, nzv, zerov, onev)
+		local t = {}
+		for c=1,numChannels do
+			table.insert(t, quote
+				var tv = simd.load([tgts[c]] + [i])
+				var d = simd.load([srcs[c]] + [i]) - tv
+				[errv] = [errv] + d*d
+				[nzv] = [nzv] + terralib.select(tv == [zerov], [zerov], [onev])
+			end)
+		end
+		return t
+	end
+	return quote
+		var [srcs] = [srcPlanes]
+		var [tgts] = [tgtPlanes]
+		var zero = 0.0
+		var one = 1.0
+		var zerov = simd.broadcast(zero)
+		var onev = simd.broadcast(one)
+		var accumZeroV = zerov
+		var accumNonZeroV = zerov
+		var i : uint = 0
+		while i + W <= [n] do
+			var errv = zerov
+			-- Number of nonzero target channels, per sample
+			var nzv = zerov
+			[channelSq(i, errv, nzv, zerov, onev)]
+			var isZero = (nzv == zerov)
+			accumZeroV = accumZeroV + terralib.select(isZero, errv, zerov)
+			accumNonZeroV = accumNonZeroV + terralib.select(isZero, zerov, errv)
+			i = i + W
+		end
+		var zp = [&double](&accumZeroV)
+		var nzp = [&double](&accumNonZeroV)
+		for k=0,W do
+			[accumZero] = [accumZero] + zp[k]
+			[accumNonZero] = [accumNonZero] + nzp[k]
+		end
+		for j=i,[n] do
+			var err = 0.0
+			var isZero = true
+			escape
+				for c=1,numChannels do
+					emit quote
+						var t = [tgts[c]][j]
+						var d = [srcs[c]][j] - t
+						err = err + d*d
+						if t ~= 0.0 then isZero = false end
+					end
+				end
+			end
+			if isZero then
+				[accumZero] = [accumZero] + err
+			else
+				[accumNonZero] = [accumNonZero] + err
+			end
+		end
+	end
+end
+
+-- Error components for AD sample colors. The errors are computed on plain doubles by
+--    errCompsPlanes; the tape only gets their gradients, one addErrTerms node per
+--    errChunkSize color values (with the division by n folded in).
+local mseCompsAD = macro(function(srcPointer, tgtPointer)
+	local numChannels = srcPointer:gettype().type.ColorVec.Dimension
+	local n = symbol(uint, "n")
+	local accumZero = symbol(double, "accumZero")
+	local accumNonZero = symbol(double, "accumNonZero")
+	-- Plain values of the samples (channels 0..numChannels-1) and of the targets
+	local values = symbol(Vector(double)[2*numChannels], "values")
+	local srcPlanes, tgtPlanes = {}, {}
+	for c=0,numChannels-1 do
+		table.insert(srcPlanes, `[values][c]:getPointer(0))
+		table.insert(tgtPlanes, `[values][numChannels+c]:getPointer(0))
+	end
+	return quote
+		[checkSamePattern(srcPointer, tgtPointer)]
+		var [n] = [srcPointer]:numSamples()
+		var [values]
+		for c=0,[2*numChannels] do
+			m.init([values][c])
+			[values][c]:resize([n])
+		end
+		for i=0,[n] do
+			var s = [srcPointer]:getSample(i)
+			var t = [tgtPointer]:getSample(i)
+			escape
+				for c=0,numChannels-1 do
+					emit quote
+						[values][c](i) = val(s.entries[c])
+						[values][numChannels+c](i) = t.entries[c]
+					end
+				end
+			end
+		end
+		var [accumZero] = 0.0
+		var [accumNonZero] = 0.0
+		[errCompsPlanes(srcPlanes, tgtPlanes, n, accumZero, accumNonZero)]
+		-- d(err/n)/dx = 2(x - t)/n
+		var zeroChain = ErrChain.stackAlloc()
+		var nonZeroChain = ErrChain.stackAlloc()
+		zeroChain.err = [accumZero] / [n]
+		nonZeroChain.err = [accumNonZero] / [n]
+		var scale = 2.0 / [n]
+		for i=0,[n] do
+			var s = [srcPointer]:getSample(i)
+			var chain = &zeroChain
+			escape
+				for c=0,numChannels-1 do
+					emit quote if [values][numChannels+c](i) ~= 0.0 then chain = &nonZeroChain end end
+				end
+				for c=0,numChannels-1 do
+					emit quote
+						chain:addGradient(s.entries[c], scale*([values][c](i) - [values][numChannels+c](i)))
+					end
+				end
+			end
+		end
+		zeroChain:flush()
+		nonZeroChain:flush()
+		for c=0,[2*numChannels] do m.destruct([values][c]) end
+		var resultZero = zeroChain.acc
+		var resultNonZero = nonZeroChain.acc
+	in
+		resultZero, resultNonZero
+	end
+end)
+
+-- Error components for double-valued SoA sample sets
+local mseCompsSIMD = macro(function(srcPointer, tgtPointer)
+	local numChannels = srcPointer:gettype().type.ColorVec.Dimension
+	local n = symbol(uint, "n")
+	local accumZero = symbol(double, "accumZero")
+	local accumNonZero = symbol(double, "accumNonZero")
+	local srcPlanes, tgtPlanes = {}, {}
+	for c=0,numChannels-1 do
+		table.insert(srcPlanes, `[srcPointer]:getChannelPlane(c))
+		table.insert(tgtPlanes, `[tgtPointer]:getChannelPlane(c))
+	end
+	return quote
+		[checkSamePattern(srcPointer, tgtPointer)]
+		var [n] = [srcPointer]:numSamples()
+		var [accumZero] = 0.0
+		var [accumNonZero] = 0.0
+		[errCompsPlanes(srcPlanes, tgtPlanes, n, accumZero, accumNonZero)]
+		var resultZero = [accumZero] / [n]
+		var resultNonZero = [accumNonZero] / [n]
+	in
+		resultZero, resultNonZero
 	end
-	local width, height = loadTarget(filename)
-	return {target = target, width = width, height = height}
+end)
+
+-- Which specialized error kernel (if any) handles this pair of sample set types
+local function fastMseKernel(SampledFunctionT1, SampledFunctionT2)
+	local real1 = SampledFunctionT1.ColorVec.RealType
+	local real2 = SampledFunctionT2.ColorVec.RealType
+	if real1 == ad.num and real2 == double then
+		return mseCompsAD
+	elseif real1 == double and real2 == double and
+		   SampledFunctionT1.Layout == SfnOpts.Layouts.SoA() and
+		   SampledFunctionT2.Layout == SfnOpts.Layouts.SoA() then
+		return mseCompsSIMD
+	end
+	return nil
 end
 
 -- Calculate mean squared error between two sample sets
@@ -53,6 +638,14 @@ local mse = macro(function(srcPointer, tgtPointer)
 	local SampledFunctionT1 = srcPointer:gettype().type
 	local SampledFunctionT2 = tgtPointer:gettype().type
 	local accumType = SampledFunctionT1.ColorVec.RealType
+	local kernel = fastMseKernel(SampledFunctionT1, SampledFunctionT2)
+	if kernel then
+		return quote
+			var zeroErr, nonZeroErr = kernel(srcPointer, tgtPointer)
+		in
+			zeroErr + nonZeroErr
+		end
+	end
 	local function makeProcessFn(accum)
 		return macro(function(color1, color2)
 			return quote
@@ -66,17 +659,16 @@ local mse = macro(function(srcPointer, tgtPointer)
 	return quote
 		var accum : accumType = 0.0
 		[SampledFunctionT1.lockstep(SampledFunctionT2, makeProcessFn(accum))](srcPointer, tgtPointer)
-		var result = accum / srcPointer.samples.size
+		var result = accum / srcPointer:numSamples()
 	in
 		result
 	end
 end)
 
 
--- Calculate mean squared error between two sample sets
--- Return the resulting error in two components: the error from target pixels with value 0,
---    and the error from target pixels with value > 0.
-local mseComps = macro(function(srcPointer, tgtPointer)
+-- Error components of any pair of sample set types, visiting the samples in lockstep
+--    (see mseComps)
+local mseCompsLockstep = macro(function(srcPointer, tgtPointer)
 	local SampledFunctionT1 = srcPointer:gettype().type
 	local SampledFunctionT2 = tgtPointer:gettype().type
 	local accumType = SampledFunctionT1.ColorVec.RealType
@@ -96,23 +688,124 @@ local mseComps = macro(function(srcPointer, tgtPointer)
 		var accumZero : accumType = 0.0
 		var accumNonZero : accumType = 0.0
 		[SampledFunctionT1.lockstep(SampledFunctionT2, makeProcessFn(accumZero, accumNonZero))](srcPointer, tgtPointer)
-		var resultZero = accumZero / srcPointer.samples.size
-		var resultNonzero = accumNonZero / srcPointer.samples.size
+		var resultZero = accumZero / srcPointer:numSamples()
+		var resultNonzero = accumNonZero / srcPointer:numSamples()
 	in
 		resultZero, resultNonzero
 	end
 end)
 
+-- Calculate mean squared error between two sample sets
+-- Return the resulting error in two components: the error from target pixels with value 0,
+--    and the error from target pixels with value > 0.
+local mseComps = macro(function(srcPointer, tgtPointer)
+	local SampledFunctionT1 = srcPointer:gettype().type
+	local SampledFunctionT2 = tgtPointer:gettype().type
+	local kernel = fastMseKernel(SampledFunctionT1, SampledFunctionT2)
+	if kernel then
+		return `kernel(srcPointer, tgtPointer)
+	end
+	return `mseCompsLockstep(srcPointer, tgtPointer)
+end)
+
+-- Like mseComps, but every sample's error is scaled by its weight (see
+--    buildImportancePattern), i.e. the result is an importance-weighted estimate of the
+--    error over the region that the samples were drawn from.
+local weightedMseComps = macro(function(srcPointer, tgtPointer, weights)
+	local SampledFunctionT1 = srcPointer:gettype().type
+	local accumType = SampledFunctionT1.ColorVec.RealType
+	local numChannels = SampledFunctionT1.ColorVec.Dimension
+	local accumZero = symbol(accumType, "accumZero")
+	local accumNonZero = symbol(accumType, "accumNonZero")
+	local n = symbol(uint, "n")
+	local accumulate
+	if accumType == ad.num then
+		accumulate = quote
+			var zeroChain = ErrChain.stackAlloc()
+			var nonZeroChain = ErrChain.stackAlloc()
+			for i=0,[n] do
+				var s = [srcPointer]:getSample(i)
+				var t = [tgtPointer]:getSample(i)
+				var w = [weights]:get(i)
+				var chain = &nonZeroChain
+				if t == 0.0 then chain = &zeroChain end
+				escape
+					for c=0,numChannels-1 do
+						emit quote chain:addWeighted(s.entries[c], t.entries[c], w) end
+					end
+				end
+			end
+			zeroChain:flush()
+			nonZeroChain:flush()
+			[accumZero] = zeroChain.acc
+			[accumNonZero] = nonZeroChain.acc
+		end
+	else
+		accumulate = quote
+			for i=0,[n] do
+				var t = [tgtPointer]:getSample(i)
+				var err = [weights]:get(i) * [srcPointer]:getSample(i):distSq(t)
+				if t == 0.0 then
+					[accumZero] = [accumZero] + err
+				else
+					[accumNonZero] = [accumNonZero] + err
+				end
+			end
+		end
+	end
+	return quote
+		[checkSamePattern(srcPointer, tgtPointer)]
+		var [n] = [srcPointer]:numSamples()
+		var [accumZero] = 0.0
+		var [accumNonZero] = 0.0
+		[accumulate]
+		var resultZero = [accumZero] / [n]
+		var resultNonZero = [accumNonZero] / [n]
+	in
+		resultZero, resultNonZero
+	end
+end)
+
 
 -- Likelihood module for calculating MSE with respect to a sampled target function
-local function mseLikelihoodModule(priorModuleWithSampling, targetData, strength, inferenceTime, zeroTargetLLSum, doLocalErrorTempering)
+-- If 'doFusedScoring' is set, AD specializations whose prior renders smoothly render
+--    and score in one fused pass (see ImplicitSampler:setFusedScoring).
+-- If 'miniBatchFraction' is given (and less than 1), each iteration renders and scores
+--    only that fraction of the target's samples (see makeMiniBatch). The MSE over the
+--    subset is an unbiased estimate of the full MSE, so strength needs no adjustment;
+--    the price is noisier likelihoods and gradients. As with annealing, the logprob
+--    cached in the current trace is from the previous iteration's subset.
+-- If 'targetData' is a pyramid (see loadTargetImagePyramid), inference time is split
+--    into equal phases which render and score coarsest level first, finest level last.
+--    Each level's strength is scaled by its share of the full-resolution sample count,
+--    so every sample carries the same weight at any level (which also makes coarse
+--    levels act as a tempered version of the full likelihood).
+-- If 'doIncrementalRendering' is set, non-AD specializations only re-render the parts
+--    of the target whose shapes changed since the previous evaluation (see
+--    ImplicitSampler:setIncremental). The prior's sample function must then clear the
+--    sampled function before every render.
+local function mseLikelihoodModule(priorModuleWithSampling, targetData, strength, inferenceTime, zeroTargetLLSum, doLocalErrorTempering, doFusedScoring, miniBatchFraction, doIncrementalRendering)
 	local target = targetData.target
+	local levels = targetData.levels or {targetData}
+	-- (Shared by all specializations of the likelihood)
+	local batch = nil
+	if miniBatchFraction and miniBatchFraction < 1 then
+		assert(#levels == 1, "Mini-batch likelihoods do not support target pyramids")
+		assert(not targetData.weights, "Mini-batch likelihoods do not support weighted targets")
+		batch = makeMiniBatch(targetData, miniBatchFraction, inferenceTime)
+	end
 	return function()
 		local P = priorModuleWithSampling()
 		local ReturnType = P.prior:gettype().returns[1]
 		local SamplerType = P.sample:gettype().parameters[2].type
 		local SampledFunctionType = SamplerType.SampledFunctionType
 		local SamplingPatternType = P.sample:gettype().parameters[3].type
+		local TargetType = terralib.typeof(target)
+		-- (Fused kernels don't support per-sample weights. Whether a given render
+		--    actually got deferred, and so can be fused, is only known at runtime;
+		--    see ImplicitSampler:canFuseScoring)
+		local fused = doFusedScoring and SamplerType.fusedMseComps ~= nil and P.sample == P.sampleSmooth
+					  and not targetData.weights
 
 		-- The sample set and sampler are 'global' to the inference chain since it
 		--    is wasteful to reconstruct these every iteration.
@@ -120,30 +813,121 @@ local function mseLikelihoodModule(priorModuleWithSampling, targetData, strength
 		--    specialization of the program.
 		local samples = m.gc(terralib.new(SampledFunctionType))
 		local sampler = m.gc(terralib.new(SamplerType))
+		-- The mini-batch draw that 'sampler' last saw
+		local samplerGeneration = global(uint)
 		local terra initSamplerGlobals()
 			samples = SampledFunctionType.stackAlloc()
 			sampler = SamplerType.stackAlloc(&samples)
-
+			samplerGeneration = 0
+			[util.optionally(doIncrementalRendering, function() return quote
+				sampler:setIncremental(true)
+			end end)]
+			-- Keep the AD tape to a few nodes per pixel, rather than one per covering shape
+			[util.optionally(SampledFunctionType.methods.setAggregatedAccumulation ~= nil, function() return quote
+				samples:setAggregatedAccumulation(true)
+			end end)]
+			[util.optionally(fused, function() return quote
+				sampler:setFusedScoring(true)
+			end end)]
 		end
 		initSamplerGlobals()
 
-		local terra likelihood(value: &ReturnType)
-			P.sample(value, &sampler, target.samplingPattern)
-			var zeroWeight = [double](inferenceTime)
-			var l : real
-			[doLocalErrorTempering and
-				quote
-					var zeroErr, nonZeroErr = mseComps(&samples, &target)
-					var zeroLL = -strength*zeroErr
-					var nonZeroLL = -strength*nonZeroErr
+		-- Turn error components into a log likelihood (into 'l')
+		local function errorsToLL(zeroErr, nonZeroErr, strength, l)
+			if doLocalErrorTempering then
+				return quote
+					var zeroLL = -strength*[zeroErr]
+					var nonZeroLL = -strength*[nonZeroErr]
 					zeroTargetLLSum = ad.val(zeroLL)
-					l = nonZeroLL + inferenceTime*zeroLL
+					[l] = nonZeroLL + inferenceTime*zeroLL
 				end
-			or
-				quote
-					l = -strength * mse(&samples, &target)
+			else
+				return quote [l] = -strength * ([zeroErr] + [nonZeroErr]) end
+			end
+		end
+
+		-- Render 'value' at the samples of 'target' and score it (into 'l')
+		-- 'weights' are optional per-sample importance weights.
+		local function renderAndScore(value, target, strength, l, weights)
+			return quote
+				var renderStart = instr.startTimer()
+				P.sample([value], &sampler, target.samplingPattern)
+				instr.stopTimer("renderTime", renderStart)
+				var mseStart = instr.startTimer()
+				[weights and
+					quote
+						var zeroErr, nonZeroErr = weightedMseComps(&samples, &target, &weights)
+						[errorsToLL(zeroErr, nonZeroErr, strength, l)]
+					end
+				or fused and
+					quote
+						var zeroErr : real
+						var nonZeroErr : real
+						if sampler:canFuseScoring() then
+							zeroErr, nonZeroErr = [SamplerType.fusedMseComps(TargetType)](&sampler, &target)
+						else
+							sampler:renderPending()
+							zeroErr, nonZeroErr = mseComps(&samples, &target)
+						end
+						[errorsToLL(zeroErr, nonZeroErr, strength, l)]
+					end
+				or doLocalErrorTempering and
+					quote
+						var zeroErr, nonZeroErr = mseComps(&samples, &target)
+						[errorsToLL(zeroErr, nonZeroErr, strength, l)]
+					end
+				or
+					quote
+						[l] = -strength * mse(&samples, &target)
+					end
+				]
+				instr.stopTimer("mseTime", mseStart)
+			end
+		end
+
+		-- Pick the pyramid level for the current inference time
+		local function renderAndScoreLevels(value, l)
+			local numLevels = #levels
+			local fullSamples = levels[1].cells * levels[1].cells
+			local levelIndex = symbol(int)
+			local stmt = quote end
+			for k=numLevels,1,-1 do
+				local level = levels[k]
+				local levelStrength = strength * (level.cells*level.cells) / fullSamples
+				stmt = quote
+					if [levelIndex] == [k-1] then
+						[renderAndScore(value, level.target, levelStrength, l)]
+					else
+						[stmt]
+					end
 				end
-			]
+			end
+			return quote
+				var [levelIndex] = [int]((1.0 - inferenceTime) * numLevels)
+				if [levelIndex] < 0 then [levelIndex] = 0 end
+				if [levelIndex] > [numLevels-1] then [levelIndex] = [numLevels-1] end
+				[stmt]
+			end
+		end
+
+		-- Draw a new mini-batch if needed, and score against it
+		local function renderAndScoreBatch(value, l)
+			return quote
+				[batch.update]()
+				if samplerGeneration ~= [batch.generation] then
+					sampler:patternChanged()
+					samplerGeneration = [batch.generation]
+				end
+				[renderAndScore(value, batch.target, strength, l)]
+			end
+		end
+
+		local terra likelihood(value: &ReturnType)
+			instr.count("likelihoodCalls")
+			var l : real
+			[batch and renderAndScoreBatch(value, l) or
+			 #levels > 1 and renderAndScoreLevels(value, l) or
+			 renderAndScore(value, target, strength, l, targetData.weights)]
 			return l
 		end
 
@@ -156,11 +940,15 @@ local function mseLikelihoodModule(priorModuleWithSampling, targetData, strength
 end
 
 
-
 return
 {
+	TargetPatterns = TargetPatterns,
 	loadTargetImage = loadTargetImage,
-	mseLikelihoodModule = mseLikelihoodModule
+	loadTargetImagePyramid = loadTargetImagePyramid,
+	mseLikelihoodModule = mseLikelihoodModule,
+	-- (For tests)
+	mseComps = mseComps,
+	mseCompsLockstep = mseCompsLockstep
 }
 
 
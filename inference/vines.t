@@ -17,6 +17,7 @@ local SampledFunction = require("sampledFunction")
 local shapes = require("shapes")
 
 local ImplicitSampler = require("samplers").ImplicitSampler
+local SmoothAlphaFns = require("samplers").SmoothAlphaFns
 
 --------------------------------
 
@@ -51,11 +52,11 @@ local function vinesModule(inferenceTime, doSmoothing)
 		if doSmooth == nil then doSmooth = (real == ad.num) end
 		local Vec2 = Vec(real, 2)
 		local Color1 = Color(real, 1)
-		local SampledFunctionType = SampledFunction(Vec2d, Color1, SfnOpts.ClampFns.None(), SfnOpts.AccumFns.Over())
+		local SampledFunctionType = SampledFunction(Vec2d, Color1, SfnOpts.ClampFns.None(), SfnOpts.AccumFns.Over(), SfnOpts.Layouts.SoA())
 		local ShapeType = shapes.ImplicitShape(Vec2, Color1)
-		local Capsule = shapes.CapsuleImplicitShape(Vec2, Color1)
-		local ColoredShape = shapes.ConstantColorImplicitShape(Vec2, Color1)
-		local Sampler = ImplicitSampler(SampledFunctionType, ShapeType)
+		-- Segments are all capsules, so use their single-node AD isovalue
+		local Sampler = ImplicitSampler(SampledFunctionType, ShapeType, SmoothAlphaFns.Exact(),
+										shapes.CapsuleIsovalueModes.Primitive)
 
 		local RetType = VinesRetType(real)
 		local LineSeg = RetType.LineSeg
@@ -151,9 +152,7 @@ local function vinesModule(inferenceTime, doSmoothing)
 				sampler:clear()
 				for i=0,retval.segs.size do
 					var seg = retval.segs:getPointer(i)
-					var capsule = Capsule.heapAlloc(seg.start, seg.stop, seg.width)
-					var coloredCapsule = ColoredShape.heapAlloc(capsule, Color1.stackAlloc(1.0))
-					sampler:addShape(coloredCapsule)
+					sampler:addCapsule(seg.start, seg.stop, seg.width, Color1.stackAlloc(1.0), 1.0)
 				end
 				[(not smooth) and (`sampler:sampleSharp(pattern)) or (`sampler:sampleSmooth(pattern, retval.smoothParam))]
 			end
@@ -0,0 +1,267 @@
+local util = require("util")
+local ad = require("ad")
+
+local C = terralib.includecstring [[
+#include <stdio.h>
+#include <time.h>
+static inline void atomicAddU64(unsigned long long* ptr, unsigned long long val)
+{
+	__sync_fetch_and_add(ptr, val);
+}
+static inline double wallTime()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+]]
+
+-- Counters and timers describing the work done by likelihood evaluations, kept per
+--    inference iteration and in total.
+-- Instrumentation is compiled out unless enable() is called before the instrumented
+--    code is compiled (i.e. before running inference). Counts are exact when sampling
+--    with multiple threads, at the cost of an atomic add per count.
+-- 'tapeNodes' counts the AD tape nodes recorded while evaluating the program: every
+--    arithmetic operation on ad.num and every application of a primitive wrapped with
+--    countedPrimitive (which all of this repo's primitives are). Nodes recorded by
+--    ad.math functions are not counted.
+local counterNames =
+{
+	"likelihoodCalls",
+	"shapesAdded",
+	"samplesTested",
+	"samplesAccumulated",
+	"expEvals",
+	"tapeNodes"
+}
+-- Wall-clock seconds. 'gradientTime' is the reverse pass over the AD tape (see
+--    markTapeStart), and 'otherTime' the rest of each iteration, i.e. the inference
+--    kernel's own bookkeeping.
+local timerNames =
+{
+	"priorTime",
+	"renderTime",
+	"mseTime",
+	"gradientTime",
+	"otherTime"
+}
+
+local struct Stats {}
+for _,name in ipairs(counterNames) do
+	table.insert(Stats.entries, {field=name, type=uint64})
+end
+for _,name in ipairs(timerNames) do
+	table.insert(Stats.entries, {field=name, type=double})
+end
+
+terra Stats:clear() : {}
+	escape
+		for _,name in ipairs(counterNames) do emit quote self.[name] = 0 end end
+		for _,name in ipairs(timerNames) do emit quote self.[name] = 0.0 end end
+	end
+end
+
+terra Stats:add(other: &Stats) : {}
+	escape
+		for _,entry in ipairs(Stats.entries) do
+			local name = entry.field
+			emit quote self.[name] = self.[name] + other.[name] end
+		end
+	end
+end
+
+local enabled = false
+local iterationStats = global(Stats)
+local totalStats = global(Stats)
+local iterationStart = global(double)
+local gradientStart = global(double)
+local csvFile = global(&C.FILE)
+
+local terra reset() : {}
+	iterationStats:clear()
+	totalStats:clear()
+	iterationStart = C.wallTime()
+	gradientStart = -1.0
+end
+reset()
+csvFile:set(nil)
+
+-- Add n to a counter
+local count = macro(function(name, n)
+	if not enabled then return quote end end
+	name = name:asvalue()
+	n = n or `1
+	return quote
+		C.atomicAddU64([&uint64](&iterationStats.[name]), [n])
+	end
+end)
+
+-- Usage: var t0 = startTimer(); ...; stopTimer("renderTime", t0)
+local startTimer = macro(function()
+	if not enabled then return `0.0 end
+	return `C.wallTime()
+end)
+local stopTimer = macro(function(name, t0)
+	if not enabled then return quote end end
+	name = name:asvalue()
+	return quote
+		iterationStats.[name] = iterationStats.[name] + (C.wallTime() - [t0])
+	end
+end)
+
+-- Wrap an AD primitive (see ad.def.makePrimitive) so that every application of it to
+--    AD arguments counts one tape node
+local function countedPrimitive(prim)
+	return macro(function(...)
+		local args = {...}
+		for _,arg in ipairs(args) do
+			if arg:gettype() == ad.num then
+				return quote count("tapeNodes") in prim([args]) end
+			end
+		end
+		return `prim([args])
+	end)
+end
+
+-- Count the nodes recorded by arithmetic on ad.num, by wrapping its operators
+local adArithmetic = {"__add", "__sub", "__mul", "__div", "__unm"}
+local arithmeticCounted = false
+local function countADArithmetic()
+	if arithmeticCounted then return end
+	arithmeticCounted = true
+	for _,op in ipairs(adArithmetic) do
+		local orig = ad.num.metamethods[op]
+		if orig ~= nil then
+			ad.num.metamethods[op] = macro(function(...)
+				local args = {...}
+				return quote count("tapeNodes") in [orig]([args]) end
+			end)
+		end
+	end
+end
+
+local function enable()
+	enabled = true
+	countADArithmetic()
+	reset()
+end
+
+-- Gradients are computed by the inference kernels, outside of any instrumented code,
+--    so the reverse pass is timed with two identity primitives recorded on the tape:
+--    markTapeStart records one before anything else, so its adjoint runs last, and
+--    markTapeEnd wraps the final result, so its adjoint runs (about) first.
+-- This relies on the reverse pass visiting every node on the tape.
+local terra startGradientTimer() : {}
+	gradientStart = C.wallTime()
+end
+local terra stopGradientTimer() : {}
+	if gradientStart >= 0.0 then
+		iterationStats.gradientTime = iterationStats.gradientTime + (C.wallTime() - gradientStart)
+		gradientStart = -1.0
+	end
+end
+local function makeMarker(onAdjoint)
+	return ad.def.makePrimitive(
+		terra(x: double)
+			return x
+		end,
+		function(T)
+			return terra(v: ad.num, x: T)
+				onAdjoint()
+				ad.def.accumadj(v, x(), 1.0)
+			end
+		end)
+end
+local tapeStartMarker = makeMarker(stopGradientTimer)
+local tapeEndMarker = makeMarker(startGradientTimer)
+
+-- Usage, in a program specialized on 'real':
+--    markTapeStart(real); ...; factor(markTapeEnd(logprob))
+-- (Both do nothing unless instrumentation is enabled and 'real' is ad.num)
+local markTapeStart = macro(function(realType)
+	if not enabled or realType:astype() ~= ad.num then return quote end end
+	return quote
+		var marker = tapeStartMarker([ad.num](0.0))
+	end
+end)
+local markTapeEnd = macro(function(x)
+	if not enabled or x:gettype() ~= ad.num then return x end
+	return `tapeEndMarker(x)
+end)
+
+local terra writeCSVRow(iter: uint) : {}
+	C.fprintf(csvFile, "%u", iter)
+	escape
+		for _,name in ipairs(counterNames) do
+			emit quote C.fprintf(csvFile, ",%llu", iterationStats.[name]) end
+		end
+		for _,name in ipairs(timerNames) do
+			emit quote C.fprintf(csvFile, ",%g", iterationStats.[name]) end
+		end
+	end
+	C.fprintf(csvFile, "\n")
+end
+
+-- Close out the stats for one inference iteration (call once per iteration)
+local terra endIterationImpl(iter: uint) : {}
+	var now = C.wallTime()
+	var measured = iterationStats.priorTime + iterationStats.renderTime + iterationStats.mseTime +
+				   iterationStats.gradientTime
+	var other = (now - iterationStart) - measured
+	if other < 0.0 then other = 0.0 end
+	iterationStats.otherTime = other
+	if csvFile ~= nil then writeCSVRow(iter) end
+	totalStats:add(&iterationStats)
+	iterationStats:clear()
+	iterationStart = now
+end
+local endIteration = macro(function(iter)
+	if not enabled then return quote end end
+	return `endIterationImpl([iter])
+end)
+
+-- Write one CSV row per iteration to 'filename' (until closeCSV is called)
+local terra openCSV(filename: rawstring) : {}
+	csvFile = C.fopen(filename, "w")
+	if csvFile == nil then util.fatalError("Could not open instrumentation CSV file.\n") end
+	C.fprintf(csvFile, "iteration")
+	escape
+		for _,name in ipairs(counterNames) do emit quote C.fprintf(csvFile, [","..name]) end end
+		for _,name in ipairs(timerNames) do emit quote C.fprintf(csvFile, [","..name]) end end
+	end
+	C.fprintf(csvFile, "\n")
+end
+local terra closeCSV() : {}
+	if csvFile ~= nil then
+		C.fclose(csvFile)
+		csvFile = nil
+	end
+end
+
+-- Lua table of all counters and timers, summed over the iterations so far
+local function totals()
+	local stats = totalStats:get()
+	local t = {}
+	for _,name in ipairs(counterNames) do t[name] = tonumber(stats[name]) end
+	for _,name in ipairs(timerNames) do t[name] = stats[name] end
+	return t
+end
+
+
+return
+{
+	enable = enable,
+	reset = reset,
+	count = count,
+	startTimer = startTimer,
+	stopTimer = stopTimer,
+	countedPrimitive = countedPrimitive,
+	markTapeStart = markTapeStart,
+	markTapeEnd = markTapeEnd,
+	endIteration = endIteration,
+	openCSV = openCSV,
+	closeCSV = closeCSV,
+	totals = totals,
+	counterNames = counterNames,
+	timerNames = timerNames
+}
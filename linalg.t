@@ -2,6 +2,7 @@ local templatize = require("templatize")
 local m = require("mem")
 local util = require("util")
 local ad = require("ad")
+local instr = require("instrumentation")
 
 local Vec
 Vec = templatize(function(real, dim)
@@ -407,7 +408,7 @@ function Vec.makeADPrimitive(argTypes, fwdMacro, adjMacro)
 		end
 	end
 	-- Construct an AD primitive
-	local adprim = ad.def.makePrimitive(fwdFn, adjFn, compsPerType)
+	local adprim = instr.countedPrimitive(ad.def.makePrimitive(fwdFn, adjFn, compsPerType))
 	-- Return a wrapper for this AD primitive that unpacks vectors into
 	--    blocks of scalars.
 	return macro(function(...)
@@ -426,6 +427,97 @@ function Vec.makeADPrimitive(argTypes, fwdMacro, adjMacro)
 end
 
 
+-- Batched counterpart of makeADPrimitive, for sums of one function over many points
+--    which share the same parameters (e.g. a shape's isovalue over a row of samples).
+-- 'sharedArgTypes' are the types of the shared parameters, as for makeADPrimitive.
+-- 'fwdGradMacro(point, grads..., shared...)' runs on plain doubles: it returns the
+--    function value at 'point', and stores the partial derivative w.r.t. each shared
+--    parameter into the corresponding 'grads' lvalue (of the same type).
+-- Returns a Lua function batchSum(n, pointFn, shared) which generates an expression for
+--    the sum of the function over the points pointFn(k), k in [0, n). The whole sum is a
+--    single tape node: the partials are summed in registers as the points are visited,
+--    and the reverse pass just applies those sums to the shared parameters.
+function Vec.makeBatchedADPrimitive(sharedArgTypes, fwdGradMacro)
+	-- Scalar components per shared parameter
+	local compsPerType = {}
+	local numComps = 0
+	for _,t in ipairs(sharedArgTypes) do
+		assert(t == double or (t.__generatorTemplate == Vec and t.RealType == double))
+		local comps = (t == double) and 1 or t.Dimension
+		table.insert(compsPerType, comps)
+		numComps = numComps + comps
+	end
+	local function entries(exp, i)
+		if sharedArgTypes[i] == double then return {exp} end
+		local t = {}
+		for c=0,compsPerType[i]-1 do table.insert(t, `[exp].entries[c]) end
+		return t
+	end
+	-- AD primitive which passes 'y' through, with precomputed partials g_j w.r.t. p_j
+	local y = symbol(double, "y")
+	local ps = {}
+	local gs = {}
+	for j=1,numComps do
+		table.insert(ps, symbol(double, "p"..j))
+		table.insert(gs, symbol(double, "g"..j))
+	end
+	local terra linearFwd([y], [ps], [gs])
+		return [y]
+	end
+	local linear = instr.countedPrimitive(ad.def.makePrimitive(linearFwd, function(...)
+		local v = symbol(ad.num, "v")
+		local args = {}
+		for _,T in ipairs({...}) do table.insert(args, symbol(T)) end
+		return terra([v], [args])
+			escape
+				for j=1,numComps do
+					emit quote ad.def.accumadj([v], [args[1+j]](), ad.val([args[1+numComps+j]]())) end
+				end
+			end
+		end
+	end))
+	return function(n, pointFn, shared)
+		assert(#shared == #sharedArgTypes)
+		local k = symbol(uint, "k")
+		local vals = {}
+		local grads = {}
+		local gradSums = {}
+		local decls = {}
+		local gradDecls = {}
+		local accums = {}
+		local sharedEntries = {}
+		local gradSumEntries = {}
+		for i,T in ipairs(sharedArgTypes) do
+			local valSym = symbol(T, "sharedVal")
+			local gradSym = symbol(T, "grad")
+			local gradSumSym = symbol(T, "gradSum")
+			table.insert(vals, valSym)
+			table.insert(grads, gradSym)
+			local zero = (T == double) and `0.0 or `T.stackAlloc(0.0)
+			table.insert(decls, quote
+				var [valSym] = ad.val([shared[i]])
+				var [gradSumSym] = [zero]
+			end)
+			table.insert(gradDecls, quote var [gradSym] : T end)
+			table.insert(accums, quote [gradSumSym] = [gradSumSym] + [gradSym] end)
+			sharedEntries = util.concattables(sharedEntries, entries(shared[i], i))
+			gradSumEntries = util.concattables(gradSumEntries, entries(gradSumSym, i))
+		end
+		return quote
+			[decls]
+			var sum = 0.0
+			for [k]=0,[n] do
+				[gradDecls]
+				sum = sum + fwdGradMacro([pointFn(k)], [grads], [vals])
+				[accums]
+			end
+		in
+			linear(sum, [sharedEntries], [gradSumEntries])
+		end
+	end
+end
+
+
 return
 {
 	Vec = Vec
@@ -5,6 +5,42 @@ local Vec = require("linalg").Vec
 local Vector = require("vector")
 local util = require("util")
 
+local C = terralib.includecstring [[
+#include <math.h>
+#include <string.h>
+]]
+
+
+-- Small, fast, seedable random number generator (xorshift64*), so that randomized
+--    patterns are reproducible and independent of any other random stream.
+local struct Random
+{
+	state: uint64
+}
+
+terra Random:__construct(seed: uint64) : {}
+	-- (State must be nonzero)
+	self.state = seed ^ [uint64](0x9E3779B97F4A7C15ULL)
+	if self.state == 0 then self.state = 1 end
+end
+
+terra Random:next() : uint64
+	var x = self.state
+	x = x ^ (x >> 12)
+	x = x ^ (x << 25)
+	x = x ^ (x >> 27)
+	self.state = x
+	return x * [uint64](2685821657736338717ULL)
+end
+
+-- Uniform in [0, 1)
+terra Random:uniform() : double
+	return (self:next() >> 11) * (1.0 / 9007199254740992.0)
+end
+util.inline(Random.methods.uniform)
+
+m.addConstructors(Random)
+
 
 local SamplingPattern = templatize(function(SpaceVec)
 
@@ -24,46 +60,314 @@ local SamplingPattern = templatize(function(SpaceVec)
 end)
 
 
-local RegularGridSamplingPattern = templatize(function(SpaceVec)
+-- Description of a regular grid of samples placed at cell centroids, with the
+--    last dimension varying fastest (i.e. the order in which RegularGridSamplingPattern
+--    generates its samples). Lets consumers of a sample pattern map a region of space
+--    to a range of sample indices instead of visiting every sample.
+local RegularGrid = templatize(function(SpaceVec)
 
-	local CellVec = Vec(uint, SpaceVec.Dimension)
+	assert(SpaceVec.__generatorTemplate == Vec)
+
+	local real = SpaceVec.RealType
+	local dim = SpaceVec.Dimension
+	local CellVec = Vec(uint, dim)
 	local SamplePattern = Vector(SpaceVec)
-	local SamplingPatternT = SamplingPattern(SpaceVec)
 
-	local struct RegularGridSamplingPatternT
+	local struct RegularGridT
 	{
-		storedPattern: SamplePattern
+		mins: SpaceVec,
+		maxs: SpaceVec,
+		numCells: CellVec
 	}
-	inheritance.dynamicExtend(SamplingPatternT, RegularGridSamplingPatternT)
+	RegularGridT.SpaceVec = SpaceVec
+	RegularGridT.CellVec = CellVec
+
+	terra RegularGridT:__construct(mins: SpaceVec, maxs: SpaceVec, numCells: CellVec) : {}
+		self.mins = mins
+		self.maxs = maxs
+		self.numCells = numCells
+	end
+
+	terra RegularGridT:__construct() : {}
+		self:__construct(SpaceVec.stackAlloc(0.0), SpaceVec.stackAlloc(1.0), CellVec.stackAlloc(0))
+	end
+
+	terra RegularGridT:numSamples() : uint
+		var n = [uint](1)
+		for d=0,dim do n = n * self.numCells.entries[d] end
+		return n
+	end
+	util.inline(RegularGridT.methods.numSamples)
 
-	-- Build code to generate list of grid samples using a cartesian product recursion.
-	-- Variadic args are coordinates (symbols) for the dimension up to the one we're currently looping over.
-	local function buildGridLoop(mins, maxs, numCells, samplePoints, ...)
-		local whichDim = select("#",...)
-		local coords = {...}
-		local function loopBody(coord)
-			local newcoords = util.copytable(coords)
-			table.insert(newcoords, coord)
-			-- Base case: we're at the last dimension
-			if whichDim == SpaceVec.Dimension-1 then
-				return `[samplePoints]:push(SpaceVec.stackAlloc([newcoords]))
-			-- Recursive case: generate another loop
+	-- Conservative range [lo, hi) of cells whose centroids may lie inside the box
+	--    (bmins, bmaxs). The range is padded by one cell on either side to absorb
+	--    rounding differences, so callers should still do an exact containment test.
+	terra RegularGridT:cellRange(bmins: SpaceVec, bmaxs: SpaceVec) : {CellVec, CellVec}
+		var lo : CellVec
+		var hi : CellVec
+		for d=0,dim do
+			var n = self.numCells.entries[d]
+			var h = (self.maxs.entries[d] - self.mins.entries[d]) / n
+			if n <= 1 or not (h > 0.0) then
+				lo.entries[d] = 0
+				hi.entries[d] = n
 			else
-				return buildGridLoop(mins, maxs, numCells, samplePoints, unpack(newcoords))
+				var flo = C.floor((bmins.entries[d] - self.mins.entries[d])/h - 0.5)
+				var fhi = C.floor((bmaxs.entries[d] - self.mins.entries[d])/h - 0.5) + 2.0
+				-- Clamp in floating point first, since the box may be unbounded
+				lo.entries[d] = [uint](C.fmin(C.fmax(flo, 0.0), [double](n)))
+				hi.entries[d] = [uint](C.fmin(C.fmax(fhi, 0.0), [double](n)))
+			end
+		end
+		return lo, hi
+	end
+
+	-- Generate a loop nest over every sample index in the cell range [lo, hi).
+	-- 'bodyFn' is called with a symbol holding the current sample index.
+	function RegularGridT.foreachIndexInRange(grid, lo, hi, bodyFn)
+		local function buildLoop(whichDim, baseIndex)
+			local index = symbol(uint, "index")
+			local body = (whichDim == dim-1) and bodyFn(index) or buildLoop(whichDim+1, index)
+			return quote
+				for c=[lo].entries[whichDim],[hi].entries[whichDim] do
+					var [index] = [baseIndex]*[grid].numCells.entries[whichDim] + c
+					[body]
+				end
+			end
+		end
+		return buildLoop(0, `[uint](0))
+	end
+
+	-- Coordinate of the centroid of cell c along dimension d
+	local function cellCoord(grid, d, c)
+		return quote
+			var t = ([c]+0.5)/[grid].numCells.entries[d]
+		in
+			(1.0-t)*[grid].mins.entries[d] + t*[grid].maxs.entries[d]
+		end
+	end
+
+	-- Like foreachIndexInRange, but 'bodyFn' is also called with a symbol holding the
+	--    sample's location. Coordinates are computed on the fly, one dimension per loop
+	--    level.
+	function RegularGridT.foreachSampleInRange(grid, lo, hi, bodyFn)
+		local point = symbol(SpaceVec, "point")
+		local function buildLoop(whichDim, baseIndex)
+			local index = symbol(uint, "index")
+			local body = (whichDim == dim-1) and bodyFn(index, point) or buildLoop(whichDim+1, index)
+			return quote
+				for c=[lo].entries[whichDim],[hi].entries[whichDim] do
+					var [index] = [baseIndex]*[grid].numCells.entries[whichDim] + c
+					[point].entries[whichDim] = [cellCoord(grid, whichDim, c)]
+					[body]
+				end
 			end
 		end
 		return quote
-			for i=0,[numCells].entries[whichDim] do
-				var t = (i+0.5)/[numCells].entries[whichDim]  -- Samples at grid cell centroids
-				var coord = (1.0-t)*[mins].entries[whichDim] + t*[maxs].entries[whichDim]
-				[loopBody(coord)]
+			var [point]
+			[buildLoop(0, `[uint](0))]
+		end
+	end
+
+	-- Coordinate of the centroid of cell c along dimension d (identical to the
+	--    coordinates of the stored samples of a RegularGridSamplingPattern)
+	terra RegularGridT:cellCenter(d: uint, c: uint) : real
+		return [cellCoord(self, d, c)]
+	end
+
+	-- Check whether 'pattern' is laid out as a regular grid of cell centroids and,
+	--    if so, store its description in self.
+	terra RegularGridT:detect(pattern: &SamplePattern) : bool
+		var N = pattern.size
+		if N == 0 then return false end
+		var p0 = pattern:get(0)
+		-- Recover the number of cells along each dimension, innermost first
+		var stride = [uint](1)
+		for dd=0,dim do
+			var d = dim-1-dd
+			var n = [uint](1)
+			while n*stride < N and
+				  pattern:get(n*stride).entries[d] > pattern:get((n-1)*stride).entries[d] do
+				n = n + 1
+			end
+			var h = 1.0
+			if n > 1 then
+				h = (pattern:get((n-1)*stride).entries[d] - p0.entries[d]) / (n-1)
+			end
+			self.numCells.entries[d] = n
+			self.mins.entries[d] = p0.entries[d] - 0.5*h
+			self.maxs.entries[d] = self.mins.entries[d] + n*h
+			stride = stride * n
+		end
+		if stride ~= N then return false end
+		-- Verify that every sample sits (close to) where the grid says it should
+		var cellSize = (self.maxs - self.mins) / [SpaceVec](self.numCells)
+		for i=0,N do
+			var p = pattern:getPointer(i)
+			var rem = i
+			for dd=0,dim do
+				var d = dim-1-dd
+				var n = self.numCells.entries[d]
+				var c = rem % n
+				rem = rem / n
+				var expected = self.mins.entries[d] + (c+0.5)*cellSize.entries[d]
+				if C.fabs(p.entries[d] - expected) > 0.25*cellSize.entries[d] then
+					return false
+				end
 			end
 		end
+		return true
 	end
 
+	m.addConstructors(RegularGridT)
+	return RegularGridT
+
+end)
+
+
+-- Immutable, reference-counted sample pattern. Shared patterns are interned by content
+--    (per process, per SpaceVec type), so equal patterns are stored only once, and
+--    everyone who interns an equal pattern gets the same object.
+-- The samples must not be modified once shared.
+local SharedSamplePattern = templatize(function(SpaceVec)
+
+	assert(SpaceVec.__generatorTemplate == Vec)
+
+	local SamplePattern = Vector(SpaceVec)
+	local RegularGridT = RegularGrid(SpaceVec)
+
+	local struct SharedSamplePatternT
+	{
+		samples: SamplePattern,
+		fingerprint: uint64,
+		refCount: uint,
+		-- Set if the samples were generated from this grid (see findGrid)
+		hasGrid: bool,
+		grid: RegularGridT
+	}
+	SharedSamplePatternT.SpaceVec = SpaceVec
+
+	-- All live shared patterns of this type
+	local registry = global(Vector(&SharedSamplePatternT))
+	local terra initRegistry() m.init(registry) end
+	initRegistry()
+
+	-- 64-bit FNV-1a hash of the sample count and the raw sample data
+	terra SharedSamplePatternT.methods.fingerprintOf(pattern: &SamplePattern) : uint64
+		var h = [uint64](14695981039346656037ULL)
+		var prime = [uint64](1099511628211ULL)
+		h = (h ^ [uint64](pattern.size)) * prime
+		var bytes = [&uint8](pattern:getPointer(0))
+		for i=0,pattern.size*sizeof(SpaceVec) do
+			h = (h ^ [uint64](bytes[i])) * prime
+		end
+		return h
+	end
+
+	terra SharedSamplePatternT:__construct(pattern: &SamplePattern) : {}
+		self.samples = m.copy(@pattern)
+		self.fingerprint = SharedSamplePatternT.fingerprintOf(pattern)
+		self.refCount = 1
+		self.hasGrid = false
+	end
+
+	terra SharedSamplePatternT:__destruct() : {}
+		m.destruct(self.samples)
+	end
+
+	terra SharedSamplePatternT:acquire() : &SharedSamplePatternT
+		self.refCount = self.refCount + 1
+		return self
+	end
+
+	terra SharedSamplePatternT:release() : {}
+		self.refCount = self.refCount - 1
+		if self.refCount == 0 then
+			for i=0,registry.size do
+				if registry(i) == self then
+					registry(i) = registry(registry.size-1)
+					registry:resize(registry.size-1)
+					break
+				end
+			end
+			m.delete(self)
+		end
+	end
+
+	-- Get the shared pattern with the same contents as 'pattern' (creating it if needed),
+	--    with one more reference that the caller owns.
+	terra SharedSamplePatternT.methods.intern(pattern: &SamplePattern) : &SharedSamplePatternT
+		-- Already shared storage?
+		for i=0,registry.size do
+			if &registry(i).samples == pattern then return registry(i):acquire() end
+		end
+		var fingerprint = SharedSamplePatternT.fingerprintOf(pattern)
+		for i=0,registry.size do
+			var shared = registry(i)
+			if shared.fingerprint == fingerprint and shared.samples.size == pattern.size and
+			   C.memcmp(shared.samples:getPointer(0), pattern:getPointer(0),
+			   			pattern.size*sizeof(SpaceVec)) == 0 then
+				return shared:acquire()
+			end
+		end
+		var shared = SharedSamplePatternT.heapAlloc(pattern)
+		registry:push(shared)
+		return shared
+	end
+
+	-- The shared pattern whose samples are stored at 'pattern', if any (without taking
+	--    a reference), for users who were handed a shared pattern's sample Vector
+	terra SharedSamplePatternT.methods.findStorage(pattern: &SamplePattern) : &SharedSamplePatternT
+		for i=0,registry.size do
+			if &registry(i).samples == pattern then return registry(i) end
+		end
+		return nil
+	end
+
+	-- Find the shared pattern generated from an identical grid, if any (with one more
+	--    reference that the caller owns), so that grids can skip generating their samples.
+	terra SharedSamplePatternT.methods.findGrid(grid: &RegularGridT) : &SharedSamplePatternT
+		for i=0,registry.size do
+			var shared = registry(i)
+			if shared.hasGrid and shared.grid.mins == grid.mins and shared.grid.maxs == grid.maxs and
+			   shared.grid.numCells == grid.numCells then
+				return shared:acquire()
+			end
+		end
+		return nil
+	end
+
+	terra SharedSamplePatternT:setGrid(grid: &RegularGridT) : {}
+		self.hasGrid = true
+		self.grid = @grid
+	end
+
+	m.addConstructors(SharedSamplePatternT)
+	return SharedSamplePatternT
+
+end)
+
+
+local RegularGridSamplingPattern = templatize(function(SpaceVec)
+
+	local CellVec = Vec(uint, SpaceVec.Dimension)
+	local SamplePattern = Vector(SpaceVec)
+	local SamplingPatternT = SamplingPattern(SpaceVec)
+	local RegularGridT = RegularGrid(SpaceVec)
+	local SharedSamplePatternT = SharedSamplePattern(SpaceVec)
+
+	-- Sample locations are implicit in the grid, and only stored when someone asks for
+	--    the whole pattern (see materialize). Identical grids share one stored copy.
+	local struct RegularGridSamplingPatternT
+	{
+		grid: RegularGridT,
+		shared: &SharedSamplePatternT
+	}
+	inheritance.dynamicExtend(SamplingPatternT, RegularGridSamplingPatternT)
+
 	terra RegularGridSamplingPatternT:__construct(mins: SpaceVec, maxs: SpaceVec, numCells: CellVec) : {}
-		m.init(self.storedPattern)
-		[buildGridLoop(mins, maxs, numCells, `self.storedPattern)]
+		self.grid = RegularGridT.stackAlloc(mins, maxs, numCells)
+		self.shared = nil
 	end
 
 	-- Without mins and maxs, builds a unit cube
@@ -71,24 +375,444 @@ local RegularGridSamplingPattern = templatize(function(SpaceVec)
 		self:__construct(SpaceVec.stackAlloc(0.0), SpaceVec.stackAlloc(1.0), numCells)
 	end
 
+	terra RegularGridSamplingPatternT:__copy(other: &RegularGridSamplingPatternT) : {}
+		self.grid = other.grid
+		self.shared = nil
+		if other.shared ~= nil then self.shared = other.shared:acquire() end
+	end
+
 	terra RegularGridSamplingPatternT:__destruct() : {}
-		m.destruct(self.storedPattern)
+		if self.shared ~= nil then self.shared:release() end
 	end
 	inheritance.virtual(RegularGridSamplingPatternT, "__destruct")
 
+	-- Store the samples (or find an identical grid that already has)
+	terra RegularGridSamplingPatternT:materialize() : {}
+		if self.shared ~= nil then return end
+		self.shared = SharedSamplePatternT.findGrid(&self.grid)
+		if self.shared == nil then
+			var samples = SamplePattern.stackAlloc()
+			samples:resize(self.grid:numSamples())
+			var lo = CellVec.stackAlloc(0)
+			var hi = self.grid.numCells
+			[RegularGridT.foreachSampleInRange(`self.grid, lo, hi, function(index, point)
+				return quote samples:set([index], [point]) end
+			end)]
+			self.shared = SharedSamplePatternT.intern(&samples)
+			self.shared:setGrid(&self.grid)
+			m.destruct(samples)
+		end
+	end
+
 	terra RegularGridSamplingPatternT:getSamplePattern() : &SamplePattern
-		return &self.storedPattern
+		self:materialize()
+		return &self.shared.samples
 	end
 	inheritance.virtual(RegularGridSamplingPatternT, "getSamplePattern")
 
+	terra RegularGridSamplingPatternT:getSharedPattern() : &SharedSamplePatternT
+		self:materialize()
+		return self.shared
+	end
+
+	terra RegularGridSamplingPatternT:getGrid() : &RegularGridT
+		return &self.grid
+	end
+
 	m.addConstructors(RegularGridSamplingPatternT)
 	return RegularGridSamplingPatternT
 
 end)
 
 
+-- A random subset of the samples of another pattern, for estimating sums/means over
+--    the full pattern from a fraction of its samples. Subsets are stratified: the
+--    source indices are split into equal contiguous ranges (i.e. runs of rows, for
+--    grids) and one sample is drawn uniformly from each range.
+-- The samples change on every draw, so consumers that cache structure derived from
+--    a pattern must be told when that happens.
+local StratifiedSubsetPattern = templatize(function(SpaceVec)
+
+	local SamplePattern = Vector(SpaceVec)
+	local SamplingPatternT = SamplingPattern(SpaceVec)
+
+	local struct StratifiedSubsetPatternT
+	{
+		samples: SamplePattern,
+		-- Index into the source pattern of every subset sample
+		indices: Vector(uint),
+		random: Random
+	}
+	inheritance.dynamicExtend(SamplingPatternT, StratifiedSubsetPatternT)
+
+	terra StratifiedSubsetPatternT:__construct(seed: uint64) : {}
+		m.init(self.samples)
+		m.init(self.indices)
+		self.random = Random.stackAlloc(seed)
+	end
+
+	terra StratifiedSubsetPatternT:__construct() : {}
+		self:__construct(1)
+	end
+
+	terra StratifiedSubsetPatternT:__copy(other: &StratifiedSubsetPatternT) : {}
+		self.samples = m.copy(other.samples)
+		self.indices = m.copy(other.indices)
+		self.random = other.random
+	end
+
+	terra StratifiedSubsetPatternT:__destruct() : {}
+		m.destruct(self.samples)
+		m.destruct(self.indices)
+	end
+	inheritance.virtual(StratifiedSubsetPatternT, "__destruct")
+
+	-- Draw a new subset of (at most) n samples of 'source'
+	terra StratifiedSubsetPatternT:draw(source: &SamplePattern, n: uint) : {}
+		var N = [uint64](source.size)
+		if n > N then n = N end
+		self.samples:resize(n)
+		self.indices:resize(n)
+		for k=0,n do
+			var lo = (k*N) / n
+			var hi = ((k+1)*N) / n
+			var index = [uint](lo + self.random:next() % (hi - lo))
+			self.indices(k) = index
+			self.samples(k) = source(index)
+		end
+	end
+
+	terra StratifiedSubsetPatternT:getSamplePattern() : &SamplePattern
+		return &self.samples
+	end
+	inheritance.virtual(StratifiedSubsetPatternT, "getSamplePattern")
+
+	terra StratifiedSubsetPatternT:getSourceIndex(k: uint) : uint
+		return self.indices(k)
+	end
+	util.inline(StratifiedSubsetPatternT.methods.getSourceIndex)
+
+	m.addConstructors(StratifiedSubsetPatternT)
+	return StratifiedSubsetPatternT
+
+end)
+
+
+-- One sample per cell of a regular grid, placed uniformly at random within its cell
+--    (in the same order as RegularGridSamplingPattern). Keeps the grid's even coverage
+--    while breaking up the aliasing of samples that all sit at cell centroids.
+local JitteredGridSamplingPattern = templatize(function(SpaceVec)
+
+	local dim = SpaceVec.Dimension
+	local CellVec = Vec(uint, dim)
+	local SamplePattern = Vector(SpaceVec)
+	local SamplingPatternT = SamplingPattern(SpaceVec)
+	local RegularGridT = RegularGrid(SpaceVec)
+
+	local struct JitteredGridSamplingPatternT
+	{
+		grid: RegularGridT,
+		samples: SamplePattern
+	}
+	inheritance.dynamicExtend(SamplingPatternT, JitteredGridSamplingPatternT)
+
+	terra JitteredGridSamplingPatternT:__construct(mins: SpaceVec, maxs: SpaceVec, numCells: CellVec,
+												   seed: uint64) : {}
+		self.grid = RegularGridT.stackAlloc(mins, maxs, numCells)
+		m.init(self.samples)
+		var random = Random.stackAlloc(seed)
+		var cellSize = (maxs - mins) / [SpaceVec](numCells)
+		self.samples:resize(self.grid:numSamples())
+		for i=0,self.samples.size do
+			var p : SpaceVec
+			var rem = i
+			for dd=0,dim do
+				var d = dim-1-dd
+				var n = numCells.entries[d]
+				p.entries[d] = mins.entries[d] + ((rem % n) + random:uniform())*cellSize.entries[d]
+				rem = rem / n
+			end
+			self.samples(i) = p
+		end
+	end
+
+	terra JitteredGridSamplingPatternT:__construct(mins: SpaceVec, maxs: SpaceVec, numCells: CellVec) : {}
+		self:__construct(mins, maxs, numCells, 1)
+	end
+
+	terra JitteredGridSamplingPatternT:__copy(other: &JitteredGridSamplingPatternT) : {}
+		self.grid = other.grid
+		self.samples = m.copy(other.samples)
+	end
+
+	terra JitteredGridSamplingPatternT:__destruct() : {}
+		m.destruct(self.samples)
+	end
+	inheritance.virtual(JitteredGridSamplingPatternT, "__destruct")
+
+	terra JitteredGridSamplingPatternT:getSamplePattern() : &SamplePattern
+		return &self.samples
+	end
+	inheritance.virtual(JitteredGridSamplingPatternT, "getSamplePattern")
+
+	m.addConstructors(JitteredGridSamplingPatternT)
+	return JitteredGridSamplingPatternT
+
+end)
+
+
+-- Low-discrepancy samples from the Halton sequence (one prime base per dimension),
+--    mapped onto the box [mins, maxs]. The seed picks a random toroidal shift of the
+--    unit cube (a Cranley-Patterson rotation), so that different seeds give different,
+--    equally well-distributed patterns; seed 0 gives the plain sequence.
+local HaltonSamplingPattern = templatize(function(SpaceVec)
+
+	local dim = SpaceVec.Dimension
+	local SamplePattern = Vector(SpaceVec)
+	local SamplingPatternT = SamplingPattern(SpaceVec)
+
+	local primes = {2, 3, 5, 7, 11, 13, 17, 19}
+	assert(dim <= #primes)
+
+	-- Van der Corput radical inverse of i in the given base
+	local terra radicalInverse(i: uint64, base: uint64) : double
+		var invBase = 1.0 / base
+		var f = invBase
+		var r = 0.0
+		while i > 0 do
+			r = r + f*(i % base)
+			i = i / base
+			f = f*invBase
+		end
+		return r
+	end
+
+	local struct HaltonSamplingPatternT
+	{
+		samples: SamplePattern
+	}
+	inheritance.dynamicExtend(SamplingPatternT, HaltonSamplingPatternT)
+
+	terra HaltonSamplingPatternT:__construct(mins: SpaceVec, maxs: SpaceVec, numSamples: uint,
+											 seed: uint64) : {}
+		m.init(self.samples)
+		var shift : double[dim]
+		var random = Random.stackAlloc(seed)
+		for d=0,dim do
+			shift[d] = 0.0
+			if seed ~= 0 then shift[d] = random:uniform() end
+		end
+		self.samples:resize(numSamples)
+		for i=0,numSamples do
+			var p : SpaceVec
+			escape
+				for d=0,dim-1 do
+					emit quote
+						-- (Skip index 0, which is the origin in every dimension)
+						var t = radicalInverse(i+1, [primes[d+1]]) + shift[d]
+						if t >= 1.0 then t = t - 1.0 end
+						p.entries[d] = (1.0-t)*mins.entries[d] + t*maxs.entries[d]
+					end
+				end
+			end
+			self.samples(i) = p
+		end
+	end
+
+	terra HaltonSamplingPatternT:__construct(mins: SpaceVec, maxs: SpaceVec, numSamples: uint) : {}
+		self:__construct(mins, maxs, numSamples, 1)
+	end
+
+	terra HaltonSamplingPatternT:__copy(other: &HaltonSamplingPatternT) : {}
+		self.samples = m.copy(other.samples)
+	end
+
+	terra HaltonSamplingPatternT:__destruct() : {}
+		m.destruct(self.samples)
+	end
+	inheritance.virtual(HaltonSamplingPatternT, "__destruct")
+
+	terra HaltonSamplingPatternT:getSamplePattern() : &SamplePattern
+		return &self.samples
+	end
+	inheritance.virtual(HaltonSamplingPatternT, "getSamplePattern")
+
+	m.addConstructors(HaltonSamplingPatternT)
+	return HaltonSamplingPatternT
+
+end)
+
+
+-- Blue-noise samples: no two samples are closer than 'radius', and no gap is large
+--    enough to fit another one (Poisson-disk sampling, built with Bridson's algorithm).
+-- The number of samples is determined by the radius; see PoissonDiskSamplingPattern.radiusFor.
+local PoissonDiskSamplingPattern = templatize(function(SpaceVec)
+
+	local dim = SpaceVec.Dimension
+	local SamplePattern = Vector(SpaceVec)
+	local SamplingPatternT = SamplingPattern(SpaceVec)
+
+	-- Candidates tried around each sample before it is retired
+	local numCandidates = 30
+	-- Background grid cells are small enough to hold at most one sample, so samples
+	--    within 'radius' of a point lie at most this many cells away from it
+	local cellReach = math.ceil(math.sqrt(dim))
+	local neighborhoodWidth = 2*cellReach+1
+	local neighborhoodSize = 1
+	for d=1,dim do neighborhoodSize = neighborhoodSize*neighborhoodWidth end
+
+	-- Background grid cell containing point p
+	local function cellOf(p, mins, cellSize, gridDims)
+		return quote
+			var c : int[dim]
+			for d=0,dim do
+				c[d] = [int](([p].entries[d] - [mins].entries[d]) / [cellSize])
+				if c[d] >= [gridDims][d] then c[d] = [gridDims][d]-1 end
+			end
+		in
+			c
+		end
+	end
+	local function cellIndex(c, gridDims)
+		return quote
+			var index = 0
+			for d=0,dim do index = index*[gridDims][d] + [c][d] end
+		in
+			index
+		end
+	end
+
+	local struct PoissonDiskSamplingPatternT
+	{
+		samples: SamplePattern
+	}
+	inheritance.dynamicExtend(SamplingPatternT, PoissonDiskSamplingPatternT)
+
+	-- Radius which yields roughly numSamples samples in a box of the given volume.
+	-- (Bridson's algorithm fills about 65% of the densest possible packing.)
+	local packingDensity = (dim == 1 and 1.0) or (dim == 2 and 0.75) or 0.6
+	terra PoissonDiskSamplingPatternT.methods.radiusFor(volume: double, numSamples: uint) : double
+		return C.pow(packingDensity * volume / numSamples, 1.0/dim)
+	end
+
+	terra PoissonDiskSamplingPatternT:__construct(mins: SpaceVec, maxs: SpaceVec, radius: double,
+												  seed: uint64) : {}
+		m.init(self.samples)
+		var random = Random.stackAlloc(seed)
+		var extent = maxs - mins
+		var cellSize = radius / C.sqrt(dim)
+		var gridDims : int[dim]
+		var numCells = 1
+		for d=0,dim do
+			gridDims[d] = [int](C.ceil(extent.entries[d] / cellSize))
+			if gridDims[d] < 1 then gridDims[d] = 1 end
+			numCells = numCells * gridDims[d]
+		end
+		-- Index of the sample in each cell (or -1), with the last dimension fastest
+		var cells = [Vector(int)].stackAlloc()
+		cells:resize(numCells)
+		for i=0,numCells do cells(i) = -1 end
+		var active = [Vector(uint)].stackAlloc()
+
+		-- First sample anywhere in the box
+		var p0 : SpaceVec
+		for d=0,dim do p0.entries[d] = mins.entries[d] + random:uniform()*extent.entries[d] end
+		self.samples:push(p0)
+		active:push(0)
+		var c0 = [cellOf(p0, mins, cellSize, gridDims)]
+		cells([cellIndex(c0, gridDims)]) = 0
+
+		var rSq = radius*radius
+		while active.size > 0 do
+			var a = [uint](random:next() % active.size)
+			var center = self.samples(active(a))
+			var found = false
+			for k=0,numCandidates do
+				-- Uniform-ish candidate in the shell between radius and 2*radius
+				var offset : SpaceVec
+				var distSq = 0.0
+				repeat
+					for d=0,dim do offset.entries[d] = (4.0*random:uniform() - 2.0)*radius end
+					distSq = offset:normSq()
+				until distSq >= rSq and distSq <= 4.0*rSq
+				var q = center + offset
+				var inside = true
+				for d=0,dim do
+					if q.entries[d] < mins.entries[d] or q.entries[d] >= maxs.entries[d] then inside = false end
+				end
+				if inside then
+					-- Check the neighboring cells for samples that are too close
+					var cq = [cellOf(q, mins, cellSize, gridDims)]
+					var free = true
+					for n=0,neighborhoodSize do
+						var c : int[dim]
+						var valid = true
+						var rem = n
+						for dd=0,dim do
+							var d = dim-1-dd
+							c[d] = cq[d] + (rem % neighborhoodWidth) - cellReach
+							rem = rem / neighborhoodWidth
+							if c[d] < 0 or c[d] >= gridDims[d] then valid = false end
+						end
+						if valid then
+							var s = cells([cellIndex(c, gridDims)])
+							if s >= 0 and self.samples(s):distSq(q) < rSq then
+								free = false
+								break
+							end
+						end
+					end
+					if free then
+						cells([cellIndex(cq, gridDims)]) = self.samples.size
+						active:push(self.samples.size)
+						self.samples:push(q)
+						found = true
+						break
+					end
+				end
+			end
+			if not found then
+				active(a) = active(active.size-1)
+				active:resize(active.size-1)
+			end
+		end
+		m.destruct(cells)
+		m.destruct(active)
+	end
+
+	terra PoissonDiskSamplingPatternT:__construct(mins: SpaceVec, maxs: SpaceVec, radius: double) : {}
+		self:__construct(mins, maxs, radius, 1)
+	end
+
+	terra PoissonDiskSamplingPatternT:__copy(other: &PoissonDiskSamplingPatternT) : {}
+		self.samples = m.copy(other.samples)
+	end
+
+	terra PoissonDiskSamplingPatternT:__destruct() : {}
+		m.destruct(self.samples)
+	end
+	inheritance.virtual(PoissonDiskSamplingPatternT, "__destruct")
+
+	terra PoissonDiskSamplingPatternT:getSamplePattern() : &SamplePattern
+		return &self.samples
+	end
+	inheritance.virtual(PoissonDiskSamplingPatternT, "getSamplePattern")
+
+	m.addConstructors(PoissonDiskSamplingPatternT)
+	return PoissonDiskSamplingPatternT
+
+end)
+
+
 return
 {
+	Random = Random,
 	SamplingPattern = SamplingPattern,
-	RegularGridSamplingPattern = RegularGridSamplingPattern
+	RegularGrid = RegularGrid,
+	SharedSamplePattern = SharedSamplePattern,
+	RegularGridSamplingPattern = RegularGridSamplingPattern,
+	StratifiedSubsetPattern = StratifiedSubsetPattern,
+	JitteredGridSamplingPattern = JitteredGridSamplingPattern,
+	HaltonSamplingPattern = HaltonSamplingPattern,
+	PoissonDiskSamplingPattern = PoissonDiskSamplingPattern
 }
@@ -1,5 +1,6 @@
 local ad = require("ad")
 local Color = require("Color")
+local instr = require("instrumentation")
 
 
 -- Functions that specify how to quantize/convert color channels
@@ -32,12 +33,25 @@ local ChannelFns =
 }
 
 
+-- (These return the same macro every time, so that row kernels can recognize them)
+local channelFnKinds = {}
+for name,makeFn in pairs(ChannelFns) do
+	local fn = makeFn()
+	channelFnKinds[fn] = name
+	ChannelFns[name] = function() return fn end
+end
+
 -- Functions that specify how to deal with 'extra' color channels when
 --    writing to/loading from images.
-local function makeDimMatchFn(extraCompFn)
+-- Dimension match functions made here remember how they were made, so that
+--    rowKernel can build bulk versions of them.
+local dimMatchInfo = {}
+local function makeDimMatchFn(extraCompFn, extraKind)
+	local made = {}
 	return function(channelFn)
 		channelFn = channelFn or ChannelFns.Quantize()
-		return macro(function(src, dst)
+		if made[channelFn] then return made[channelFn] end
+		local fn = macro(function(src, dst)
 			-- src is a Color by value, dst is a Color pointer (so we can write into it)
 			local SrcTyp = src:gettype()
 			local DstTyp = dst:gettype().type
@@ -56,6 +70,9 @@ local function makeDimMatchFn(extraCompFn)
 			end
 			return t
 		end)
+		made[channelFn] = fn
+		dimMatchInfo[fn] = {channelKind = channelFnKinds[channelFn], extraKind = extraKind}
+		return fn
 	end
 end
 local DimensionMatchFns =
@@ -63,12 +80,120 @@ local DimensionMatchFns =
 	makeNew = makeDimMatchFn,
 	Zeros = makeDimMatchFn(function(src, srcDim, dstDim, currIndex)
 		return `0.0
-	end),
+	end, "Zeros"),
 	RepeatLast = makeDimMatchFn(function(src, srcDim, dstDim, currIndex)
 		return `[src].entries[ [srcDim-1] ]
-	end)
+	end, "RepeatLast")
 }
 
+-- Row kernels: bulk versions of dimension match functions, which convert a whole
+--    array of colors at once, 'rowKernelWidth' channel values at a time using
+--    vector types. Only available for plain numeric channel types, and for
+--    dimension match functions made by DimensionMatchFns (for ones made with
+--    makeNew, only when no extra channels need to be filled in).
+local rowKernelWidth = 4
+local plainChannelTypes = {[uint8]=true, [uint16]=true, [float]=true, [double]=true}
+
+-- Conversion of one channel value x from SrcT to DstT (or, if 'width' is given, of a
+--    vector of that many values), following the given ChannelFns kind
+local function convertChannel(channelKind, SrcT, DstT, x, width)
+	local function const(T, value)
+		if not width then return `[T](value) end
+		local t = {}
+		for k=1,width do table.insert(t, `[T](value)) end
+		return `vectorof(T, [t])
+	end
+	local ResultT = width and vector(DstT, width) or DstT
+	if channelKind == "Quantize" and SrcT:isintegral() and DstT:isfloat() then
+		local intmax = 2 ^ (terralib.sizeof(SrcT)*8) - 1
+		return `[ResultT]([x]) / [const(DstT, intmax)]
+	elseif channelKind == "Quantize" and SrcT:isfloat() and DstT:isintegral() then
+		local intmax = 2 ^ (terralib.sizeof(DstT)*8) - 1
+		-- (Same clamping as fmin(fmax(y, 0), intmax), including sending NaNs to 0)
+		return quote
+			var y = [x] * [const(SrcT, intmax)]
+			var zero = [const(SrcT, 0)]
+			var top = [const(SrcT, intmax)]
+			y = terralib.select(y > zero, y, zero)
+			y = terralib.select(y < top, y, top)
+		in
+			[ResultT](y)
+		end
+	else
+		return `[ResultT]([x])
+	end
+end
+
+local rowKernelCache = {}
+function DimensionMatchFns.rowKernel(dimMatchFn, SrcColor, DstColor)
+	local info = dimMatchInfo[dimMatchFn]
+	local SrcT = SrcColor.RealType
+	local DstT = DstColor.RealType
+	if not info or not info.channelKind or not plainChannelTypes[SrcT] or not plainChannelTypes[DstT] then
+		return nil
+	end
+	local SrcDim = SrcColor.Dimension
+	local DstDim = DstColor.Dimension
+	-- (Extra channels from arbitrary extraCompFns can't be reproduced here)
+	if DstDim > SrcDim and not info.extraKind then
+		return nil
+	end
+	rowKernelCache[dimMatchFn] = rowKernelCache[dimMatchFn] or {}
+	local key = tostring(SrcColor) .. "->" .. tostring(DstColor)
+	if rowKernelCache[dimMatchFn][key] then return rowKernelCache[dimMatchFn][key] end
+
+	local W = rowKernelWidth
+	local SrcVT = vector(SrcT, W)
+	local DstVT = vector(DstT, W)
+	local kernel
+	if SrcDim == DstDim then
+		-- Channels line up one-to-one, so the colors can be converted as flat arrays
+		kernel = terra(src: &SrcColor, dst: &DstColor, n: uint) : {}
+			var s = [&SrcT](src)
+			var d = [&DstT](dst)
+			var count = n*SrcDim
+			var e : uint = 0
+			while e + W <= count do
+				var v : SrcVT
+				var vp = [&SrcT](&v)
+				for k=0,W do vp[k] = s[e+k] end
+				var r : DstVT = [convertChannel(info.channelKind, SrcT, DstT, v, W)]
+				var rp = [&DstT](&r)
+				for k=0,W do d[e+k] = rp[k] end
+				e = e + W
+			end
+			for k=e,count do
+				d[k] = [convertChannel(info.channelKind, SrcT, DstT, `s[k])]
+			end
+		end
+	else
+		-- Shared channels are converted as above; extra destination channels replicate
+		--    the last source channel or are zero-filled
+		kernel = terra(src: &SrcColor, dst: &DstColor, n: uint) : {}
+			for i=0,n do
+				escape
+					for c=0,DstDim-1 do
+						local srcVal
+						if c < SrcDim then
+							srcVal = `src[i].entries[c]
+						elseif info.extraKind == "RepeatLast" then
+							srcVal = `src[i].entries[ [SrcDim-1] ]
+						else
+							assert(info.extraKind == "Zeros")
+							srcVal = `[SrcT](0)
+						end
+						emit quote
+							dst[i].entries[c] = [convertChannel(info.channelKind, SrcT, DstT, srcVal)]
+						end
+					end
+				end
+			end
+		end
+	end
+	rowKernelCache[dimMatchFn][key] = kernel
+	return kernel
+end
+
 -- Functions that specify how to interpolate color from an image
 local ImageInterpFns = 
 {
@@ -91,27 +216,154 @@ local ImageInterpFns =
 				color
 			end
 		end)
+	end,
+	-- Blends the four pixels whose centers surround samplePoint (clamping at the image
+	--    border). Better suited than nearest neighbor to patterns which don't line up
+	--    with the pixel grid. Points outside of the image are black, as above.
+	Bilinear = function()
+		return macro(function(image, samplePoint)
+			local ImageType = image:gettype().type
+			local ColorVec = ImageType.ColorVec
+			local ChannelType = ColorVec.RealType
+			local numChannels = ColorVec.Dimension
+			local round = ChannelType:isintegral() and (function(x) return `[x] + 0.5 end) or
+													 (function(x) return x end)
+			return quote
+				var w = [int]([image]:width())
+				var h = [int]([image]:height())
+				var x = [samplePoint].entries[0] * w
+				var y = [samplePoint].entries[1] * h
+				var color : ColorVec
+				if x >= 0.0 and x < w and y >= 0.0 and y < h then
+					-- Pixel centers are at half-integer coordinates
+					var fx = ad.math.fmin(ad.math.fmax(x - 0.5, 0.0), w - 1.0)
+					var fy = ad.math.fmin(ad.math.fmax(y - 0.5, 0.0), h - 1.0)
+					var i0 = [int](fx)
+					var j0 = [int](fy)
+					var i1 = i0 + 1
+					var j1 = j0 + 1
+					if i1 >= w then i1 = w - 1 end
+					if j1 >= h then j1 = h - 1 end
+					var tx = fx - i0
+					var ty = fy - j0
+					var c00 = [image]:getPixelColor(i0, j0)
+					var c10 = [image]:getPixelColor(i1, j0)
+					var c01 = [image]:getPixelColor(i0, j1)
+					var c11 = [image]:getPixelColor(i1, j1)
+					escape
+						for c=0,numChannels-1 do
+							emit quote
+								var top = (1.0-tx)*[double](c00.entries[c]) + tx*[double](c10.entries[c])
+								var bot = (1.0-tx)*[double](c01.entries[c]) + tx*[double](c11.entries[c])
+								color.entries[c] = [ChannelType]([round(`(1.0-ty)*top + ty*bot)])
+							end
+						end
+					end
+				else
+					color:__construct()
+				end
+			in
+				color
+			end
+		end)
 	end
 }
 
+-- (These return the same macro every time, so that callers can recognize them,
+--    e.g. 'interpFn == ImageInterpFns.NearestNeighbor()')
+for name,makeFn in pairs(ImageInterpFns) do
+	local fn = nil
+	ImageInterpFns[name] = function()
+		fn = fn or makeFn()
+		return fn
+	end
+end
+
 -- Functions that specify how to interpolate color from a SampledFn
+-- Other than NearestNeighbor, these are separable reconstruction filters: every sample
+--    is splatted onto the pixels within 'radius' (in pixels) of it, weighted by
+--    weight(dx)*weight(dy), and each pixel gets the weighted average of its splats.
+local function reconstructionFilter(radius, weightFn)
+	return
+	{
+		radius = radius,
+		-- Weight of a sample 'x' pixels away (along one axis), with |x| <= radius
+		weight = macro(function(x) return weightFn(x) end)
+	}
+end
+local filterCache = {}
+local function cachedFilter(name, params, makeFn)
+	local key = name
+	for _,p in ipairs(params) do key = key .. "_" .. tostring(p) end
+	if not filterCache[key] then filterCache[key] = makeFn() end
+	return filterCache[key]
+end
 local SampleInterpFns = 
 {
 	NearestNeighbor = function()
 		-- This is really just a flag indicating that we should do nearest neighbor,
 		--    intead of general interpolation
 		return "NearestNeighbor"
-		-- This is what the structure of a general interpolation function should look like:
-		--    return macro(function(sampledFn, samplePoint)
-		-- 	     --
-		--    end)
+	end,
+	-- (Parameterized filters return the same table for the same parameters, so that
+	--    saveToImage specializations are shared)
+	Tent = function(radius)
+		radius = radius or 1.0
+		return cachedFilter("Tent", {radius}, function()
+			return reconstructionFilter(radius, function(x)
+				return `ad.math.fmax(1.0 - ad.math.fabs([x]) / radius, 0.0)
+			end)
+		end)
+	end,
+	-- Gaussian with standard deviation 'sigma', shifted down so it reaches zero at 'radius'
+	Gaussian = function(sigma, radius)
+		sigma = sigma or 0.5
+		radius = radius or 3.0*sigma
+		local edge = math.exp(-radius*radius / (2.0*sigma*sigma))
+		return cachedFilter("Gaussian", {sigma, radius}, function()
+			return reconstructionFilter(radius, function(x)
+				return `ad.math.fmax(ad.math.exp(-[x]*[x] / [2.0*sigma*sigma]) - edge, 0.0)
+			end)
+		end)
+	end,
+	-- Mitchell-Netravali cubic (radius 2); B = C = 1/3 by default
+	Mitchell = function(B, C)
+		B = B or 1.0/3.0
+		C = C or 1.0/3.0
+		return cachedFilter("Mitchell", {B, C}, function()
+			return reconstructionFilter(2.0, function(x)
+				return quote
+					var ax = ad.math.fabs([x])
+					var w = 0.0
+					if ax < 1.0 then
+						w = ((12.0 - 9.0*B - 6.0*C)*ax*ax*ax + (-18.0 + 12.0*B + 6.0*C)*ax*ax
+							 + (6.0 - 2.0*B)) / 6.0
+					elseif ax < 2.0 then
+						w = ((-B - 6.0*C)*ax*ax*ax + (6.0*B + 30.0*C)*ax*ax + (-12.0*B - 48.0*C)*ax
+							 + (8.0*B + 24.0*C)) / 6.0
+					end
+				in
+					w
+				end
+			end)
+		end)
 	end
 }
 
+-- Functions that specify how a SampledFunction lays out its samples in memory
+local Layouts =
+{
+	-- Array of structs: a single Vector of colors
+	AoS = function() return "AoS" end,
+	-- Structure of arrays: one contiguous plane per color channel, so that kernels can
+	--    stream over a single channel without stepping over the others
+	SoA = function() return "SoA" end
+}
+
 -- AD primitive for the over operator
 local val = ad.val
 local accumadj = ad.def.accumadj
-local over = ad.def.makePrimitive(
+local over = instr.countedPrimitive(ad.def.makePrimitive(
 	terra(curr: double, new: double, alpha: double)
 		return (1.0-alpha)*curr + alpha*new
 	end,
@@ -121,39 +373,38 @@ local over = ad.def.makePrimitive(
 			accumadj(v, new(), val(alpha()))
 			accumadj(v, curr(), 1.0 - val(alpha()))
 		end
-	end)
+	end))
 
 -- Some default color accumlation / clamping functions
 -- Can think of these as a different interface to providing the same information as
 --    OpenGL's glBlendFunc and glBlendEquation
+-- (Parameterless functions return the same macro every time, so that callers can
+--    recognize them, e.g. 'accumFn == AccumFns.Over()')
+local replaceFn = macro(function(currColor, newColor) return newColor end)
+local overFn = macro(function(currColor, newColor, alpha)
+	local VecT = currColor:gettype()
+	return
+		`[VecT.zip(currColor, newColor, function(c, n)
+			-- return `[alpha]*n + (1.0 - [alpha])*c
+			return `over(c, n, [alpha])
+		end)]
+	-- return `[alpha]*[newColor] + (1.0 - [alpha])*[currColor]
+end)
+local sumFn = macro(function(currColor, newColor) return `currColor + newColor end)
+local maxFn = macro(function(currColor, newColor)
+	return `[currColor]:max([newColor])
+end)
 local AccumFns = 
 {
-	Replace = function()
-		return macro(function(currColor, newColor) return newColor end)
-	end,
-	Over = function()
-		return macro(function(currColor, newColor, alpha)
-			local VecT = currColor:gettype()
-			return
-				`[VecT.zip(currColor, newColor, function(c, n)
-					-- return `[alpha]*n + (1.0 - [alpha])*c
-					return `over(c, n, [alpha])
-				end)]
-			-- return `[alpha]*[newColor] + (1.0 - [alpha])*[currColor]
-		end)
-	end,
-	Sum = function()
-		return macro(function(currColor, newColor) return `currColor + newColor end)
-	end,
-	Max = function()
-		return macro(function(currColor, newColor)
-			return `[currColor]:max([newColor])
-		end)
-	end
+	Replace = function() return replaceFn end,
+	Over = function() return overFn end,
+	Sum = function() return sumFn end,
+	Max = function() return maxFn end
 }
+local noClampFn = macro(function(color) return color end)
 local ClampFns = 
 {
-	None = function() return macro(function(color) return color end) end,
+	None = function() return noClampFn end,
 	Min = function(maxval)
 		if maxval == nil then maxval = 1.0 end
 		maxval = `[double](maxval)
@@ -183,6 +434,7 @@ return
 	DimensionMatchFns = DimensionMatchFns,
 	ImageInterpFns = ImageInterpFns,
 	SampleInterpFns = SampleInterpFns,
+	Layouts = Layouts,
 	AccumFns = AccumFns,
 	ClampFns = ClampFns
 }
@@ -1,4 +1,5 @@
 local m = require("mem")
+local ad = require("ad")
 local util = require("util")
 local Vector = require("vector")
 local Vec = require("linalg").Vec
@@ -8,50 +9,297 @@ local inheritance = require("inheritance")
 local patterns = require("samplePatterns")
 local options = require("sampledFnOptions")
 local BBox = require("bbox")
+local instr = require("instrumentation")
 
 
-local SampledFunction = templatize(function(SpaceVec, ColorVec, clampFn, accumFn)
+-- AD primitive for a chain of 'over' operations at one sample:
+--    overChain(c, a1..aK, c1..cK) composites c1 (with alpha a1) over c, then c2 over
+--    that, and so on. The adjoint recomputes the intermediate colors and walks the
+--    chain backwards, so the whole chain costs one tape node instead of K.
+local overChainLength = 8
+local val = ad.val
+local accumadj = ad.def.accumadj
+local overChain
+do
+	local K = overChainLength
+	local prev = symbol(double, "prev")
+	local alphas = {}
+	local colors = {}
+	for k=1,K do
+		table.insert(alphas, symbol(double, "alpha"..k))
+		table.insert(colors, symbol(double, "color"..k))
+	end
+	local fwd = terra([prev], [alphas], [colors]) : double
+		var c = [prev]
+		escape
+			for k=1,K do
+				emit quote c = (1.0-[alphas[k]])*c + [alphas[k]]*[colors[k]] end
+			end
+		end
+		return c
+	end
+	overChain = instr.countedPrimitive(ad.def.makePrimitive(fwd, function(...)
+		local v = symbol(ad.num, "v")
+		local args = {}
+		for i,T in ipairs({...}) do table.insert(args, symbol(T)) end
+		local prevArg = args[1]
+		local alphaArgs = {unpack(args, 2, K+1)}
+		local colorArgs = {unpack(args, K+2, 2*K+1)}
+		return terra([v], [args])
+			-- states[k] is the color after the first k steps
+			var states : double[K+1]
+			states[0] = val([prevArg]())
+			escape
+				for k=1,K do
+					emit quote
+						var a = val([alphaArgs[k]]())
+						states[k] = (1.0-a)*states[k-1] + a*val([colorArgs[k]]())
+					end
+				end
+			end
+			-- Transmittance from each step through to the end of the chain
+			var trans = 1.0
+			escape
+				for k=K,1,-1 do
+					emit quote
+						var a = val([alphaArgs[k]]())
+						accumadj([v], [colorArgs[k]](), trans*a)
+						accumadj([v], [alphaArgs[k]](), trans*(val([colorArgs[k]]()) - states[k-1]))
+						trans = trans*(1.0-a)
+					end
+				end
+			end
+			accumadj([v], [prevArg](), trans)
+		end
+	end))
+end
+
+
+local SampledFunction = templatize(function(SpaceVec, ColorVec, clampFn, accumFn, layout)
 
 	assert(SpaceVec.__generatorTemplate == Vec)
 	assert(ColorVec.__generatorTemplate == Color)
 
 	accumFn = accumFn or options.AccumFns.Replace()
 	clampFn = clampFn or options.ClampFns.None()
+	layout = layout or options.Layouts.AoS()
+	assert(layout == options.Layouts.AoS() or layout == options.Layouts.SoA())
+	local isSoA = (layout == options.Layouts.SoA())
 	
 	local colorReal = ColorVec.RealType
+	local numChannels = ColorVec.Dimension
 	local SamplingPattern = Vector(SpaceVec)
+	local SharedPatternT = patterns.SharedSamplePattern(SpaceVec)
+
+	-- AD 'over' accumulation can be aggregated: contributions are logged per sample,
+	--    and composited at the end with one overChain node per overChainLength
+	--    contributions per channel, instead of one 'over' node per contribution.
+	local canAggregate = (colorReal == ad.num and accumFn == options.AccumFns.Over()
+						  and clampFn == options.ClampFns.None())
 
-	local struct SampledFunctionT
+	-- Contributions to each sample form a linked list (bottom to top, i.e. in
+	--    accumulation order for back-to-front compositing) through 'entries';
+	--    -1 terminates a list.
+	local struct LogEntry
+	{
+		next: int,
+		alpha: colorReal,
+		color: ColorVec
+	}
+	local struct AccumLog
 	{
-		samplingPattern: &SamplingPattern,
-		ownsSamplingPattern: bool,
-		samples: Vector(ColorVec)
+		heads: Vector(int),
+		tails: Vector(int),
+		entries: Vector(LogEntry),
+		active: bool
 	}
+	terra AccumLog:__construct() : {}
+		m.init(self.heads)
+		m.init(self.tails)
+		m.init(self.entries)
+		self.active = false
+	end
+	terra AccumLog:__destruct() : {}
+		m.destruct(self.heads)
+		m.destruct(self.tails)
+		m.destruct(self.entries)
+	end
+	terra AccumLog:reset() : {}
+		self.heads:clear()
+		self.tails:clear()
+		self.entries:clear()
+		self.active = false
+	end
+	-- Start logging for a fresh set of 'numSamples' samples (if not already logging)
+	terra AccumLog:activate(numSamples: uint) : {}
+		if not self.active then
+			self.heads:resize(numSamples)
+			self.tails:resize(numSamples)
+			for i=0,numSamples do
+				self.heads(i) = -1
+				self.tails(i) = -1
+			end
+			self.entries:clear()
+			self.active = true
+		end
+	end
+	m.addConstructors(AccumLog)
+
+	-- AoS stores one Vector of colors; SoA stores one Vector per color channel.
+	local SampledFunctionT
+	if isSoA then
+		struct SampledFunctionT
+		{
+			samplingPattern: &SamplingPattern,
+			sharedPattern: &SharedPatternT,
+			planes: Vector(colorReal)[numChannels],
+			accumLog: &AccumLog
+		}
+	else
+		struct SampledFunctionT
+		{
+			samplingPattern: &SamplingPattern,
+			sharedPattern: &SharedPatternT,
+			samples: Vector(ColorVec),
+			accumLog: &AccumLog
+		}
+	end
 	SampledFunctionT.SpaceVec = SpaceVec
 	SampledFunctionT.ColorVec = ColorVec
 	SampledFunctionT.SamplingPattern = SamplingPattern
+	SampledFunctionT.SharedPattern = SharedPatternT
+	SampledFunctionT.Layout = layout
+	SampledFunctionT.AccumFn = accumFn
+	SampledFunctionT.ClampFn = clampFn
+
+	-- Generate one statement per color channel plane
+	local function foreachPlane(self, fn)
+		local t = {}
+		for c=0,numChannels-1 do
+			table.insert(t, fn(`[self].planes[c], c))
+		end
+		return t
+	end
 
 	terra SampledFunctionT:__construct()
 		self.samplingPattern = nil
-		self.ownsSamplingPattern = false
-		m.init(self.samples)
+		self.sharedPattern = nil
+		self.accumLog = nil
+		escape
+			if isSoA then
+				emit quote [foreachPlane(self, function(p) return `m.init(p) end)] end
+			else
+				emit quote m.init(self.samples) end
+			end
+		end
 	end
 
 	terra SampledFunctionT:__copy(other: &SampledFunctionT)
-		self.samples = m.copy(other.samples)
+		-- Copies share (or borrow) the pattern of the original
+		self.samplingPattern = other.samplingPattern
+		self.sharedPattern = nil
+		if other.sharedPattern ~= nil then self.sharedPattern = other.sharedPattern:acquire() end
+		-- Copies accumulate directly; pending contributions are not copied
+		self.accumLog = nil
+		escape
+			if isSoA then
+				for c=0,numChannels-1 do
+					emit quote self.planes[c] = m.copy(other.planes[c]) end
+				end
+			else
+				emit quote self.samples = m.copy(other.samples) end
+			end
+		end
 	end
 
 	terra SampledFunctionT:__destruct()
 		self:clear()
-		m.destruct(self.samples)
+		if self.accumLog ~= nil then m.delete(self.accumLog) end
+		escape
+			if isSoA then
+				emit quote [foreachPlane(self, function(p) return `m.destruct(p) end)] end
+			else
+				emit quote m.destruct(self.samples) end
+			end
+		end
+	end
+
+	terra SampledFunctionT:numSamples() : uint
+		escape
+			if isSoA then
+				emit quote return self.planes[0].size end
+			else
+				emit quote return self.samples.size end
+			end
+		end
+	end
+	util.inline(SampledFunctionT.methods.numSamples)
+
+	terra SampledFunctionT:resizeSamples(n: uint) : {}
+		escape
+			if isSoA then
+				emit quote [foreachPlane(self, function(p) return `p:resize(n) end)] end
+			else
+				emit quote self.samples:resize(n) end
+			end
+		end
+	end
+
+	terra SampledFunctionT:clearSamples() : {}
+		escape
+			if isSoA then
+				emit quote [foreachPlane(self, function(p) return `p:clear() end)] end
+			else
+				emit quote self.samples:clear() end
+			end
+		end
+	end
+
+	-- Layout-independent access to individual samples (by value)
+	terra SampledFunctionT:getSample(index: uint) : ColorVec
+		escape
+			if isSoA then
+				emit quote
+					var color : ColorVec
+					[foreachPlane(self, function(p, c) return quote color.entries[c] = p(index) end end)]
+					return color
+				end
+			else
+				emit quote return self.samples:get(index) end
+			end
+		end
+	end
+	util.inline(SampledFunctionT.methods.getSample)
+
+	terra SampledFunctionT:setSample(index: uint, color: ColorVec) : {}
+		escape
+			if isSoA then
+				emit quote
+					[foreachPlane(self, function(p, c) return quote p:set(index, color.entries[c]) end end)]
+				end
+			else
+				emit quote self.samples:set(index, color) end
+			end
+		end
+	end
+	util.inline(SampledFunctionT.methods.setSample)
+
+	if isSoA then
+		-- Contiguous storage for one color channel
+		terra SampledFunctionT:getChannelPlane(channel: uint) : &colorReal
+			return self.planes[channel]:getPointer(0)
+		end
+		util.inline(SampledFunctionT.methods.getChannelPlane)
 	end
 
 	terra SampledFunctionT:clear()
-		if self.ownsSamplingPattern then
-			m.delete(self.samplingPattern)
+		if self.sharedPattern ~= nil then
+			self.sharedPattern:release()
+			self.sharedPattern = nil
 		end
 		self.samplingPattern = nil
-		self.samples:clear()
+		self:clearSamples()
+		if self.accumLog ~= nil then self.accumLog:reset() end
 	end
 
 	terra SampledFunctionT:spatialBounds()
@@ -62,31 +310,155 @@ local SampledFunction = templatize(function(SpaceVec, ColorVec, clampFn, accumFn
 		return bbox
 	end
 
+	-- Use 'pattern' without taking a reference to it; the caller keeps it alive
 	terra SampledFunctionT:setSamplingPattern(pattern: &SamplingPattern)
-		if self.ownsSamplingPattern then m.delete(self.samplingPattern) end
-		self.samplingPattern = pattern
-		self.ownsSamplingPattern = false
-		self.samples:resize(pattern.size)
+		if pattern ~= self.samplingPattern then
+			if self.sharedPattern ~= nil then
+				self.sharedPattern:release()
+				self.sharedPattern = nil
+			end
+			self.samplingPattern = pattern
+		end
+		self:resizeSamples(pattern.size)
 	end
 
+	-- Use a shared pattern, holding a reference to it
+	terra SampledFunctionT:shareSamplingPattern(shared: &SharedPatternT)
+		var old = self.sharedPattern
+		self.sharedPattern = shared:acquire()
+		self.samplingPattern = &shared.samples
+		if old ~= nil then old:release() end
+		self:resizeSamples(shared.samples.size)
+	end
+
+	-- Keep a pattern with the contents of 'pattern' alive for as long as this function
+	--    uses it. Equal patterns are shared between all functions that own them.
 	terra SampledFunctionT:ownSamplingPattern(pattern: &SamplingPattern)
-		if self.ownsSamplingPattern then m.delete(self.samplingPattern) end
-		self.samplingPattern = m.new(SamplingPattern)
-		self.samplingPattern:__copy(pattern)
-		self.ownsSamplingPattern = true
-		self.samples:resize(pattern.size)
+		var shared = SharedPatternT.intern(pattern)
+		self:shareSamplingPattern(shared)
+		shared:release()
+	end
+
+	-- Content fingerprint of the sampling pattern (free for shared patterns)
+	terra SampledFunctionT:patternFingerprint() : uint64
+		if self.sharedPattern ~= nil then return self.sharedPattern.fingerprint end
+		return SharedPatternT.fingerprintOf(self.samplingPattern)
 	end
 
+	-- (For SoA, this gathers the sample from the channel planes and scatters the result back)
 	terra SampledFunctionT:accumulateSample(index: uint, color: ColorVec, alpha: colorReal) : {}
-		var currColor = self.samples:get(index)
-		self.samples:set(index, clampFn(accumFn(currColor, color, alpha)))
+		[util.optionally(canAggregate, function() return quote
+			var log = self.accumLog
+			if log ~= nil then
+				log:activate(self:numSamples())
+				var e = [int](log.entries.size)
+				log.entries:push(LogEntry { -1, alpha, color })
+				if log.tails(index) < 0 then
+					log.heads(index) = e
+				else
+					log.entries:getPointer(log.tails(index)).next = e
+				end
+				log.tails(index) = e
+				return
+			end
+		end end)]
+		var currColor = self:getSample(index)
+		self:setSample(index, clampFn(accumFn(currColor, color, alpha)))
 	end
 
 	terra SampledFunctionT:accumulateSample(index: uint, color: ColorVec) : {}
 		self:accumulateSample(index, color, 1.0)
 	end
 
+	if canAggregate then
+		-- With aggregation enabled, accumulateSample only logs its contributions;
+		--    samples are not updated until flushAccumulation is called.
+		terra SampledFunctionT:setAggregatedAccumulation(enabled: bool) : {}
+			if enabled and self.accumLog == nil then
+				self.accumLog = m.new(AccumLog)
+			elseif not enabled and self.accumLog ~= nil then
+				self:flushAccumulation()
+				m.delete(self.accumLog)
+				self.accumLog = nil
+			end
+		end
+
+		-- Whether accumulateSample currently only logs contributions
+		terra SampledFunctionT:isAggregating() : bool
+			return self.accumLog ~= nil
+		end
+		util.inline(SampledFunctionT.methods.isAggregating)
+
+		-- Log a contribution which goes under all the contributions logged so far at
+		--    'index' (but still over the sample's current color), for front-to-back
+		--    compositing. Requires aggregation to be enabled.
+		terra SampledFunctionT:accumulateSampleUnder(index: uint, color: ColorVec, alpha: colorReal) : {}
+			var log = self.accumLog
+			log:activate(self:numSamples())
+			var e = [int](log.entries.size)
+			log.entries:push(LogEntry { log.heads(index), alpha, color })
+			log.heads(index) = e
+			if log.tails(index) < 0 then log.tails(index) = e end
+		end
+
+		-- Composite all logged contributions into the samples
+		terra SampledFunctionT:flushAccumulation() : {}
+			var log = self.accumLog
+			if log == nil or not log.active then return end
+			var zero = [colorReal](0.0)
+			for i=0,log.heads.size do
+				var e = log.heads(i)
+				if e >= 0 then
+					var c = self:getSample(i)
+					while e >= 0 do
+						-- Gather the next chunk of contributions (padding with no-ops)
+						var alphas : colorReal[overChainLength]
+						var colors : ColorVec[overChainLength]
+						for k=0,overChainLength do
+							if e >= 0 then
+								var entry = log.entries:getPointer(e)
+								alphas[k] = entry.alpha
+								colors[k] = entry.color
+								e = entry.next
+							else
+								alphas[k] = zero
+								colors[k] = ColorVec.stackAlloc()
+							end
+						end
+						escape
+							for ch=0,numChannels-1 do
+								local as, cs = {}, {}
+								for k=0,overChainLength-1 do
+									table.insert(as, `alphas[k])
+									table.insert(cs, `colors[k].entries[ch])
+								end
+								emit quote c.entries[ch] = overChain(c.entries[ch], [as], [cs]) end
+							end
+						end
+					end
+					self:setSample(i, c)
+				end
+			end
+			log.active = false
+		end
+	end
+
 	if SpaceVec.Dimension == 2 then
+		-- Whether the samples are exactly the pixel centers of a w x h image spanning
+		--    [mins, maxs] (i.e. a shared pattern generated from that grid). If so, the
+		--    sample for pixel (i, j) is sample i*h + j, and image conversions can
+		--    stream through whole scanlines without any coordinate math.
+		local PixelGridVec = Vec(uint, 2)
+		terra SampledFunctionT:matchesPixelGrid(w: uint, h: uint, mins: SpaceVec, maxs: SpaceVec) : bool
+			var shared = self.sharedPattern
+			if shared == nil and self.samplingPattern ~= nil then
+				shared = SharedPatternT.findStorage(self.samplingPattern)
+			end
+			return shared ~= nil and shared.hasGrid and
+				   shared.grid.numCells == PixelGridVec.stackAlloc(w, h) and
+				   shared.grid.mins == mins and shared.grid.maxs == maxs
+		end
+
 		--  Save/load to/from images, parameterized by:
 		--    A function specifying how to interpolate onto/from image grid.
 		--    What to do with extra color channels (dimension matching)
@@ -96,15 +468,47 @@ local SampledFunction = templatize(function(SpaceVec, ColorVec, clampFn, accumFn
 			interpFn = interpFn or options.ImageInterpFns.NearestNeighbor()
 			dimMatchFn = dimMatchFn or options.DimensionMatchFns.RepeatLast()
 			
+			local isNearest = (interpFn == options.ImageInterpFns.NearestNeighbor())
+			local rowKernel = options.DimensionMatchFns.rowKernel(dimMatchFn, ImageType.ColorVec, ColorVec)
+
 			return terra(sampledFn: &SampledFunctionT, image: &ImageType, mins: SpaceVec, maxs: SpaceVec) : {}
+				-- (Nearest neighbor lookups at pixel centers are just the pixels)
+				[util.optionally(isNearest, function() return quote
+					var w = image:width()
+					var h = image:height()
+					if sampledFn:matchesPixelGrid(w, h, mins, maxs) then
+						[rowKernel and quote
+							-- Convert each scanline in bulk, then scatter it to the samples
+							var rowColors = [Vector(ColorVec)].stackAlloc()
+							rowColors:resize(w)
+							for j=0,h do
+								rowKernel([&ImageType.ColorVec](image:scanLine(j)), rowColors:getPointer(0), w)
+								for i=0,w do sampledFn:setSample(i*h + j, rowColors(i)) end
+							end
+							m.destruct(rowColors)
+						end or quote
+							for j=0,h do
+								var row = image:scanLine(j)
+								for i=0,w do
+									var sourceColor = ImageType.getRowPixelColor(row, i)
+									var targetColor : ColorVec
+									dimMatchFn(sourceColor, &targetColor)
+									sampledFn:setSample(i*h + j, targetColor)
+								end
+							end
+						end]
+						return
+					end
+				end end)]
 				var range = maxs - mins
 				for i=0,sampledFn.samplingPattern.size do
 					var samplePoint = sampledFn.samplingPattern:get(i)
 					-- Normalize samplePoint before passing to image
 					samplePoint = (samplePoint - mins) / range
 					var sourceColor = interpFn(image, samplePoint)
-					var targetColor = sampledFn.samples:getPointer(i)
-					dimMatchFn(sourceColor, targetColor)
+					var targetColor : ColorVec
+					dimMatchFn(sourceColor, &targetColor)
+					sampledFn:setSample(i, targetColor)
 				end
 			end
 		end)
@@ -115,6 +519,7 @@ local SampledFunction = templatize(function(SpaceVec, ColorVec, clampFn, accumFn
 			dimMatchFn = dimMatchFn or options.DimensionMatchFns.RepeatLast()
 
 			local ImColorVec = ImageType.ColorVec
+			local rowKernel = options.DimensionMatchFns.rowKernel(dimMatchFn, ColorVec, ImColorVec)
 
 			-- Special case the nearest-neighbor interpolation scheme, since it's much more efficient
 			--    to just iterate over samples in this case, instead of over pixel grid locations.
@@ -123,9 +528,32 @@ local SampledFunction = templatize(function(SpaceVec, ColorVec, clampFn, accumFn
 					var range = maxs - mins
 					var w = image:width()
 					var h = image:height()
-					for i=0,sampledFn.samples.size do
+					if sampledFn:matchesPixelGrid(w, h, mins, maxs) then
+						[rowKernel and quote
+							-- Gather each scanline's samples, then convert them in bulk
+							var rowColors = [Vector(ColorVec)].stackAlloc()
+							rowColors:resize(w)
+							for j=0,h do
+								for i=0,w do rowColors(i) = sampledFn:getSample(i*h + j) end
+								rowKernel(rowColors:getPointer(0), [&ImColorVec](image:scanLine(j)), w)
+							end
+							m.destruct(rowColors)
+						end or quote
+							for j=0,h do
+								var row = image:scanLine(j)
+								for i=0,w do
+									var sourceColor = sampledFn:getSample(i*h + j)
+									var targetColor = ImColorVec.stackAlloc()
+									dimMatchFn(sourceColor, &targetColor)
+									ImageType.setRowPixelColor(row, i, targetColor)
+								end
+							end
+						end]
+						return
+					end
+					for i=0,sampledFn:numSamples() do
 						var samplePoint = sampledFn.samplingPattern:get(i)
-						var sourceColor = sampledFn.samples:get(i)
+						var sourceColor = sampledFn:getSample(i)
 						var targetColor = ImColorVec.stackAlloc()
 						dimMatchFn(sourceColor, &targetColor)
 						var oldSamplePoint = samplePoint
@@ -136,25 +564,83 @@ local SampledFunction = templatize(function(SpaceVec, ColorVec, clampFn, accumFn
 					end
 				end
 			else
-				local DiscreteVec = Vec(uint, 2)
+				-- Splat every sample onto the pixels under its filter footprint, then
+				--    normalize by the accumulated filter weight (pixels that no sample
+				--    reaches are left black).
+				local filter = interpFn
+				assert(type(filter) == "table" and filter.radius and filter.weight,
+					"saveToImage: interpFn must be NearestNeighbor or a reconstruction filter")
+				local footprint = 2*math.ceil(filter.radius) + 1
+				local AccumColor = Color(double, numChannels)
 				return terra(sampledFn: &SampledFunctionT, image: &ImageType, mins: SpaceVec, maxs: SpaceVec) : {}
 					var range = maxs - mins
-					var w = image:width()
-					var h = image:height()
-					var grid = [patterns.RegularGridPattern(real, 2)].stackAlloc(
-						mins, maxs, DiscreteVec.stackAlloc(w, h))
-					for i=0,grid.storedPattern.size do
-						var samplePoint = grd.storedPattern:get(i)
-						var sourceColor = interpFn(sampledFn, samplePoint)
-						var targetColor = ImColorVec.stackAlloc()
-						dimMatchFn(sourceColor, &targetColor)
-						-- Match samplePoint to image i, j, write to image
-						samplePoint = (samplePoint - mins) / range
-						var icoord = [uint](samplePoint(0) * w)
-						var jcoord = [uint](samplePoint(1) * h)
-						image:setPixelColor(icoord, jcoord, targetColor)
+					var w = [int](image:width())
+					var h = [int](image:height())
+					var colorSums = [Vector(double)].stackAlloc()
+					var weightSums = [Vector(double)].stackAlloc()
+					colorSums:resize(w*h*numChannels)
+					weightSums:resize(w*h)
+					for i=0,colorSums.size do colorSums(i) = 0.0 end
+					for i=0,weightSums.size do weightSums(i) = 0.0 end
+					for s=0,sampledFn:numSamples() do
+						var samplePoint = (sampledFn.samplingPattern:get(s) - mins) / range
+						-- Continuous pixel coordinates (pixel centers are at integers)
+						var px = ad.val(samplePoint(0))*w - 0.5
+						var py = ad.val(samplePoint(1))*h - 0.5
+						var x0 = [int](ad.math.ceil(px - [filter.radius]))
+						var y0 = [int](ad.math.ceil(py - [filter.radius]))
+						-- Separable weights, evaluated once per axis
+						var wx : double[footprint]
+						var wy : double[footprint]
+						for k=0,footprint do
+							wx[k] = 0.0
+							wy[k] = 0.0
+							var dx = (x0 + k) - px
+							var dy = (y0 + k) - py
+							if ad.math.fabs(dx) <= [filter.radius] then wx[k] = filter.weight(dx) end
+							if ad.math.fabs(dy) <= [filter.radius] then wy[k] = filter.weight(dy) end
+						end
+						var color = sampledFn:getSample(s)
+						for kx=0,footprint do
+							var x = x0 + kx
+							if x >= 0 and x < w and wx[kx] ~= 0.0 then
+								for ky=0,footprint do
+									var y = y0 + ky
+									if y >= 0 and y < h and wy[ky] ~= 0.0 then
+										var wt = wx[kx]*wy[ky]
+										var pix = x*h + y
+										weightSums(pix) = weightSums(pix) + wt
+										escape
+											for c=0,numChannels-1 do
+												emit quote
+													colorSums(pix*numChannels + c) = colorSums(pix*numChannels + c) +
+														wt*ad.val(color.entries[c])
+												end
+											end
+										end
+									end
+								end
+							end
+						end
+					end
+					for x=0,w do
+						for y=0,h do
+							var pix = x*h + y
+							var sourceColor = AccumColor.stackAlloc(0.0)
+							-- (Negative-lobed filters can cancel out; treat those pixels as empty)
+							if weightSums(pix) > 1e-8 then
+								var invWeight = 1.0 / weightSums(pix)
+								for c=0,numChannels do
+									sourceColor.entries[c] = colorSums(pix*numChannels + c) * invWeight
+								end
+							end
+							var targetColor = ImColorVec.stackAlloc()
+							dimMatchFn(sourceColor, &targetColor)
+							image:setPixelColor(x, y, targetColor)
+						end
 					end
-					m.destruct(grid)
+					m.destruct(colorSums)
+					m.destruct(weightSums)
 				end
 			end
 		end)
@@ -162,6 +648,24 @@ local SampledFunction = templatize(function(SpaceVec, ColorVec, clampFn, accumFn
 
 	-- Process samples in lock-step with samples from an identical sampling
 	--    pattern (but possibly of a different type)
+	-- For SoA layouts, the pointers handed to processingMacro refer to gathered
+	--    copies of the samples, so the macro should only read through them.
+	-- Patterns match if they are the same object, or have the same contents
+	local function checkSamePattern(fn1, fn2)
+		return quote
+			if [fn1].samplingPattern ~= [fn2].samplingPattern and
+			   [fn1]:patternFingerprint() ~= [fn2]:patternFingerprint() then
+				util.fatalError("Attempt to compare two sample sets drawn from different sampling patterns.\n")
+			end
+		end
+	end
+	local function samplePointer(FnT, fn, i)
+		if FnT.Layout == options.Layouts.SoA() then
+			return quote var c = [fn]:getSample([i]) in &c end
+		else
+			return `[fn].samples:getPointer([i])
+		end
+	end
 	SampledFunctionT.lockstep = templatize(
 	function(SampledFunctionT2, processingMacro)
 		assert(SampledFunctionT.SpaceVec.Dimension == SampledFunctionT2.SpaceVec.Dimension)
@@ -169,18 +673,40 @@ local SampledFunction = templatize(function(SpaceVec, ColorVec, clampFn, accumFn
 			assert(self:gettype() == &SampledFunctionT)
 			assert(fn2:gettype() == &SampledFunctionT2)
 			return quote
-				if self.samplingPattern ~= fn2.samplingPattern then
-					util.fatalError("Attempt to compare two sample sets drawn from different sampling patterns.\n")			
-				end
+				[checkSamePattern(self, fn2)]
 				for i=0,self.samplingPattern.size do
-					var s1 = self.samples:getPointer(i)
-					var s2 = fn2.samples:getPointer(i)
+					var s1 = [samplePointer(SampledFunctionT, self, i)]
+					var s2 = [samplePointer(SampledFunctionT2, fn2, i)]
 					processingMacro(s1, s2)
 				end
 			end
 		end)
 	end)
 
+	-- Like lockstep, but for two SoA functions: processes one color channel at a time.
+	-- channelMacro is called once per channel as channelMacro(plane1, plane2, numSamples).
+	SampledFunctionT.lockstepChannels = templatize(
+	function(SampledFunctionT2, channelMacro)
+		assert(SampledFunctionT.Layout == options.Layouts.SoA() and
+			   SampledFunctionT2.Layout == options.Layouts.SoA())
+		assert(SampledFunctionT.SpaceVec.Dimension == SampledFunctionT2.SpaceVec.Dimension)
+		assert(SampledFunctionT.ColorVec.Dimension == SampledFunctionT2.ColorVec.Dimension)
+		return macro(function(self, fn2)
+			assert(self:gettype() == &SampledFunctionT)
+			assert(fn2:gettype() == &SampledFunctionT2)
+			local t = {}
+			for c=0,numChannels-1 do
+				table.insert(t, quote
+					channelMacro([self]:getChannelPlane(c), [fn2]:getChannelPlane(c), [self]:numSamples())
+				end)
+			end
+			return quote
+				[checkSamePattern(self, fn2)]
+				[t]
+			end
+		end)
+	end)
+
 	m.addConstructors(SampledFunctionT)
 	return SampledFunctionT
 
@@ -1,9 +1,19 @@
 local m = require("mem")
+local util = require("util")
 local Vector = require("vector")
 local Vec = require("linalg").Vec
 local Color = require("color")
+local BBox = require("bbox")
 local templatize = require("templatize")
 local ad = require("ad")
+local RegularGrid = require("samplePatterns").RegularGrid
+local SharedSamplePattern = require("samplePatterns").SharedSamplePattern
+local ShapeRecord = require("shapes").ShapeRecord
+local threadPool = require("threadPool")
+local Arena = require("arena")
+local SfnOpts = require("sampledFnOptions")
+local BVH = require("bvh")
+local instr = require("instrumentation")
 
 
 -- Skip sampling shapes at locations where the resulting alpha
@@ -11,133 +21,1225 @@ local ad = require("ad")
 local smoothAlphaThresh = 0.02
 local logSmoothAlphaThresh = math.log(smoothAlphaThresh)
 
--- AD primitive for isovalue smoothing calculations
+local C = terralib.includec("math.h")
+
+-- Fast exponential: range reduction to x = n*ln(2) + r with |r| <= ln(2)/2,
+--    followed by a degree 6 Taylor polynomial for exp(r).
+-- Max relative error is below 2e-7 (for x >= -708; smaller x returns 0).
+local ln2Hi = 6.93147180369123816490e-01
+local ln2Lo = 1.90821492927058770002e-10
+local invLn2 = 1.0 / math.log(2)
+local expCoeffs = {}
+for k=0,6 do
+	local f = 1
+	for j=2,k do f = f*j end
+	expCoeffs[k] = 1.0/f
+end
+local terra fastExp(x: double) : double
+	if x < -708.0 then return 0.0 end
+	var n = C.floor(x*invLn2 + 0.5)
+	var r = (x - n*ln2Hi) - n*ln2Lo
+	var p = [expCoeffs[6]]
+	escape
+		for k=5,0,-1 do
+			emit quote p = p*r + [expCoeffs[k]] end
+		end
+	end
+	-- Scale by 2^n by building the exponent bits directly
+	var scaleBits = [uint64]([int64](n) + 1023) << 52
+	return p * @[&double](&scaleBits)
+end
+util.inline(fastExp)
+
+-- AD primitive for isovalue smoothing calculations, using 'expFn' for the exponential
+-- The adjoint only depends on the primal output, so it is consistent with whichever
+--    exponential produced it.
 local val = ad.val
 local accumadj = ad.def.accumadj
-local smoothAlpha = ad.def.makePrimitive(
-	terra(isoval: double, smoothParam: double)
-		return ad.math.exp(-isoval / smoothParam)
+local function makeSmoothAlpha(expFn)
+	return instr.countedPrimitive(ad.def.makePrimitive(
+		terra(isoval: double, smoothParam: double)
+			return expFn(-isoval / smoothParam)
+		end,
+		function(T1, T2)
+			return terra(v: ad.num, isoval: T1, smoothParam: T2)
+				var spv = val(smoothParam())
+				accumadj(v, isoval(), -val(v)/spv)
+				accumadj(v, smoothParam, val(v)*val(isoval())/(spv*spv))
+			end
+		end))
+end
+
+-- AD primitive which passes 'acc' through unchanged, but gives 'x' the (constant)
+--    partial derivative 'g'. Lets a hand-differentiated computation put one tape node
+--    per input on the tape, instead of one per operation.
+local addGradTerm = instr.countedPrimitive(ad.def.makePrimitive(
+	terra(acc: double, x: double, g: double)
+		return acc
 	end,
-	function(T1, T2)
-		return terra(v: ad.num, isoval: T1, smoothParam: T2)
-			var spv = val(smoothParam())
-			accumadj(v, isoval(), -val(v)/spv)
-			accumadj(v, smoothParam, val(v)*val(isoval())/(spv*spv))
+	function(T1, T2, T3)
+		return terra(v: ad.num, acc: T1, x: T2, g: T3)
+			accumadj(v, acc(), 1.0)
+			accumadj(v, x(), val(g()))
 		end
-	end)
+	end))
 
-local ImplicitSampler = templatize(function(SampledFunctionT, Shape)
+-- Selectable implementations of smoothAlpha (chosen per ImplicitSampler instantiation)
+local smoothAlphaExact = makeSmoothAlpha(ad.math.exp)
+local smoothAlphaFast = makeSmoothAlpha(fastExp)
+local SmoothAlphaFns =
+{
+	Exact = function() return smoothAlphaExact end,
+	Fast = function() return smoothAlphaFast end
+}
+
+-- 'smoothAlpha' is one of SmoothAlphaFns (Exact by default), and 'capsuleIsovalueMode'
+--    one of shapes.CapsuleIsovalueModes (Arithmetic by default), for capsules added
+--    with addCapsule.
+local ImplicitSampler = templatize(function(SampledFunctionT, Shape, smoothAlpha, capsuleIsovalueMode)
 
 	assert(SampledFunctionT.ColorVec == Shape.ColorVec)
 	assert(SampledFunctionT.SpaceVec.Dimension == Shape.SpaceVec.Dimension)
 
+	smoothAlpha = smoothAlpha or SmoothAlphaFns.Exact()
+
 	local real = Shape.SpaceVec.RealType
+	local colorReal = SampledFunctionT.ColorVec.RealType
 	local SamplingPattern = SampledFunctionT.SamplingPattern
+	local RegularGridT = RegularGrid(SampledFunctionT.SpaceVec)
+	local SharedPatternT = SharedSamplePattern(SampledFunctionT.SpaceVec)
+	local BBoxT = BBox(Vec(double, Shape.SpaceVec.Dimension))
+	local BVHT = BVH(Vec(double, Shape.SpaceVec.Dimension))
+	local dim = Shape.SpaceVec.Dimension
+	local ShapeRecordT = ShapeRecord(Shape.SpaceVec, Shape.ColorVec, capsuleIsovalueMode)
+
+	-- Multithreaded sampling is only possible when no AD tape is being recorded
+	local canParallelize = (real == double and colorReal == double)
+	-- How many tiles to split the samples into per thread (more tiles balance
+	--    better when shapes are unevenly distributed)
+	local tilesPerThread = 8
+	-- Front-to-back compositing is only equivalent for plain 'over' compositing
+	local canFrontToBack = (SampledFunctionT.AccumFn == SfnOpts.AccumFns.Over() and
+							SampledFunctionT.ClampFn == SfnOpts.ClampFns.None())
+
+	-- A contiguous run of sample indices, along with the bounds of those samples
+	local struct SampleTile
+	{
+		start: uint,
+		stop: uint,
+		bounds: BBoxT
+	}
 
 	local struct ImplicitSamplerT
 	{
-		shapes: Vector(&Shape),
-		sampledFn: &SampledFunctionT
+		shapes: Vector(ShapeRecordT),
+		-- Backing memory for shapes constructed in place (reset by clearShapes)
+		shapeArena: Arena,
+		sampledFn: &SampledFunctionT,
+		-- Cached grid structure of the last pattern we sampled
+		--    (patterns are assumed not to change once built; see patternChanged)
+		grid: RegularGridT,
+		gridPattern: &SamplingPattern,
+		gridPatternSize: uint,
+		patternIsGrid: bool,
+		-- Per-dimension sample coordinates of a grid pattern (concatenated), valid if
+		--    every sample's coordinates match them exactly. These are the contiguous
+		--    coordinate arrays the row kernels read; off-grid patterns stay AoS.
+		axes: Vector(double),
+		axisOffsets: uint[dim],
+		patternIsSeparable: bool,
+		-- Tiles and per-tile shape lists for multithreaded sampling
+		numThreads: uint,
+		tiles: Vector(SampleTile),
+		tilePattern: &SamplingPattern,
+		tilePatternSize: uint,
+		tileThreads: uint,
+		tileShapes: Vector(Vector(uint)),
+		shapeBounds: Vector(BBoxT),
+		-- The previous frame, for incremental re-rendering (see setIncremental)
+		incremental: bool,
+		frameValid: bool,
+		frameSmoothing: bool,
+		frameSmoothParam: double,
+		frameSamples: Vector(SampledFunctionT.ColorVec),
+		frameTileShapes: Vector(Vector(ShapeRecordT)),
+		dirtyTiles: Vector(uint),
+		-- Front-to-back compositing state: premultiplied color and remaining
+		--    transmittance (1 - accumulated alpha) of every sample
+		frontToBack: bool,
+		transmittanceCutoff: double,
+		premultColors: Vector(SampledFunctionT.ColorVec),
+		transmittances: Vector(colorReal),
+		-- Hierarchy over shape bounds for sample-major traversal (see setUseBVH)
+		useBVH: bool,
+		bvh: BVHT,
+		shapeMinIsovalues: Vector(real),
+		-- Deferred smooth render, for fused rendering + scoring (see setFusedScoring)
+		fusedScoring: bool,
+		pendingPattern: &SamplingPattern,
+		pendingSmoothParam: real
 	}
 	ImplicitSamplerT.SampledFunctionType = SampledFunctionT
 
 	terra ImplicitSamplerT:__construct(sampledFn: &SampledFunctionT)
 		m.init(self.shapes)
+		m.init(self.shapeArena)
 		self.sampledFn = sampledFn
+		m.init(self.grid)
+		self.gridPattern = nil
+		self.gridPatternSize = 0
+		self.patternIsGrid = false
+		m.init(self.axes)
+		self.patternIsSeparable = false
+		self.numThreads = 1
+		m.init(self.tiles)
+		self.tilePattern = nil
+		self.tilePatternSize = 0
+		self.tileThreads = 0
+		m.init(self.tileShapes)
+		m.init(self.shapeBounds)
+		self.incremental = false
+		self.frameValid = false
+		self.frameSmoothing = false
+		self.frameSmoothParam = 0.0
+		m.init(self.frameSamples)
+		m.init(self.frameTileShapes)
+		m.init(self.dirtyTiles)
+		self.frontToBack = false
+		self.transmittanceCutoff = 0.0
+		m.init(self.premultColors)
+		m.init(self.transmittances)
+		self.useBVH = false
+		m.init(self.bvh)
+		m.init(self.shapeMinIsovalues)
+		self.fusedScoring = false
+		self.pendingPattern = nil
 	end
 
 	terra ImplicitSamplerT:__destruct()
 		self:clearShapes()
 		m.destruct(self.shapes)
+		m.destruct(self.shapeArena)
+		m.destruct(self.axes)
+		m.destruct(self.tiles)
+		m.destruct(self.tileShapes)
+		m.destruct(self.shapeBounds)
+		m.destruct(self.frameSamples)
+		m.destruct(self.frameTileShapes)
+		m.destruct(self.dirtyTiles)
+		m.destruct(self.premultColors)
+		m.destruct(self.transmittances)
+		m.destruct(self.bvh)
+		m.destruct(self.shapeMinIsovalues)
 	end
 
 	-- Assumes ownership of shape
 	terra ImplicitSamplerT:addShape(shape: &Shape)
-		self.shapes:push(shape)
+		self.shapes:push(ShapeRecordT.stackAlloc(shape))
+		instr.count("shapesAdded")
 	end
 
-	local function buildSampleFunction(smoothing)
-		local useTwoField = true
-		local secondFieldMult = 20.0
-		local function accumSharp(self, index, isovalue, color, alpha)
-			return quote
-				if [isovalue] <= 0.0 then [self].sampledFn:accumulateSample([index], [color], [alpha]) end
+	-- Construct a shape of type T (a subtype of Shape) in place, in memory owned by
+	--    the sampler, and add it. Returns a pointer to the new shape.
+	-- Usage: sampler:emplaceShape(T, constructor args...)
+	ImplicitSamplerT.methods.emplaceShape = macro(function(self, T, ...)
+		T = T:astype()
+		local args = {...}
+		return quote
+			var shape = [&T]([self].shapeArena:alloc(sizeof(T)))
+			@shape = T.stackAlloc([args])
+			var rec : ShapeRecordT
+			rec:initInArena(shape)
+			[self].shapes:push(rec)
+			instr.count("shapesAdded")
+		in
+			shape
+		end
+	end)
+
+	-- Closed-world versions of addShape for the concrete shape types: these are stored
+	--    by value and sampled without virtual calls.
+	terra ImplicitSamplerT:addSphere(center: Shape.SpaceVec, r: real, color: Shape.ColorVec, alpha: real)
+		var rec : ShapeRecordT
+		rec:initSphere(center, r, color, alpha)
+		self.shapes:push(rec)
+		instr.count("shapesAdded")
+	end
+
+	terra ImplicitSamplerT:addCapsule(bot: Shape.SpaceVec, top: Shape.SpaceVec, r: real,
+									  color: Shape.ColorVec, alpha: real)
+		var rec : ShapeRecordT
+		rec:initCapsule(bot, top, r, color, alpha)
+		self.shapes:push(rec)
+		instr.count("shapesAdded")
+	end
+
+	-- Sample using up to 'n' threads. Results are identical to single-threaded
+	--    sampling, since every sample still sees the shapes in order.
+	-- Has no effect when sampling with AD types, since the AD tape is not thread-safe.
+	terra ImplicitSamplerT:setNumThreads(n: uint)
+		if n < 1 then n = 1 end
+		self.numThreads = n
+	end
+
+	-- Re-render only the tiles whose shapes changed since the previous frame, and
+	--    reuse the previous frame's colors everywhere else. Results are identical
+	--    to a full render, provided that the sampled function is cleared before
+	--    every render (as sampler:clear() does).
+	-- Has no effect when sampling with AD types, since every render must record
+	--    its own AD tape.
+	terra ImplicitSamplerT:setIncremental(incremental: bool)
+		self.incremental = incremental
+		self.frameValid = false
+	end
+
+	-- Forget everything cached about the patterns sampled so far. Must be called
+	--    when the contents of a pattern change in place (e.g. when a new subset
+	--    is drawn into a StratifiedSubsetPattern).
+	terra ImplicitSamplerT:patternChanged()
+		self.gridPattern = nil
+		self.gridPatternSize = 0
+		self.patternIsGrid = false
+		self.patternIsSeparable = false
+		self.tilePattern = nil
+		self.tilePatternSize = 0
+		self.frameValid = false
+	end
+
+	-- Loop over samples instead of shapes, using a BVH over the shapes' bounds to
+	--    find the shapes covering each sample. Pays off for scenes with many small
+	--    shapes and patterns that are not regular grids. Results are identical to
+	--    shape-major sampling. Takes precedence over incremental re-rendering.
+	terra ImplicitSamplerT:setUseBVH(useBVH: bool)
+		self.useBVH = useBVH
+	end
+
+	-- Composite shapes front-to-back (visiting them in reverse order with the under
+	--    operator), and stop visiting a sample once its accumulated alpha reaches
+	--    'saturation'. With saturation = 1, only fully opaque samples are skipped, and
+	--    results match back-to-front compositing up to rounding; below 1, each color
+	--    channel may be off by at most 1 - saturation.
+	-- Requires a sampled function which uses AccumFns.Over and ClampFns.None.
+	terra ImplicitSamplerT:setFrontToBack(enabled: bool, saturation: double)
+		if enabled and not canFrontToBack then
+			util.fatalError("Front-to-back compositing requires AccumFns.Over and ClampFns.None.\n")
+		end
+		var cutoff = 1.0 - saturation
+		if enabled ~= self.frontToBack or cutoff ~= self.transmittanceCutoff then
+			self.frontToBack = enabled
+			self.transmittanceCutoff = cutoff
+			self.frameValid = false
+		end
+	end
+
+	terra ImplicitSamplerT:prepareFrontToBack(numSamples: uint)
+		self.premultColors:resize(numSamples)
+		self.transmittances:resize(numSamples)
+	end
+
+	terra ImplicitSamplerT:beginFrontToBack(start: uint, stop: uint)
+		for i=start,stop do
+			self.premultColors(i) = [SampledFunctionT.ColorVec].stackAlloc(0.0)
+			self.transmittances(i) = 1.0
+		end
+	end
+
+	-- If the sampled function aggregates AD compositing, contributions are logged under
+	--    the ones visited before them instead, and the transmittance is only kept as a
+	--    plain value for the saturation test.
+	local canLogUnder = SampledFunctionT.methods.accumulateSampleUnder ~= nil
+	terra ImplicitSamplerT:accumulateFrontToBack(index: uint, color: SampledFunctionT.ColorVec,
+												  alpha: colorReal) : {}
+		var t = self.transmittances:getPointer(index)
+		[util.optionally(canLogUnder, function() return quote
+			if self.sampledFn:isAggregating() then
+				self.sampledFn:accumulateSampleUnder(index, color, alpha)
+				@t = ad.val(@t)*(1.0 - ad.val(alpha))
+				return
+			end
+		end end)]
+		var c = self.premultColors:getPointer(index)
+		@c = @c + (@t*alpha)*color
+		@t = @t*(1.0 - alpha)
+	end
+	util.inline(ImplicitSamplerT.methods.accumulateFrontToBack)
+
+	terra ImplicitSamplerT:isSaturated(index: uint) : bool
+		return ad.val(self.transmittances(index)) <= self.transmittanceCutoff
+	end
+	util.inline(ImplicitSamplerT.methods.isSaturated)
+
+	-- Composite the accumulated colors over what was in the sampled function before
+	terra ImplicitSamplerT:finishFrontToBack(start: uint, stop: uint)
+		-- (Logged contributions are composited by flushAccumulation instead)
+		[util.optionally(canLogUnder, function() return quote
+			if self.sampledFn:isAggregating() then return end
+		end end)]
+		for i=start,stop do
+			var under = self.sampledFn:getSample(i)
+			self.sampledFn:setSample(i, self.premultColors(i) + self.transmittances(i)*under)
+		end
+	end
+
+	-- Extract the per-dimension coordinates of a grid pattern, and check that every
+	--    sample lies exactly on them (so rows of samples can be evaluated in bulk).
+	terra ImplicitSamplerT:buildAxes(pattern: &SamplingPattern) : bool
+		self.axes:clear()
+		var stride = self.grid:numSamples()
+		for d=0,dim do
+			var n = self.grid.numCells(d)
+			stride = stride / n
+			self.axisOffsets[d] = self.axes.size
+			for c=0,n do
+				self.axes:push(pattern:getPointer(c*stride).entries[d])
+			end
+		end
+		for i=0,pattern.size do
+			var p = pattern:getPointer(i)
+			var rem = i
+			for dd=0,dim do
+				var d = dim-1-dd
+				var n = self.grid.numCells(d)
+				if p.entries[d] ~= self.axes(self.axisOffsets[d] + rem % n) then
+					return false
+				end
+				rem = rem / n
+			end
+		end
+		return true
+	end
+
+	-- Per-dimension sample coordinates of a pattern generated from self.grid, computed
+	--    from the grid rather than read off the samples
+	terra ImplicitSamplerT:buildAxesFromGrid() : {}
+		self.axes:clear()
+		for d=0,dim do
+			self.axisOffsets[d] = self.axes.size
+			for c=0,self.grid.numCells(d) do
+				self.axes:push(self.grid:cellCenter(d, c))
+			end
+		end
+	end
+
+	-- Figure out whether 'pattern' is a regular grid, so that we can visit only
+	--    the samples covered by each shape's bounds.
+	-- Patterns materialized from a RegularGridSamplingPattern know their grid, so
+	--    they need not be scanned.
+	terra ImplicitSamplerT:updatePatternStructure(pattern: &SamplingPattern)
+		if pattern ~= self.gridPattern or pattern.size ~= self.gridPatternSize then
+			self.gridPattern = pattern
+			self.gridPatternSize = pattern.size
+			var shared = SharedPatternT.findStorage(pattern)
+			if shared ~= nil and shared.hasGrid then
+				self.grid = shared.grid
+				self.patternIsGrid = true
+				self:buildAxesFromGrid()
+				self.patternIsSeparable = true
+			else
+				self.patternIsGrid = self.grid:detect(pattern)
+				self.patternIsSeparable = false
+				if self.patternIsGrid then
+					self.patternIsSeparable = self:buildAxes(pattern)
+				end
+			end
+		end
+	end
+
+	-- Split the samples of 'pattern' into tiles of contiguous indices.
+	-- On grids, tiles are whole slabs along the outermost dimension, so that each
+	--    shape's cell range can be clipped to the tile.
+	terra ImplicitSamplerT:updateTiles(pattern: &SamplingPattern)
+		if pattern == self.tilePattern and pattern.size == self.tilePatternSize and
+		   self.numThreads == self.tileThreads then
+			return
+		end
+		self.tilePattern = pattern
+		self.tilePatternSize = pattern.size
+		self.tileThreads = self.numThreads
+		self.frameValid = false
+		self.tiles:clear()
+		self.tileShapes:clear()
+		var N = pattern.size
+		if N == 0 then return end
+		var granularity = [uint](1)
+		if self.patternIsGrid then granularity = N / self.grid.numCells(0) end
+		var numTiles = self.numThreads * tilesPerThread
+		var unitsPerTile = (N/granularity + numTiles - 1) / numTiles
+		var tileSize = unitsPerTile * granularity
+		var start = [uint](0)
+		while start < N do
+			var stop = start + tileSize
+			if stop > N then stop = N end
+			var tile = SampleTile { start, stop, BBoxT.stackAlloc() }
+			for i=start,stop do
+				tile.bounds:expand(pattern:getPointer(i))
+			end
+			self.tiles:push(tile)
+			self.tileShapes:push([Vector(uint)].stackAlloc())
+			start = stop
+		end
+	end
+
+	-- Assign each shape to every tile that its (expanded) bounds overlap,
+	--    preserving shape order within each tile.
+	terra ImplicitSamplerT:binShapes(expansion: double)
+		self.shapeBounds:clear()
+		for t=0,self.tileShapes.size do
+			self.tileShapes:getPointer(t):clear()
+		end
+		for shapei=0,self.shapes.size do
+			var bounds = self.shapes:getPointer(shapei):bounds()
+			bounds:expand(expansion)
+			self.shapeBounds:push(bounds)
+			for t=0,self.tiles.size do
+				if self.tiles:getPointer(t).bounds:intersects(&bounds) then
+					self.tileShapes:getPointer(t):push(shapei)
+				end
+			end
+		end
+	end
+
+	-- Whether tile t has the same shapes (in the same order) as in the previous frame
+	terra ImplicitSamplerT:tileUnchanged(t: uint) : bool
+		var prev = self.frameTileShapes:getPointer(t)
+		var curr = self.tileShapes:getPointer(t)
+		if prev.size ~= curr.size then return false end
+		for k=0,curr.size do
+			if not self.shapes:getPointer(curr(k)):sameAs(prev:getPointer(k)) then
+				return false
+			end
+		end
+		return true
+	end
+
+	-- Generate code to composite 'color' with opacity 'alpha' into sample 'index'
+	local function accumulate(frontToBack, self, index, color, alpha)
+		local accum
+		if frontToBack then
+			accum = `[self]:accumulateFrontToBack([index], [color], [alpha])
+		else
+			accum = `[self].sampledFn:accumulateSample([index], [color], [alpha])
+		end
+		return quote
+			[accum]
+			instr.count("samplesAccumulated")
+		end
+	end
+
+	-- Rebuild the BVH over the shapes' (expanded) bounds
+	terra ImplicitSamplerT:buildShapeHierarchy(expansion: double)
+		self.shapeBounds:clear()
+		self.shapeMinIsovalues:clear()
+		for shapei=0,self.shapes.size do
+			var shape = self.shapes:getPointer(shapei)
+			var bounds = shape:bounds()
+			bounds:expand(expansion)
+			self.shapeBounds:push(bounds)
+			self.shapeMinIsovalues:push(shape:minIsovalue())
+		end
+		self.bvh:build(&self.shapeBounds)
+	end
+
+	local useTwoField = true
+	local secondFieldMult = 20.0
+	local function accumSharp(frontToBack, self, index, isovalue, color, alpha)
+		return quote
+			if [isovalue] <= 0.0 then [accumulate(frontToBack, self, index, color, alpha)] end
+		end
+	end
+	local function accumSmoothOneField(frontToBack, self, index, isovalue, color, alpha, smoothParam)
+		return quote
+			var sp = [smoothParam]
+			var spv = ad.val(sp)
+			var ivv = ad.val([isovalue])
+			if ivv < -spv*logSmoothAlphaThresh then
+				-- var alphaS = ad.math.exp(-[isovalue] / sp)
+				var alphaS = smoothAlpha([isovalue], sp)
+				instr.count("expEvals")
+				[accumulate(frontToBack, self, index, color, `alphaS*alpha)]
+			end
+		end
+	end
+	local function accumSmoothTwoField(frontToBack, self, index, isovalue, color, alpha, smoothParam)
+		return quote
+			var sp = [smoothParam]
+			var spv = ad.val(sp)
+			var ivv = ad.val([isovalue])
+			if ivv < -spv*secondFieldMult*logSmoothAlphaThresh then
+				var alphaNarrow = 0.9*smoothAlpha([isovalue], sp)
+				var alphaWide = 0.1*smoothAlpha([isovalue], sp*secondFieldMult)
+				instr.count("expEvals", 2)
+				-- The wide field goes over the narrow one, so front-to-back visits it first
+				[frontToBack and quote
+					[accumulate(frontToBack, self, index, color, `alpha*alphaWide)]
+					[accumulate(frontToBack, self, index, color, `alpha*alphaNarrow)]
+				end or quote
+					[accumulate(frontToBack, self, index, color, `alpha*alphaNarrow)]
+					[accumulate(frontToBack, self, index, color, `alpha*alphaWide)]
+				end]
+			end
+		end
+	end
+	local function accumSmooth(frontToBack, self, index, isovalue, color, alpha, smoothParam)
+		if useTwoField then
+			return accumSmoothTwoField(frontToBack, self, index, isovalue, color, alpha, smoothParam)
+		else
+			return accumSmoothOneField(frontToBack, self, index, isovalue, color, alpha, smoothParam)
+		end
+	end
+	-- How far to expand shape bounds so that they cover every sample with non-negligible
+	--    smoothed alpha.
+	local function boundsExpansion(smoothParam)
+		local factor = useTwoField and `ad.val(smoothParam)*secondFieldMult or `ad.val(smoothParam)
+		return `ad.math.sqrt(-[factor]*logSmoothAlphaThresh)
+	end
+
+	-- Generate code to accumulate one shape's contribution at sample index 'sampi'
+	local function genAccum(smoothing, frontToBack, self, smoothParam, miniv, sampi, isovalue, color, alpha)
+		return quote
+			var iv = [isovalue]
+			[smoothing and (quote iv = iv - [miniv] end) or quote end]
+			[smoothing and accumSmooth(frontToBack, self, sampi, iv, color, alpha, smoothParam) or
+						   accumSharp(frontToBack, self, sampi, iv, color, alpha)]
+		end
+	end
+
+	-- Generate a test for whether sample 'sampi' should still be visited
+	local function notSaturated(frontToBack, self, sampi)
+		return frontToBack and `not [self]:isSaturated([sampi]) or `true
+	end
+
+	-- Generate code to sample one shape at sample index 'sampi'
+	-- 'evalFn' generates the (statically dispatched) shape evaluation; see ShapeRecord.dispatch
+	local function genSampleAt(smoothing, frontToBack, self, pattern, smoothParam, evalFn, miniv, bounds, sampi)
+		return quote
+			var samplePoint = [pattern]:getPointer([sampi])
+			instr.count("samplesTested")
+			if [bounds]:contains(samplePoint) and [notSaturated(frontToBack, self, sampi)] then
+				var isovalue, color, alpha = [evalFn(`@samplePoint)]
+				[genAccum(smoothing, frontToBack, self, smoothParam, miniv, sampi, isovalue, color, alpha)]
 			end
 		end
-		local function accumSmoothOneField(self, index, isovalue, color, alpha, smoothParam)
+	end
+
+	-- Number of samples along a grid row evaluated per call to a row kernel
+	local rowChunkSize = 64
+
+	-- Generate code to sample one shape at every grid cell in [lo, hi).
+	-- When the pattern is separable and the shape has a vectorized row kernel, walk the
+	--    grid one row (run of the innermost dimension) at a time, trimming each row to the
+	--    samples strictly inside 'bounds' (the same test BBox:contains does).
+	local function genVisitGridCells(smoothing, frontToBack, self, pattern, smoothParam, evalFn, rowEvalFn,
+									 miniv, bounds, lo, hi)
+		local function sampleAt(sampi)
+			return genSampleAt(smoothing, frontToBack, self, pattern, smoothParam, evalFn, miniv, bounds, sampi)
+		end
+		local indexLoop = RegularGridT.foreachIndexInRange(`[self].grid, lo, hi, sampleAt)
+		if not rowEvalFn then return indexLoop end
+		local base = symbol(Shape.SpaceVec, "base")
+		local function buildRowLoop(whichDim, baseIndex)
+			local bmin = `[bounds].mins.entries[whichDim]
+			local bmax = `[bounds].maxs.entries[whichDim]
+			if whichDim == dim-1 then
+				return quote
+					var axis = [self].axes:getPointer([self].axisOffsets[whichDim])
+					var j0 = [lo].entries[whichDim]
+					var j1 = [hi].entries[whichDim]
+					while j0 < j1 and not (axis[j0] > [bmin]) do j0 = j0 + 1 end
+					while j1 > j0 and not (axis[j1-1] < [bmax]) do j1 = j1 - 1 end
+					var rowStart = [baseIndex]*[self].grid.numCells.entries[whichDim]
+					var isovalues : double[rowChunkSize]
+					var j = j0
+					while j < j1 do
+						var n = j1 - j
+						if n > rowChunkSize then n = rowChunkSize end
+						var color, alpha = [rowEvalFn(base, `axis + j, n, `&isovalues[0])]
+						instr.count("samplesTested", n)
+						for k=0,n do
+							var sampi = rowStart + j + k
+							if [notSaturated(frontToBack, self, sampi)] then
+								[genAccum(smoothing, frontToBack, self, smoothParam, miniv, sampi, `isovalues[k], color, alpha)]
+							end
+						end
+						j = j + n
+					end
+				end
+			else
+				local index = symbol(uint, "index")
+				return quote
+					var axis = [self].axes:getPointer([self].axisOffsets[whichDim])
+					for c=[lo].entries[whichDim],[hi].entries[whichDim] do
+						var x = axis[c]
+						if x > [bmin] and x < [bmax] then
+							[base].entries[whichDim] = x
+							var [index] = [baseIndex]*[self].grid.numCells.entries[whichDim] + c
+							[buildRowLoop(whichDim+1, index)]
+						end
+					end
+				end
+			end
+		end
+		return quote
+			if [self].patternIsSeparable then
+				var [base] : Shape.SpaceVec
+				[buildRowLoop(0, `[uint](0))]
+			else
+				[indexLoop]
+			end
+		end
+	end
+
+	-- Sample the shapes binned into one tile (called concurrently for different tiles)
+	local function buildTileSampleFunction(smoothing, frontToBack)
+		local self = symbol(&ImplicitSamplerT, "self")
+		local pattern = symbol(&SamplingPattern, "pattern")
+		local smoothParam = symbol(real, "smoothParam")
+		local tile = symbol(&SampleTile, "tile")
+		local shape = symbol(&ShapeRecordT, "shape")
+		local miniv = symbol(real, "miniv")
+		local bounds = symbol(BBoxT, "bounds")
+		local function visitSamples(evalFn, rowEvalFn)
+			local function sampleAt(sampi)
+				return genSampleAt(smoothing, frontToBack, self, pattern, smoothParam, evalFn, miniv, bounds, sampi)
+			end
 			return quote
-				var sp = [smoothParam]
-				var spv = ad.val(sp)
-				var ivv = ad.val([isovalue])
-				if ivv < -spv*logSmoothAlphaThresh then
-					-- var alphaS = ad.math.exp(-[isovalue] / sp)
-					var alphaS = smoothAlpha([isovalue], sp)
-					[self].sampledFn:accumulateSample([index], [color], alphaS*alpha)
+				if [self].patternIsGrid then
+					var lo, hi = [self].grid:cellRange([bounds].mins, [bounds].maxs)
+					-- Clip to this tile's slab of cells
+					var slabSize = [self].grid:numSamples() / [self].grid.numCells(0)
+					var tileLo = [tile].start / slabSize
+					var tileHi = [tile].stop / slabSize
+					if lo(0) < tileLo then lo(0) = tileLo end
+					if hi(0) > tileHi then hi(0) = tileHi end
+					[genVisitGridCells(smoothing, frontToBack, self, pattern, smoothParam, evalFn, rowEvalFn,
+									   miniv, bounds, lo, hi)]
+				else
+					for sampi=[tile].start,[tile].stop do
+						[sampleAt(sampi)]
+					end
+				end
+			end
+		end
+		return terra([self], [pattern], [smoothParam], tilei: uint) : {}
+			var [tile] = [self].tiles:getPointer(tilei)
+			var tileShapes = [self].tileShapes:getPointer(tilei)
+			[util.optionally(frontToBack, function() return quote
+				[self]:beginFrontToBack([tile].start, [tile].stop)
+			end end)]
+			for kk=0,tileShapes.size do
+				var k = [frontToBack and (`tileShapes.size-1-kk) or kk]
+				var shapei = tileShapes(k)
+				var [shape] = [self].shapes:getPointer(shapei)
+				var [miniv] = [shape]:minIsovalue()
+				var [bounds] = [self].shapeBounds(shapei)
+				[ShapeRecordT.dispatch(shape, visitSamples)]
+			end
+			[util.optionally(frontToBack, function() return quote
+				[self]:finishFrontToBack([tile].start, [tile].stop)
+			end end)]
+		end
+	end
+
+	local function buildParallelSampleFunction(smoothing, frontToBack)
+		local struct TileContext
+		{
+			sampler: &ImplicitSamplerT,
+			pattern: &SamplingPattern,
+			smoothParam: real
+		}
+		local sampleTile = buildTileSampleFunction(smoothing, frontToBack)
+		local terra tileTask(ctx: &TileContext, tilei: uint) : {}
+			sampleTile(ctx.sampler, ctx.pattern, ctx.smoothParam, tilei)
+		end
+		local runTiles = threadPool.parallelFor(TileContext, tileTask)
+		local expansion = smoothing and boundsExpansion or function() return `0.0 end
+		return terra(self: &ImplicitSamplerT, pattern: &SamplingPattern, smoothParam: real) : {}
+			self:updateTiles(pattern)
+			self:binShapes([expansion(smoothParam)])
+			var ctx = TileContext { self, pattern, smoothParam }
+			runTiles(&ctx, self.tiles.size, self.numThreads)
+		end
+	end
+
+	local function buildIncrementalSampleFunction(smoothing, frontToBack)
+		local struct DirtyTileContext
+		{
+			sampler: &ImplicitSamplerT,
+			pattern: &SamplingPattern,
+			smoothParam: real
+		}
+		local sampleTile = buildTileSampleFunction(smoothing, frontToBack)
+		local terra dirtyTileTask(ctx: &DirtyTileContext, k: uint) : {}
+			sampleTile(ctx.sampler, ctx.pattern, ctx.smoothParam, ctx.sampler.dirtyTiles(k))
+		end
+		local runDirtyTiles = threadPool.parallelFor(DirtyTileContext, dirtyTileTask)
+		local expansion = smoothing and boundsExpansion or function() return `0.0 end
+		return terra(self: &ImplicitSamplerT, pattern: &SamplingPattern, smoothParam: real) : {}
+			self:updateTiles(pattern)
+			self:binShapes([expansion(smoothParam)])
+			if self.frameSmoothing ~= smoothing or self.frameSmoothParam ~= smoothParam then
+				self.frameValid = false
+			end
+			if not self.frameValid then
+				self.frameSamples:resize(pattern.size)
+				self.frameTileShapes:clear()
+				for t=0,self.tiles.size do
+					self.frameTileShapes:push([Vector(ShapeRecordT)].stackAlloc())
+				end
+			end
+			-- Copy over unchanged tiles; collect the rest for re-rendering
+			self.dirtyTiles:clear()
+			for t=0,self.tiles.size do
+				var tile = self.tiles:getPointer(t)
+				if self.frameValid and self:tileUnchanged(t) then
+					for i=tile.start,tile.stop do
+						self.sampledFn:setSample(i, self.frameSamples(i))
+					end
+				else
+					self.dirtyTiles:push(t)
+				end
+			end
+			var ctx = DirtyTileContext { self, pattern, smoothParam }
+			runDirtyTiles(&ctx, self.dirtyTiles.size, self.numThreads)
+			-- Remember the re-rendered tiles for the next frame
+			for k=0,self.dirtyTiles.size do
+				var t = self.dirtyTiles(k)
+				var tile = self.tiles:getPointer(t)
+				for i=tile.start,tile.stop do
+					self.frameSamples:set(i, self.sampledFn:getSample(i))
+				end
+				var prev = self.frameTileShapes:getPointer(t)
+				var curr = self.tileShapes:getPointer(t)
+				prev:clear()
+				for j=0,curr.size do
+					prev:push(self.shapes(curr(j)))
 				end
 			end
+			self.frameSmoothing = smoothing
+			self.frameSmoothParam = smoothParam
+			self.frameValid = true
 		end
-		local function accumSmoothTwoField(self, index, isovalue, color, alpha, smoothParam)
+	end
+
+	-- Sample-major traversal: for each sample, visit only the shapes whose bounds
+	--    contain it (in order), as reported by the shape BVH.
+	local function buildSampleMajorFunction(smoothing, frontToBack)
+		local self = symbol(&ImplicitSamplerT, "self")
+		local pattern = symbol(&SamplingPattern, "pattern")
+		local smoothParam = symbol(real, "smoothParam")
+		local samplePoint = symbol(&SampledFunctionT.SpaceVec, "samplePoint")
+		local sampi = symbol(uint, "sampi")
+		local miniv = symbol(real, "miniv")
+		local function visitSample(evalFn)
 			return quote
-				var sp = [smoothParam]
-				var spv = ad.val(sp)
-				var ivv = ad.val([isovalue])
-				if ivv < -spv*secondFieldMult*logSmoothAlphaThresh then
-					var alphaS = 0.9*smoothAlpha([isovalue], sp)
-					[self].sampledFn:accumulateSample([index], [color], alpha*alphaS)
-					alphaS = 0.1*smoothAlpha([isovalue], sp*secondFieldMult)
-					[self].sampledFn:accumulateSample([index], [color], alpha*alphaS)
+				var isovalue, color, alpha = [evalFn(`@[samplePoint])]
+				[genAccum(smoothing, frontToBack, self, smoothParam, miniv, sampi, isovalue, color, alpha)]
+			end
+		end
+		local terra sampleRange([self], [pattern], [smoothParam], start: uint, stop: uint) : {}
+			var hits = [Vector(uint)].stackAlloc()
+			[util.optionally(frontToBack, function() return quote
+				[self]:beginFrontToBack(start, stop)
+			end end)]
+			for [sampi]=start,stop do
+				var [samplePoint] = [pattern]:getPointer([sampi])
+				[self].bvh:query([samplePoint], &hits)
+				instr.count("samplesTested", hits.size)
+				for kk=0,hits.size do
+					var k = [frontToBack and (`hits.size-1-kk) or kk]
+					[util.optionally(frontToBack, function() return quote
+						if [self]:isSaturated([sampi]) then break end
+					end end)]
+					var shapei = hits(k)
+					var shape = [self].shapes:getPointer(shapei)
+					var [miniv] = [self].shapeMinIsovalues(shapei)
+					[ShapeRecordT.dispatch(shape, visitSample)]
 				end
 			end
+			[util.optionally(frontToBack, function() return quote
+				[self]:finishFrontToBack(start, stop)
+			end end)]
+			m.destruct(hits)
 		end
-		local function accumSmooth(self, index, isovalue, color, alpha, smoothParam)
-			if useTwoField then
-				return accumSmoothTwoField(self, index, isovalue, color, alpha, smoothParam)
-			else
-				return accumSmoothOneField(self, index, isovalue, color, alpha, smoothParam)
+		local struct RangeContext
+		{
+			sampler: &ImplicitSamplerT,
+			pattern: &SamplingPattern,
+			smoothParam: real
+		}
+		local terra rangeTask(ctx: &RangeContext, tilei: uint) : {}
+			var tile = ctx.sampler.tiles:getPointer(tilei)
+			sampleRange(ctx.sampler, ctx.pattern, ctx.smoothParam, tile.start, tile.stop)
+		end
+		local runRanges = canParallelize and threadPool.parallelFor(RangeContext, rangeTask)
+		local expansion = smoothing and boundsExpansion or function() return `0.0 end
+		return terra([self], [pattern], [smoothParam]) : {}
+			[self]:buildShapeHierarchy([expansion(smoothParam)])
+			[util.optionally(canParallelize, function() return quote
+				if [self].numThreads > 1 then
+					[self]:updateTiles([pattern])
+					var ctx = RangeContext { [self], [pattern], [smoothParam] }
+					runRanges(&ctx, [self].tiles.size, [self].numThreads)
+					return
+				end
+			end end)]
+			sampleRange([self], [pattern], [smoothParam], 0, [pattern].size)
+		end
+	end
+
+	local function buildVariantSampleFunction(smoothing, frontToBack)
+		local self = symbol(&ImplicitSamplerT, "self")
+		local pattern = symbol(&SamplingPattern, "pattern")
+		local smoothParam = symbol(real, "smoothParam")
+		local shape = symbol(&ShapeRecordT, "shape")
+		local miniv = symbol(real, "miniv")
+		local bounds = symbol(BBoxT, "bounds")
+		local function visitSamples(evalFn, rowEvalFn)
+			local function sampleAt(sampi)
+				return genSampleAt(smoothing, frontToBack, self, pattern, smoothParam, evalFn, miniv, bounds, sampi)
+			end
+			return quote
+				if [self].patternIsGrid then
+					-- Only visit the grid cells covered by the shape's bounds
+					var lo, hi = [self].grid:cellRange([bounds].mins, [bounds].maxs)
+					[genVisitGridCells(smoothing, frontToBack, self, pattern, smoothParam, evalFn, rowEvalFn,
+									   miniv, bounds, lo, hi)]
+				else
+					for sampi=0,[pattern].size do
+						[sampleAt(sampi)]
+					end
+				end
 			end
 		end
-		local function expandBounds(bounds, smoothParam)
-			return quote [bounds]:expand(ad.math.sqrt(-smoothParam*logSmoothAlphaThresh)) end
+		local sampleParallel = canParallelize and buildParallelSampleFunction(smoothing, frontToBack)
+		local sampleIncremental = canParallelize and buildIncrementalSampleFunction(smoothing, frontToBack)
+		local sampleMajor = buildSampleMajorFunction(smoothing, frontToBack)
+		return terra([self], [pattern], [smoothParam]) : {}
+			if [self].useBVH then
+				sampleMajor([self], [pattern], [smoothParam])
+				return
+			end
+			[util.optionally(canParallelize, function() return quote
+				if [self].incremental then
+					sampleIncremental([self], [pattern], [smoothParam])
+					return
+				end
+				if [self].numThreads > 1 then
+					sampleParallel([self], [pattern], [smoothParam])
+					return
+				end
+			end end)]
+			[util.optionally(frontToBack, function() return quote
+				[self]:beginFrontToBack(0, [pattern].size)
+			end end)]
+			for shapeii=0,[self].shapes.size do
+				var shapei = [frontToBack and (`[self].shapes.size-1-shapeii) or shapeii]
+				var [shape] = [self].shapes:getPointer(shapei)
+				var [miniv] = [shape]:minIsovalue()
+				var [bounds] = [shape]:bounds()
+				[smoothing and (quote [bounds]:expand([boundsExpansion(smoothParam)]) end) or quote end]
+				-- Branch on the shape's kind once, outside of the per-sample loop
+				[ShapeRecordT.dispatch(shape, visitSamples)]
+			end
+			[util.optionally(frontToBack, function() return quote
+				[self]:finishFrontToBack(0, [pattern].size)
+			end end)]
 		end
+	end
+
+	local function buildSampleFunction(smoothing)
 		local self = symbol(&ImplicitSamplerT, "self")
 		local pattern = symbol(&SamplingPattern, "pattern")
 		local smoothParam = symbol(real, "smoothParam")
 		local params = {self, pattern}
-		local boundsExpansionFactor = `ad.val(smoothParam)
 		if smoothing then table.insert(params, smoothParam) end
-		if useTwoField then boundsExpansionFactor = `ad.val(smoothParam)*secondFieldMult end
+		local sp = smoothing and smoothParam or `[real](0.0)
+		local sampleBackToFront = buildVariantSampleFunction(smoothing, false)
+		local sampleFrontToBack = canFrontToBack and buildVariantSampleFunction(smoothing, true)
+		-- Composite any contributions the sampled function deferred
+		local flushAccumulation = util.optionally(SampledFunctionT.methods.flushAccumulation ~= nil, function() return quote
+			[self].sampledFn:flushAccumulation()
+		end end)
 		return terra([params])
 			[self].sampledFn:setSamplingPattern([pattern])
-			for shapei=0,[self].shapes.size do
-				var shape = [self].shapes:get(shapei)
-				var miniv = shape:minIsovalue()
-				var bounds = shape:bounds()
-				[smoothing and expandBounds(bounds, boundsExpansionFactor) or quote end]
-				for sampi=0,[pattern].size do
-					var samplePoint = [pattern]:getPointer(sampi)
-					if bounds:contains(samplePoint) then
-						var isovalue, color, alpha = shape:isovalueAndColor(@samplePoint)
-						[smoothing and (quote isovalue = isovalue - miniv end) or quote end]
-						[smoothing and accumSmooth(self, sampi, isovalue, color, alpha, smoothParam) or
-									   accumSharp(self, sampi, isovalue, color, alpha)]
-					end
+			[util.optionally(smoothing and real == ad.num, function() return quote
+				if [self].fusedScoring then
+					[self].pendingPattern = [pattern]
+					[self].pendingSmoothParam = [smoothParam]
+					return
 				end
-			end
+			end end)]
+			[self]:updatePatternStructure([pattern])
+			[util.optionally(canFrontToBack, function() return quote
+				if [self].frontToBack then
+					[self]:prepareFrontToBack([pattern].size)
+					sampleFrontToBack([self], [pattern], [sp])
+					[flushAccumulation]
+					return
+				end
+			end end)]
+			sampleBackToFront([self], [pattern], [sp])
+			[flushAccumulation]
 		end
 	end
 
 	ImplicitSamplerT.methods.sampleSharp = buildSampleFunction(false)
 	ImplicitSamplerT.methods.sampleSmooth = buildSampleFunction(true)
 
+	-- Fused smooth rendering + MSE scoring for AD renders.
+	-- Recording a smooth render on the AD tape costs several nodes per sample per
+	--    covering shape, and the MSE adds a few more per sample. Instead, once
+	--    setFusedScoring(true) is called, sampleSmooth only records its arguments,
+	--    and fusedMseComps then renders and scores in plain doubles, differentiates
+	--    both by hand in a reverse pass over each sample's compositing chain, and puts
+	--    just one node per shape parameter on the tape.
+	-- Requires 'over' compositing and spheres/capsules only. The sampled function
+	--    itself is not filled in.
+	if real == ad.num and colorReal == ad.num and canFrontToBack then
+		local numChannels = SampledFunctionT.ColorVec.Dimension
+		local DVec = Vec(double, dim)
+		local DColor = Color(double, numChannels)
+		local Kind = ShapeRecordT.Kind
+
+		-- Parameter values of one shape, and the gradients of the (zero-target,
+		--    nonzero-target) error terms w.r.t. those parameters
+		local struct FusedShape
+		{
+			p0: DVec,
+			p1: DVec,
+			axis: DVec,
+			sqLen: double,
+			rSq: double,
+			color: DColor,
+			alpha: double,
+			gradP0: DVec[2],
+			gradP1: DVec[2],
+			gradColor: DColor[2],
+			gradAlpha: double[2]
+		}
+
+		-- One 'over' compositing step at a sample
+		local struct FusedLayer
+		{
+			shapei: uint,
+			-- alpha = shape alpha * weight
+			weight: double,
+			alpha: double,
+			-- Effective smoothing parameter (and its multiple of the real one)
+			s: double,
+			sMult: double,
+			-- Squared distance to the shape's core, and its gradient w.r.t. p0/p1
+			ivs: double,
+			gradIvsP0: DVec,
+			gradIvsP1: DVec,
+			under: DColor
+		}
+
+		terra ImplicitSamplerT:setFusedScoring(enabled: bool)
+			self.fusedScoring = enabled
+			self.pendingPattern = nil
+		end
+
+		-- Whether fusedMseComps can handle the current render: there must be a deferred
+		--    sampleSmooth (priors may well have rendered with sampleSharp instead), all
+		--    shapes must be spheres or capsules, and front-to-back compositing must be
+		--    lossless (fused scoring has no notion of saturation).
+		terra ImplicitSamplerT:canFuseScoring() : bool
+			if self.pendingPattern == nil then return false end
+			if self.frontToBack and self.transmittanceCutoff > 0.0 then return false end
+			for shapei=0,self.shapes.size do
+				if self.shapes:getPointer(shapei).kind == [Kind.Virtual] then return false end
+			end
+			return true
+		end
+
+		-- Fallback for renders that cannot be fused: do the deferred render normally
+		--    (if there is one; otherwise the samples are already rendered)
+		terra ImplicitSamplerT:renderPending()
+			var pattern = self.pendingPattern
+			if pattern == nil then return end
+			self.pendingPattern = nil
+			self.fusedScoring = false
+			self:sampleSmooth(pattern, self.pendingSmoothParam)
+			self.fusedScoring = true
+		end
+
+		-- Composite one smoothing field of a shape and log it for the reverse pass
+		local function fusedLayer(layers, color, fs, shapei, ivs, gradP0, gradP1, spv, sMult, weight)
+			return quote
+				var s = [spv]*[sMult]
+				var w = [weight]*smoothAlpha([ivs], s)
+				var a = [fs].alpha*w
+				[layers]:push(FusedLayer { [shapei], w, a, s, [sMult], [ivs], [gradP0], [gradP1], [color] })
+				instr.count("expEvals")
+				instr.count("samplesAccumulated")
+				[color] = (1.0 - a)*[color] + a*[fs].color
+			end
+		end
+
+		ImplicitSamplerT.fusedMseComps = templatize(function(TargetT)
+			return terra(self: &ImplicitSamplerT, target: &TargetT) : {real, real}
+				var pattern = self.pendingPattern
+				if pattern == nil then
+					util.fatalError("fusedMseComps called without a pending sampleSmooth.\n")
+				end
+				if pattern ~= target.samplingPattern then
+					util.fatalError("Attempt to compare two sample sets drawn from different sampling patterns.\n")
+				end
+				self.pendingPattern = nil
+				var sp = self.pendingSmoothParam
+				var spv = ad.val(sp)
+				self:buildShapeHierarchy([boundsExpansion(sp)])
+
+				var fshapes = [Vector(FusedShape)].stackAlloc()
+				fshapes:resize(self.shapes.size)
+				for shapei=0,self.shapes.size do
+					var rec = self.shapes:getPointer(shapei)
+					var fs = fshapes:getPointer(shapei)
+					if rec.kind == [Kind.Sphere] then
+						fs.p0 = ad.val(rec.sphere.center)
+						fs.rSq = ad.val(rec.sphere.rSq)
+					elseif rec.kind == [Kind.Capsule] then
+						fs.p0 = ad.val(rec.capsule.bot)
+						fs.p1 = ad.val(rec.capsule.top)
+						fs.axis = ad.val(rec.capsule.topMinusBot)
+						fs.sqLen = ad.val(rec.capsule.sqLen)
+						fs.rSq = ad.val(rec.capsule.rSq)
+					else
+						util.fatalError("Fused scoring only supports sphere and capsule shapes.\n")
+					end
+					fs.color = ad.val(rec.color)
+					fs.alpha = ad.val(rec.alpha)
+					for which=0,2 do
+						fs.gradP0[which] = DVec.stackAlloc(0.0)
+						fs.gradP1[which] = DVec.stackAlloc(0.0)
+						fs.gradColor[which] = DColor.stackAlloc(0.0)
+						fs.gradAlpha[which] = 0.0
+					end
+				end
+
+				var N = pattern.size
+				var errs : double[2]
+				var gradSp : double[2]
+				for which=0,2 do errs[which] = 0.0; gradSp[which] = 0.0 end
+				var hits = [Vector(uint)].stackAlloc()
+				var layers = [Vector(FusedLayer)].stackAlloc()
+				for i=0,N do
+					var p = pattern:getPointer(i)
+					var color = ad.val(self.sampledFn:getSample(i))
+					-- Forward: composite the shapes covering this sample, in order
+					self.bvh:query(p, &hits)
+					instr.count("samplesTested", hits.size)
+					layers:clear()
+					for k=0,hits.size do
+						var shapei = hits(k)
+						var fs = fshapes:getPointer(shapei)
+						-- Same arithmetic as isovalueImpl - minIsovalueImpl
+						var iv : double
+						var gradP0 : DVec
+						var gradP1 = DVec.stackAlloc(0.0)
+						if self.shapes:getPointer(shapei).kind == [Kind.Sphere] then
+							iv = p:distSq(fs.p0) - fs.rSq
+							gradP0 = -2.0*(@p - fs.p0)
+						else
+							-- (Zero-length capsules are spheres around p0)
+							var t = 0.0
+							if fs.sqLen ~= 0.0 then t = (@p - fs.p0):dot(fs.axis) / fs.sqLen end
+							var tc = t
+							var closest : DVec
+							if t < 0.0 then
+								tc = 0.0
+								closest = fs.p0
+							elseif t > 1.0 then
+								tc = 1.0
+								closest = fs.p1
+							else
+								closest = fs.p0 + t*fs.axis
+							end
+							iv = p:distSq(closest) - fs.rSq
+							var e = @p - closest
+							gradP0 = (-2.0*(1.0 - tc))*e
+							gradP1 = (-2.0*tc)*e
+						end
+						var ivs = iv - (-fs.rSq)
+						[useTwoField and quote
+							if ivs < -spv*secondFieldMult*logSmoothAlphaThresh then
+								[fusedLayer(layers, color, fs, shapei, ivs, gradP0, gradP1, spv, `1.0, `0.9)]
+								[fusedLayer(layers, color, fs, shapei, ivs, gradP0, gradP1, spv, `secondFieldMult, `0.1)]
+							end
+						end or quote
+							if ivs < -spv*logSmoothAlphaThresh then
+								[fusedLayer(layers, color, fs, shapei, ivs, gradP0, gradP1, spv, `1.0, `1.0)]
+							end
+						end]
+					end
+					-- Score
+					var tgt = ad.val(target:getSample(i))
+					var which = 1
+					if tgt == 0.0 then which = 0 end
+					var diff = color - tgt
+					errs[which] = errs[which] + diff:dot(diff)
+					-- Reverse: back through the compositing chain
+					var g = (2.0/N)*diff
+					var l = layers.size
+					while l > 0 do
+						l = l - 1
+						var layer = layers:getPointer(l)
+						var fs = fshapes:getPointer(layer.shapei)
+						var gAlpha = g:dot(fs.color - layer.under)
+						fs.gradColor[which] = fs.gradColor[which] + layer.alpha*g
+						g = (1.0 - layer.alpha)*g
+						fs.gradAlpha[which] = fs.gradAlpha[which] + gAlpha*layer.weight
+						-- alpha = shape alpha * weight * exp(-ivs/s)
+						var gExponent = gAlpha*layer.alpha
+						var gIvs = -gExponent/layer.s
+						gradSp[which] = gradSp[which] + gExponent*layer.ivs/(layer.s*layer.s)*layer.sMult
+						fs.gradP0[which] = fs.gradP0[which] + gIvs*layer.gradIvsP0
+						fs.gradP1[which] = fs.gradP1[which] + gIvs*layer.gradIvsP1
+					end
+				end
+				m.destruct(hits)
+				m.destruct(layers)
+
+				-- Put the errors on the tape, with their gradients attached to the shape parameters
+				var results : real[2]
+				for which=0,2 do
+					var acc = [real](errs[which] / N)
+					for shapei=0,self.shapes.size do
+						var rec = self.shapes:getPointer(shapei)
+						var fs = fshapes:getPointer(shapei)
+						for d=0,dim do
+							if rec.kind == [Kind.Sphere] then
+								acc = addGradTerm(acc, rec.sphere.center(d), fs.gradP0[which](d))
+							else
+								acc = addGradTerm(acc, rec.capsule.bot(d), fs.gradP0[which](d))
+								acc = addGradTerm(acc, rec.capsule.top(d), fs.gradP1[which](d))
+							end
+						end
+						for c=0,numChannels do
+							acc = addGradTerm(acc, rec.color(c), fs.gradColor[which](c))
+						end
+						acc = addGradTerm(acc, rec.alpha, fs.gradAlpha[which])
+					end
+					acc = addGradTerm(acc, sp, gradSp[which])
+					results[which] = acc
+				end
+				m.destruct(fshapes)
+				return results[0], results[1]
+			end
+		end)
+	end
+
 	terra ImplicitSamplerT:clearSamples()
 		self.sampledFn:clear()
 	end
 
 	terra ImplicitSamplerT:clearShapes()
 		for i=0,self.shapes.size do
-			m.delete(self.shapes:get(i))
+			self.shapes:getPointer(i):release()
 		end
 		self.shapes:clear()
+		self.shapeArena:reset()
 	end
 
 	terra ImplicitSamplerT:clear()
@@ -150,10 +1252,10 @@ local ImplicitSampler = templatize(function(SampledFunctionT, Shape)
 
 end)
 
-
 return
 {
-	ImplicitSampler = ImplicitSampler
+	ImplicitSampler = ImplicitSampler,
+	SmoothAlphaFns = SmoothAlphaFns
 }
 
 
@@ -6,14 +6,14 @@ local Color = require("color")
 local inheritance = require("inheritance")
 local BBox = require("bbox")
 local ad = require("ad")
+local simd = require("simd")
 
 
--- TODO: If virtual function calls are too slow, we can handle the Shape hierarchy through
---    code parameterization (e.g. ConstantColorShape(BaseShapeType))
--- To support this, samplers will need to store each type of shape it is ever passed in a 
---    separate list (use-driven type generation). Sampling iterates over each list in sequence. 
--- This will be faster, but we will lose the ability to specify the exact order in which
---    shapes are rendered (i.e. they will be rendered in batches according to their types.)
+-- NOTE: Arbitrary shapes go through the virtual ImplicitShape hierarchy below. For the
+--    concrete, constant-colored shapes defined in this file, samplers can instead store
+--    a ShapeRecord (a tagged union over those types) and branch on its kind once per
+--    shape, which keeps virtual calls out of the per-sample loop while still rendering
+--    shapes in the exact order they were added.
 
 
 local ImplicitShape = templatize(function(SpaceVec, ColorVec)
@@ -99,6 +99,23 @@ local ConstantColorImplicitShape = templatize(function(SpaceVec, ColorVec)
 end)
 
 
+-- Code gen helpers for the vectorized row kernels below.
+-- Left-to-right sum of fn(i) for i in [0, count) (same association as Vec's reductions)
+local function sumOverDims(count, fn)
+	local curr = nil
+	for i=0,count-1 do
+		local e = fn(i)
+		curr = curr and `[curr] + [e] or e
+	end
+	return curr
+end
+-- Add the (scalar or vector) sum of fixed-coordinate terms to a last-coordinate term,
+--    where there may be no fixed coordinates at all
+local function plusFixed(fixed, last, dim)
+	if dim > 1 then return `[fixed] + [last] else return last end
+end
+
+
 -- TODO: For these concrete shapes, is it faster to use the generalized implicit formula
 --    or to tranform into a canonical one? Currently using generalized.
 
@@ -168,30 +185,84 @@ local SphereImplicitShape = templatize(function(SpaceVec, ColorVec)
 			end
 		end))
 
-	terra SphereImplicitShapeT:isovalue(point: SpaceVec) : real
+	-- Non-virtual implementations (also called directly by ShapeRecord)
+	terra SphereImplicitShapeT:isovalueImpl(point: SpaceVec) : real
 		-- return point:distSq(self.center) - self.rSq
 		return isoval(point, self.center, self.rSq)
 	end
+	util.inline(SphereImplicitShapeT.methods.isovalueImpl)
+
+	terra SphereImplicitShapeT:minIsovalueImpl() : real
+		return -self.rSq
+	end
+	util.inline(SphereImplicitShapeT.methods.minIsovalueImpl)
+
+	terra SphereImplicitShapeT:boundsImpl() : BBoxT
+		return [sphereBBox(BVec)](ad.val(self.center), ad.val(self.r))
+	end
+
+	terra SphereImplicitShapeT:isovalue(point: SpaceVec) : real
+		return self:isovalueImpl(point)
+	end
 	inheritance.virtual(SphereImplicitShapeT, "isovalue")
 
 	terra SphereImplicitShapeT:minIsovalue() : real
-		return -self.rSq
+		return self:minIsovalueImpl()
 	end
 	inheritance.virtual(SphereImplicitShapeT, "minIsovalue")
 
 	terra SphereImplicitShapeT:bounds() : BBoxT
-		return [sphereBBox(BVec)](ad.val(self.center), ad.val(self.r))
+		return self:boundsImpl()
 	end
 	inheritance.virtual(SphereImplicitShapeT, "bounds")
 
+	if real == double then
+		local dim = SpaceVec.Dimension
+		local W = simd.width
+		-- Evaluate isovalueImpl at a row of points which share all but their last coordinate
+		--    (taken from 'base'), and whose last coordinates are rowCoords[0..n).
+		-- Vectorized, but gives bitwise identical results to the scalar version.
+		terra SphereImplicitShapeT:isovalueRow(base: SpaceVec, rowCoords: &double, n: uint, out: &double) : {}
+			var fixed = [sumOverDims(dim-1, function(i) return quote
+					var d = base(i) - self.center(i)
+				in
+					d*d
+				end end) or 0.0]
+			var c = self.center(dim-1)
+			var fixedv = simd.broadcast(fixed)
+			var cv = simd.broadcast(c)
+			var rSqv = simd.broadcast(self.rSq)
+			var k = [uint](0)
+			while k + W <= n do
+				var d = simd.load(rowCoords + k) - cv
+				simd.store(out + k, [plusFixed(fixedv, `d*d, dim)] - rSqv)
+				k = k + W
+			end
+			while k < n do
+				var d = rowCoords[k] - c
+				out[k] = [plusFixed(fixed, `d*d, dim)] - self.rSq
+				k = k + 1
+			end
+		end
+	end
+
 	m.addConstructors(SphereImplicitShapeT)
 	return SphereImplicitShapeT
 
 end)
 
+-- How AD capsules evaluate their isovalue: with plain ad.num arithmetic (about 20 tape
+--    nodes per evaluation), or with the hand-differentiated 'isoval' primitive (one node).
+-- Chosen per CapsuleImplicitShape instantiation (only matters for AD capsules).
+local CapsuleIsovalueModes = { Arithmetic = "Arithmetic", Primitive = "Primitive" }
+
 -- Cylinder with hemispherical caps at either end (much easier to implement/efficient to
 --    evaluate than a true cylinder).
-local CapsuleImplicitShape = templatize(function(SpaceVec, ColorVec)
+local CapsuleImplicitShape = templatize(function(SpaceVec, ColorVec, isovalueMode)
+
+	isovalueMode = isovalueMode or CapsuleIsovalueModes.Arithmetic
+	assert(isovalueMode == CapsuleIsovalueModes.Arithmetic or
+		   isovalueMode == CapsuleIsovalueModes.Primitive)
 
 	local real = SpaceVec.RealType
 	local BVec = Vec(double, SpaceVec.Dimension)
@@ -209,8 +280,7 @@ local CapsuleImplicitShape = templatize(function(SpaceVec, ColorVec)
 	}
 	inheritance.dynamicExtend(ImplicitShapeT, CapsuleImplicitShapeT)
 
-	-- NOTE: Assumption is that bot ~= top (we do not do a check for the degeneracy in the
-	--    isovalue function to save time)
+	-- Zero-length capsules (bot == top) are treated as spheres around 'bot'
 	terra CapsuleImplicitShapeT:__construct(bot: SpaceVec, top: SpaceVec, r: real)
 		self.bot = bot
 		self.top = top
@@ -220,7 +290,8 @@ local CapsuleImplicitShape = templatize(function(SpaceVec, ColorVec)
 		self.sqLen = self.topMinusBot:normSq()
 	end
 
-	-- AD primitive for capsule isosurface function
+	-- AD primitive for capsule isosurface function (one tape node per evaluation).
+	-- Zero-length capsules are treated as spheres around 'bot'.
 	local val = ad.val
 	local accumadj = ad.def.accumadj
 	local VecT = Vec(double, SpaceVec.Dimension)
@@ -228,6 +299,7 @@ local CapsuleImplicitShape = templatize(function(SpaceVec, ColorVec)
 		{VecT, VecT, VecT, double, double},
 		macro(function(point, bot, top, rSq, sqLen)
 			return quote
+				if sqLen == 0.0 then return point:distSq(bot) - rSq end
 				var topMinusBot = top - bot
 				var t = (point - bot):dot(topMinusBot) / sqLen
 				-- Beyond the ends of the cylinder; treat as semispherical caps
@@ -242,84 +314,327 @@ local CapsuleImplicitShape = templatize(function(SpaceVec, ColorVec)
 		end),
 		macro(function(v, point, bot, top, rSq, sqLen)
 			local VecT = bot:gettype()
+			local function accumVec(x, g)
+				return VecT.foreachPair(x, g, function(xe, ge)
+					return quote accumadj(v, xe, ge) end
+				end)
+			end
 			return quote
 				accumadj(v, rSq, -1.0)
-				var valbot = val(bot)
-				var topMinusBot = val(top) - valbot
-				var pointMinusBot = val(point) - valbot
-				var t = pointMinusBot:dot(topMinusBot) / val(sqLen)
-				if t < 0.0 then
-					[VecT.foreachPair(point, bot, function(p, b)
-						return quote
-							accumadj(v, p, 2*(val(p) - val(b)))
-							accumadj(v, b, 2*(val(b) - val(p)))
-						end
-					end)]
+				var p = val(point)
+				var b = val(bot)
+				var tp = val(top)
+				var lsq = val(sqLen)
+				var pointMinusBot = p - b
+				var t = 0.0
+				if lsq ~= 0.0 then t = pointMinusBot:dot(tp - b) / lsq end
+				if lsq == 0.0 or t < 0.0 then
+					var g = 2.0*pointMinusBot
+					var ng = -g
+					[accumVec(point, g)]
+					[accumVec(bot, ng)]
 				elseif t > 1.0 then
-					[VecT.foreachPair(point, top, function(p, t)
-						return quote
-							accumadj(v, p, 2*(val(p) - val(t)))
-							accumadj(v, t, 2*(val(t) - val(p)))
-						end
-					end)]
+					var g = 2.0*(p - tp)
+					var ng = -g
+					[accumVec(point, g)]
+					[accumVec(top, ng)]
 				else
-					-- From Wolfram Alpha...fingers crossed...
-					var tmbnormsq = topMinusBot:normSq()
-					var lsq = val(sqLen)
-					accumadj(v, sqLen, -2*pointMinusBot:normSq()*tmbnormsq*(tmbnormsq - lsq) / (lsq*lsq*lsq))
-					[VecT.foreachTuple(function(p, b, t)
-						return quote
-							var bmp = val(b) - val(p)
-							var bmt = val(b) - val(t)
-							var bmtSq = bmt*bmt
-							accumadj(v, p, -2*bmp*(bmtSq-lsq)*(bmtSq-lsq) / (lsq*lsq))
-							accumadj(v, b, 2*bmp*(bmtSq-lsq)*(bmt*(3*val(b) - 2*val(p) - val(t)) - lsq) / (lsq*lsq))
-							accumadj(v, t, -4*bmp*bmp*bmt*(bmtSq-lsq) / (lsq*lsq))
-						end
-					end, point, bot, top)]
+					-- f = |r|^2 - rSq, with r = w - t*u, w = point - bot, u = top - bot and
+					--    t = w.u / sqLen (sqLen is a parameter in its own right, so r.u
+					--    need not vanish)
+					var u = tp - b
+					var r = pointMinusBot - t*u
+					var ruOverL = r:dot(u) / lsq
+					var gradW = 2.0*(r - ruOverL*u)
+					var gradU = -2.0*(ruOverL*pointMinusBot + t*r)
+					var gradBot = -gradW - gradU
+					accumadj(v, sqLen, 2.0*ruOverL*t)
+					[accumVec(point, gradW)]
+					[accumVec(bot, gradBot)]
+					[accumVec(top, gradU)]
 				end
 			end
 		end))
 
-	terra CapsuleImplicitShapeT:isovalue(point: SpaceVec) : real
-		var t = (point - self.bot):dot(self.topMinusBot) / self.sqLen
-		-- Beyond the ends of the cylinder; treat as semispherical caps
-		if t < 0.0 then return point:distSq(self.bot) - self.rSq end
-		if t > 1.0 then return point:distSq(self.top) - self.rSq end
-		-- Inside the bounds of the cylinder; treat as shaft
-		var proj = self.bot + t*self.topMinusBot
-		return point:distSq(proj) - self.rSq
-		
-		-- return isoval(point, self.bot, self.top, self.rSq, self.sqLen)
+	-- Non-virtual implementations (also called directly by ShapeRecord)
+	if real == ad.num and isovalueMode == CapsuleIsovalueModes.Primitive then
+		terra CapsuleImplicitShapeT:isovalueImpl(point: SpaceVec) : real
+			return isoval(point, self.bot, self.top, self.rSq, self.sqLen)
+		end
+	else
+		terra CapsuleImplicitShapeT:isovalueImpl(point: SpaceVec) : real
+			if self.sqLen == 0.0 then return point:distSq(self.bot) - self.rSq end
+			var t = (point - self.bot):dot(self.topMinusBot) / self.sqLen
+			-- Beyond the ends of the cylinder; treat as semispherical caps
+			if t < 0.0 then return point:distSq(self.bot) - self.rSq end
+			if t > 1.0 then return point:distSq(self.top) - self.rSq end
+			-- Inside the bounds of the cylinder; treat as shaft
+			var proj = self.bot + t*self.topMinusBot
+			return point:distSq(proj) - self.rSq
+		end
 	end
-	inheritance.virtual(CapsuleImplicitShapeT, "isovalue")
+	util.inline(CapsuleImplicitShapeT.methods.isovalueImpl)
 
-	terra CapsuleImplicitShapeT:minIsovalue() : real
+	terra CapsuleImplicitShapeT:minIsovalueImpl() : real
 		return -self.rSq
 	end
-	inheritance.virtual(CapsuleImplicitShapeT, "minIsovalue")
+	util.inline(CapsuleImplicitShapeT.methods.minIsovalueImpl)
 
-	terra CapsuleImplicitShapeT:bounds() : BBoxT
+	terra CapsuleImplicitShapeT:boundsImpl() : BBoxT
 		var bbox1 = [sphereBBox(BVec)](ad.val(self.bot), ad.val(self.r))
 		var bbox2 = [sphereBBox(BVec)](ad.val(self.top), ad.val(self.r))
 		bbox1:expand(&bbox2)
 		return bbox1
 	end
+
+	terra CapsuleImplicitShapeT:isovalue(point: SpaceVec) : real
+		return self:isovalueImpl(point)
+	end
+	inheritance.virtual(CapsuleImplicitShapeT, "isovalue")
+
+	terra CapsuleImplicitShapeT:minIsovalue() : real
+		return self:minIsovalueImpl()
+	end
+	inheritance.virtual(CapsuleImplicitShapeT, "minIsovalue")
+
+	terra CapsuleImplicitShapeT:bounds() : BBoxT
+		return self:boundsImpl()
+	end
 	inheritance.virtual(CapsuleImplicitShapeT, "bounds")
 
+	if real == double then
+		local dim = SpaceVec.Dimension
+		local W = simd.width
+		-- Evaluate isovalueImpl at a row of points which share all but their last coordinate
+		--    (taken from 'base'), and whose last coordinates are rowCoords[0..n).
+		-- Vectorized, with the cap/shaft branches replaced by masked selects; gives bitwise
+		--    identical results to the scalar version.
+		terra CapsuleImplicitShapeT:isovalueRow(base: SpaceVec, rowCoords: &double, n: uint, out: &double) : {}
+			var last = dim-1
+			-- Contributions from the fixed coordinates
+			var fixedDot = [sumOverDims(dim-1, function(i)
+				return `(base(i) - self.bot(i)) * self.topMinusBot(i) end) or 0.0]
+			var fixedBotSq = [sumOverDims(dim-1, function(i) return quote
+					var d = base(i) - self.bot(i)
+				in
+					d*d
+				end end) or 0.0]
+			var fixedTopSq = [sumOverDims(dim-1, function(i) return quote
+					var d = base(i) - self.top(i)
+				in
+					d*d
+				end end) or 0.0]
+			var fixedDotv = simd.broadcast(fixedDot)
+			var fixedBotSqv = simd.broadcast(fixedBotSq)
+			var fixedTopSqv = simd.broadcast(fixedTopSq)
+			var botv = simd.broadcast(self.bot(last))
+			var topv = simd.broadcast(self.top(last))
+			var tmbv = simd.broadcast(self.topMinusBot(last))
+			var sqLenv = simd.broadcast(self.sqLen)
+			var rSqv = simd.broadcast(self.rSq)
+			var zerov = simd.broadcast(0.0)
+			var onev = simd.broadcast(1.0)
+			var k = [uint](0)
+			-- (Zero-length capsules are left to the scalar version below)
+			while k + W <= n and self.sqLen ~= 0.0 do
+				var y = simd.load(rowCoords + k)
+				var db = y - botv
+				var dt = y - topv
+				var t = [plusFixed(fixedDotv, `db*tmbv, dim)] / sqLenv
+				var capBot = [plusFixed(fixedBotSqv, `db*db, dim)] - rSqv
+				var capTop = [plusFixed(fixedTopSqv, `dt*dt, dim)] - rSqv
+				var shaft = [sumOverDims(dim, function(i)
+					if i == dim-1 then
+						return quote
+							var d = y - (botv + tmbv*t)
+						in
+							d*d
+						end
+					else
+						return quote
+							var bi = self.bot(i)
+							var tmbi = self.topMinusBot(i)
+							var pi = base(i)
+							var d = simd.broadcast(pi) - (simd.broadcast(bi) + simd.broadcast(tmbi)*t)
+						in
+							d*d
+						end
+					end
+				end)] - rSqv
+				simd.store(out + k, terralib.select(t < zerov, capBot, terralib.select(t > onev, capTop, shaft)))
+				k = k + W
+			end
+			-- Leftovers
+			var point = base
+			while k < n do
+				point(last) = rowCoords[k]
+				out[k] = self:isovalueImpl(point)
+				k = k + 1
+			end
+		end
+	end
+
 	m.addConstructors(CapsuleImplicitShapeT)
 	return CapsuleImplicitShapeT
 
 end)
 
 
+-- Closed-world shape representation: a tagged union over the concrete shape types in
+--    this file (each with a constant color and alpha), plus an escape hatch for arbitrary
+--    virtual shapes. Records are stored by value, and all calls on concrete kinds are
+--    statically dispatched.
+-- 'capsuleIsovalueMode' (one of CapsuleIsovalueModes) is passed on to the capsules.
+local ShapeRecord = templatize(function(SpaceVec, ColorVec, capsuleIsovalueMode)
+
+	local real = SpaceVec.RealType
+	local BBoxT = BBox(Vec(double, SpaceVec.Dimension))
+	local ImplicitShapeT = ImplicitShape(SpaceVec, ColorVec)
+	local SphereT = SphereImplicitShape(SpaceVec, ColorVec)
+	local CapsuleT = CapsuleImplicitShape(SpaceVec, ColorVec, capsuleIsovalueMode)
+
+	local Kind = { Virtual = 0, Sphere = 1, Capsule = 2 }
+	-- Concrete kinds, and which union member holds them
+	local concreteKinds =
+	{
+		{ kind = Kind.Sphere, field = "sphere", Type = SphereT },
+		{ kind = Kind.Capsule, field = "capsule", Type = CapsuleT }
+	}
+
+	local struct ShapeRecordT
+	{
+		kind: uint8,
+		-- Virtual shapes only: the shape was placed in an arena, which owns its memory
+		inArena: bool,
+		color: ColorVec,
+		alpha: real,
+		union
+		{
+			virtualShape: &ImplicitShapeT,
+			sphere: SphereT,
+			capsule: CapsuleT
+		}
+	}
+	ShapeRecordT.Kind = Kind
+
+	-- Generate code that branches on the kind of 'rec' (a pointer) once, and then runs
+	--    the code generated by bodyFn(evalFn, rowEvalFn). evalFn(point) generates a
+	--    statically dispatched expression yielding (isovalue, color, alpha) at 'point'.
+	-- For concrete kinds with a row kernel, rowEvalFn(base, rowCoords, n, out) generates
+	--    a vectorized evaluation of a row of points (see isovalueRow) yielding
+	--    (color, alpha); otherwise it is nil.
+	function ShapeRecordT.dispatch(rec, bodyFn)
+		local function evalVirtual(point)
+			return `[rec].virtualShape:isovalueAndColor([point])
+		end
+		local stmt = bodyFn(evalVirtual, nil)
+		for i=#concreteKinds,1,-1 do
+			local k = concreteKinds[i]
+			local function evalConcrete(point)
+				return quote in [rec].[k.field]:isovalueImpl([point]), [rec].color, [rec].alpha end
+			end
+			local function rowEvalConcrete(base, rowCoords, n, out)
+				return quote
+					[rec].[k.field]:isovalueRow([base], [rowCoords], [n], [out])
+				in
+					[rec].color, [rec].alpha
+				end
+			end
+			stmt = quote
+				if [rec].kind == [k.kind] then
+					[bodyFn(evalConcrete, k.Type.methods.isovalueRow and rowEvalConcrete or nil)]
+				else
+					[stmt]
+				end
+			end
+		end
+		return stmt
+	end
+
+	-- Takes ownership of 'shape'
+	terra ShapeRecordT:__construct(shape: &ImplicitShapeT) : {}
+		self.kind = [Kind.Virtual]
+		self.inArena = false
+		self.virtualShape = shape
+		self.alpha = 1.0
+	end
+
+	-- Refer to a shape living in an arena (we destruct it, but do not free it)
+	terra ShapeRecordT:initInArena(shape: &ImplicitShapeT)
+		self:__construct(shape)
+		self.inArena = true
+	end
+
+	terra ShapeRecordT:__construct() : {}
+		self:__construct(nil)
+	end
+
+	terra ShapeRecordT:initSphere(center: SpaceVec, r: real, color: ColorVec, alpha: real)
+		self.kind = [Kind.Sphere]
+		self.sphere:__construct(center, r)
+		self.color = color
+		self.alpha = alpha
+	end
+
+	terra ShapeRecordT:initCapsule(bot: SpaceVec, top: SpaceVec, r: real, color: ColorVec, alpha: real)
+		self.kind = [Kind.Capsule]
+		self.capsule:__construct(bot, top, r)
+		self.color = color
+		self.alpha = alpha
+	end
+
+	-- Free the underlying shape, if we own one
+	terra ShapeRecordT:release()
+		if self.kind == [Kind.Virtual] then
+			if self.inArena then
+				self.virtualShape:__destruct()
+			else
+				m.delete(self.virtualShape)
+			end
+			self.virtualShape = nil
+		end
+	end
+
+	-- Whether two records describe the same shape (by parameters). Virtual shapes are
+	--    opaque, so they never compare equal.
+	terra ShapeRecordT:sameAs(other: &ShapeRecordT) : bool
+		if self.kind ~= other.kind or self.kind == [Kind.Virtual] then return false end
+		if not (self.color == other.color and self.alpha == other.alpha) then return false end
+		if self.kind == [Kind.Sphere] then
+			return self.sphere.center == other.sphere.center and self.sphere.r == other.sphere.r
+		else
+			return self.capsule.bot == other.capsule.bot and self.capsule.top == other.capsule.top and
+				   self.capsule.r == other.capsule.r
+		end
+	end
+
+	terra ShapeRecordT:minIsovalue() : real
+		if self.kind == [Kind.Sphere] then return self.sphere:minIsovalueImpl()
+		elseif self.kind == [Kind.Capsule] then return self.capsule:minIsovalueImpl()
+		else return self.virtualShape:minIsovalue() end
+	end
+
+	terra ShapeRecordT:bounds() : BBoxT
+		if self.kind == [Kind.Sphere] then return self.sphere:boundsImpl()
+		elseif self.kind == [Kind.Capsule] then return self.capsule:boundsImpl()
+		else return self.virtualShape:bounds() end
+	end
+
+	m.addConstructors(ShapeRecordT)
+	return ShapeRecordT
+
+end)
+
+
 
 return
 {
 	ImplicitShape = ImplicitShape,
 	ConstantColorImplicitShape = ConstantColorImplicitShape,
 	SphereImplicitShape = SphereImplicitShape,
-	CapsuleImplicitShape = CapsuleImplicitShape
+	CapsuleImplicitShape = CapsuleImplicitShape,
+	CapsuleIsovalueModes = CapsuleIsovalueModes,
+	ShapeRecord = ShapeRecord
 }
 
 
@@ -0,0 +1,46 @@
+-- Helpers for writing explicitly vectorized kernels over doubles.
+-- Loads and stores go through a vector-typed local, so they never assume
+--    anything about the alignment of the pointers passed in.
+
+-- 4-wide doubles (AVX2)
+local width = 4
+local VecD = vector(double, width)
+
+local function replicate(x, n)
+	local t = {}
+	for i=1,n do table.insert(t, x) end
+	return t
+end
+
+-- Splat a scalar (should be a variable, since it is referenced 'width' times)
+local broadcast = macro(function(x)
+	return `vectorof(double, [replicate(x, width)])
+end)
+
+local load = macro(function(ptr)
+	return quote
+		var v : VecD
+		var vp = [&double](&v)
+		for k=0,width do vp[k] = [ptr][k] end
+	in
+		v
+	end
+end)
+
+local store = macro(function(ptr, v)
+	return quote
+		var tmp : VecD = [v]
+		var tp = [&double](&tmp)
+		for k=0,width do [ptr][k] = tp[k] end
+	end
+end)
+
+
+return
+{
+	width = width,
+	VecD = VecD,
+	broadcast = broadcast,
+	load = load,
+	store = store
+}
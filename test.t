@@ -1,4 +1,6 @@
 local m = require("mem")
+local ad = require("ad")
+local templatize = require("templatize")
 
 local linalg = require("linalg")
 local Vec = linalg.Vec
@@ -16,6 +18,9 @@ local RGBImage = im.Image(uint8, 3)
 
 local patterns = require("samplePatterns")
 local ImgGridPattern = patterns.RegularGridSamplingPattern(Vec2d)
+local JitteredPattern = patterns.JitteredGridSamplingPattern(Vec2d)
+local HaltonPattern = patterns.HaltonSamplingPattern(Vec2d)
+local PoissonDiskPattern = patterns.PoissonDiskSamplingPattern(Vec2d)
 
 local shapes = require("shapes")
 local Shape2d1d = shapes.ImplicitShape(Vec2d, Color1d)
@@ -29,11 +34,16 @@ local SampledFunction = require("sampledFunction")
 local SampledFunction2d1d = SampledFunction(Vec2d, Color1d, SfnOpts.ClampFns.SoftMin(10, 1.0), SfnOpts.AccumFns.Over())
 local SampledImg = SampledFunction(Vec2d, Color3d)
 
-local ImplicitSampler = require("samplers").ImplicitSampler
+local samplers = require("samplers")
+local ImplicitSampler = samplers.ImplicitSampler
 local ImplicitSampler2d1d = ImplicitSampler(SampledFunction2d1d, Shape2d1d)
+local FastExpSampler2d1d = ImplicitSampler(SampledFunction2d1d, Shape2d1d, samplers.SmoothAlphaFns.Fast())
 
 local C = terralib.includecstring [[
 #include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <math.h>
 ]]
 
 local terra testSampler()
@@ -74,6 +84,1147 @@ end
 -- ImplicitSampler2d1d.methods.sampleSmooth:printpretty()
 testSampler()
 
+-- Compare smooth rendering with the exact and fast exponentials: render time, max
+--    difference between the two renders, and the MSE log-likelihood each render
+--    gets against a sharp render of the same scene (strength as in the inference tests).
+-- That log-likelihood is a single-render stand-in: this does not run MCMC, so it says
+--    nothing directly about the log-probs inference ends up at with either exponential.
+-- Returns the max difference, which the fast exponential's error (relative error
+--    below 2e-7 per alpha) should keep well under smoothAlphaTolerance.
+local benchNumCapsules = 2000
+local benchRes = 500
+local benchStrength = 1000.0
+local smoothAlphaTolerance = 1e-5
+local function genBenchRender(SamplerType, smooth)
+	return terra(sfn: &SampledFunction2d1d, pattern: &ImgGridPattern)
+		var sampler = SamplerType.stackAlloc(sfn)
+		C.srand(42)
+		for i=0,benchNumCapsules do
+			var bot = Vec2d.stackAlloc(C.rand()/[double](C.RAND_MAX), C.rand()/[double](C.RAND_MAX))
+			var dir = Vec2d.stackAlloc(C.rand()/[double](C.RAND_MAX) - 0.5, C.rand()/[double](C.RAND_MAX) - 0.5)
+			sampler:addCapsule(bot, bot + 0.05*dir, 0.005, Color1d.stackAlloc(1.0), 0.5)
+		end
+		[smooth and (`sampler:sampleSmooth(pattern:getSamplePattern(), 0.001)) or
+					(`sampler:sampleSharp(pattern:getSamplePattern()))]
+		m.destruct(sampler)
+	end
+end
+local renderExact = genBenchRender(ImplicitSampler2d1d, true)
+local renderFast = genBenchRender(FastExpSampler2d1d, true)
+local renderTarget = genBenchRender(ImplicitSampler2d1d, false)
+local compareSamples = macro(function(sfn1, sfn2, maxDiff, sqErr)
+	return quote
+		for i=0,[sfn1]:numSamples() do
+			var d = [sfn1]:getSample(i).entries[0] - [sfn2]:getSample(i).entries[0]
+			if d < 0.0 then d = -d end
+			if d > [maxDiff] then [maxDiff] = d end
+			[sqErr] = [sqErr] + d*d
+		end
+	end
+end)
+local terra benchSmoothAlpha(numReps: uint) : double
+	var pattern = ImgGridPattern.stackAlloc(Vec2d.stackAlloc(0.0), Vec2d.stackAlloc(1.0),
+		Vec2u.stackAlloc(benchRes, benchRes))
+	var exact = SampledFunction2d1d.stackAlloc()
+	var fast = SampledFunction2d1d.stackAlloc()
+	var target = SampledFunction2d1d.stackAlloc()
+	renderTarget(&target, &pattern)
+	var t0 = C.clock()
+	for i=0,numReps do exact:clear(); renderExact(&exact, &pattern) end
+	var t1 = C.clock()
+	for i=0,numReps do fast:clear(); renderFast(&fast, &pattern) end
+	var t2 = C.clock()
+	var maxDiff = 0.0
+	var sqErr = 0.0
+	compareSamples(&exact, &fast, maxDiff, sqErr)
+	var exactMaxDiff = 0.0
+	var exactSqErr = 0.0
+	compareSamples(&exact, &target, exactMaxDiff, exactSqErr)
+	var fastMaxDiff = 0.0
+	var fastSqErr = 0.0
+	compareSamples(&fast, &target, fastMaxDiff, fastSqErr)
+	var n = exact:numSamples()
+	C.printf("smoothAlpha exact: %g s/render, fast: %g s/render\n",
+		(t1-t0)/[double](C.CLOCKS_PER_SEC)/numReps, (t2-t1)/[double](C.CLOCKS_PER_SEC)/numReps)
+	C.printf("max sample difference: %g, mse between renders: %g\n", maxDiff, sqErr/n)
+	C.printf("single-render log-likelihood vs sharp target: exact %.10g, fast %.10g\n",
+		-benchStrength*exactSqErr/n, -benchStrength*fastSqErr/n)
+	m.destruct(exact)
+	m.destruct(fast)
+	m.destruct(target)
+	m.destruct(pattern)
+	return maxDiff
+end
+-- (One repetition checks that the renders agree; use more for stable timings)
+assert(benchSmoothAlpha(1) < smoothAlphaTolerance)
+
+-- Finite-difference check of AD capsule isovalue gradients, in both capsule isovalue modes.
+-- Parameters are (point, bot, top, r), flattened into 7 doubles.
+local Vec2ad = Vec(ad.num, 2)
+local Color1ad = Color(ad.num, 1)
+local capsuleModeNames = {"Arithmetic", "Primitive"}
+local function Capsule2dAD(modeName)
+	return shapes.CapsuleImplicitShape(Vec2ad, Color1ad, shapes.CapsuleIsovalueModes[modeName])
+end
+local numCapsuleParams = 7
+local fdEps = 1e-7
+local fdTol = 1e-5
+-- Reference implementation (zero-length capsules are spheres around 'bot')
+local terra refCapsuleIsovalue(x: &double) : double
+	var p = Vec2d.stackAlloc(x[0], x[1])
+	var bot = Vec2d.stackAlloc(x[2], x[3])
+	var top = Vec2d.stackAlloc(x[4], x[5])
+	var rSq = x[6]*x[6]
+	var u = top - bot
+	var lsq = u:normSq()
+	if lsq == 0.0 then return p:distSq(bot) - rSq end
+	var t = (p - bot):dot(u) / lsq
+	if t < 0.0 then return p:distSq(bot) - rSq end
+	if t > 1.0 then return p:distSq(top) - rSq end
+	return p:distSq(bot + t*u) - rSq
+end
+local capsuleGradient = templatize(function(modeName)
+	local CapsuleT = Capsule2dAD(modeName)
+	return terra(x: &double, grad: &double) : double
+		var params : ad.num[numCapsuleParams]
+		for i=0,numCapsuleParams do params[i] = x[i] end
+		var capsule = CapsuleT.stackAlloc(Vec2ad.stackAlloc(params[2], params[3]),
+			Vec2ad.stackAlloc(params[4], params[5]), params[6])
+		var v = capsule:isovalueImpl(Vec2ad.stackAlloc(params[0], params[1]))
+		v:grad()
+		for i=0,numCapsuleParams do grad[i] = params[i]:adj() end
+		var value = ad.val(v)
+		m.destruct(capsule)
+		ad.recoverMemory()
+		return value
+	end
+end)
+-- Only the parameters flagged in 'checked' are compared against finite differences.
+local checkCapsuleGradient = templatize(function(modeName)
+	return terra(name: rawstring, x: &double, checked: &bool) : bool
+		var grad : double[numCapsuleParams]
+		var value = [capsuleGradient(modeName)](x, grad)
+		var ok = C.fabs(value - refCapsuleIsovalue(x)) <= fdTol
+		for i=0,numCapsuleParams do
+			if checked[i] then
+				var xi = x[i]
+				x[i] = xi + fdEps
+				var fplus = refCapsuleIsovalue(x)
+				x[i] = xi - fdEps
+				var fminus = refCapsuleIsovalue(x)
+				x[i] = xi
+				var fd = (fplus - fminus) / (2*fdEps)
+				if not (C.fabs(grad[i] - fd) <= fdTol*(1.0 + C.fabs(fd))) then
+					C.printf("    %s: d/dx[%d] = %g, finite difference %g\n", name, i, grad[i], fd)
+					ok = false
+				end
+			end
+		end
+		var status = "ok"
+		if not ok then status = "FAILED" end
+		C.printf("  %-16s %s\n", name, status)
+		return ok
+	end
+end)
+-- Both modes must also agree exactly, on values and on every partial derivative
+local terra compareCapsuleModes(name: rawstring, x: &double) : bool
+	var gradA : double[numCapsuleParams]
+	var gradP : double[numCapsuleParams]
+	var valueA = [capsuleGradient("Arithmetic")](x, gradA)
+	var valueP = [capsuleGradient("Primitive")](x, gradP)
+	var ok = C.fabs(valueA - valueP) <= fdTol
+	for i=0,numCapsuleParams do
+		if not (C.fabs(gradA[i] - gradP[i]) <= fdTol*(1.0 + C.fabs(gradP[i]))) then
+			C.printf("    %s: d/dx[%d] = %g (Arithmetic), %g (Primitive)\n", name, i, gradA[i], gradP[i])
+			ok = false
+		end
+	end
+	var status = "ok"
+	if not ok then status = "FAILED" end
+	C.printf("  %-16s %s\n", name, status)
+	return ok
+end
+-- 'fdParams' restricts the finite-difference check to the given parameters: moving
+--    either end of a zero-length capsule gives it a length, so central differences
+--    there straddle the cap branches.
+local capsuleGradientCases =
+{
+	{ "bottom cap", {0.1, 0.45,  0.2, 0.5,  0.8, 0.5,  0.05} },
+	{ "top cap", {0.9, 0.52,  0.2, 0.5,  0.8, 0.5,  0.05} },
+	{ "shaft", {0.5, 0.53,  0.2, 0.5,  0.8, 0.5,  0.05} },
+	{ "diagonal shaft", {0.4, 0.65,  0.2, 0.3,  0.7, 0.9,  0.02} },
+	{ "tiny capsule", {0.5004, 0.5003,  0.5, 0.5,  0.501, 0.5,  0.01} },
+	{ "zero length", {0.52, 0.47,  0.5, 0.5,  0.5, 0.5,  0.05}, fdParams = {0, 1, 6} }
+}
+local function testCapsuleGradients()
+	local allOk = true
+	for _,modeName in ipairs(capsuleModeNames) do
+		print(string.format("Capsule isovalue gradients (%s mode):", modeName))
+		for _,case in ipairs(capsuleGradientCases) do
+			local x = terralib.new(double[numCapsuleParams], case[2])
+			local checked = terralib.new(bool[numCapsuleParams])
+			for i=0,numCapsuleParams-1 do checked[i] = (case.fdParams == nil) end
+			for _,i in ipairs(case.fdParams or {}) do checked[i] = true end
+			allOk = checkCapsuleGradient(modeName)(case[1], x, checked) and allOk
+		end
+	end
+	print("Capsule isovalue gradients (Arithmetic vs. Primitive):")
+	for _,case in ipairs(capsuleGradientCases) do
+		local x = terralib.new(double[numCapsuleParams], case[2])
+		allOk = compareCapsuleModes(case[1], x) and allOk
+	end
+	return allOk
+end
+assert(testCapsuleGradients())
+
+-- Check a batched AD sum (Vec.makeBatchedADPrimitive) against the same sum built
+--    from ordinary AD arithmetic, on values and on the gradients of its shared parameters.
+local batchedTestPoints = 100
+local sphereIsovalueSum = Vec.makeBatchedADPrimitive(
+	{Vec2d, double},
+	macro(function(point, gradCenter, gradRSq, center, rSq)
+		return quote
+			[gradCenter] = -2.0*(point - center)
+			[gradRSq] = -1.0
+		in
+			point:distSq(center) - rSq
+		end
+	end))
+local terra testBatchedADPrimitive() : bool
+	C.srand(7)
+	var points : Vec2d[batchedTestPoints]
+	for k=0,batchedTestPoints do
+		points[k] = Vec2d.stackAlloc(C.rand()/[double](C.RAND_MAX), C.rand()/[double](C.RAND_MAX))
+	end
+	var params : ad.num[3]
+	params[0] = 0.3
+	params[1] = 0.6
+	params[2] = 0.04
+	-- Batched
+	var center = Vec2ad.stackAlloc(params[0], params[1])
+	var batched = [sphereIsovalueSum(batchedTestPoints, function(k) return `points[k] end,
+									 {center, `params[2]})]
+	batched:grad()
+	var batchedValue = ad.val(batched)
+	var batchedGrad : double[3]
+	for i=0,3 do batchedGrad[i] = params[i]:adj() end
+	ad.recoverMemory()
+	-- Unbatched
+	params[0] = 0.3
+	params[1] = 0.6
+	params[2] = 0.04
+	center = Vec2ad.stackAlloc(params[0], params[1])
+	var plain : ad.num = 0.0
+	for k=0,batchedTestPoints do
+		plain = plain + Vec2ad.stackAlloc(points[k](0), points[k](1)):distSq(center) - params[2]
+	end
+	plain:grad()
+	var ok = C.fabs(batchedValue - ad.val(plain)) <= 1e-9*C.fabs(ad.val(plain))
+	for i=0,3 do
+		var g = params[i]:adj()
+		if not (C.fabs(batchedGrad[i] - g) <= 1e-9*(1.0 + C.fabs(g))) then
+			C.printf("  batched AD sum: d/dparam[%d] = %g, unbatched %g\n", i, batchedGrad[i], g)
+			ok = false
+		end
+	end
+	ad.recoverMemory()
+	return ok
+end
+assert(testBatchedADPrimitive())
+
+-- Random scenes of spheres and capsules, rendered smoothly with AD in different ways
+--    and scored against a random target (see compareSceneRenders)
+local mseComps = require("inference.targetImageLikelihood").mseComps
+local SampledFunction2d1dAD = SampledFunction(Vec2d, Color1ad, SfnOpts.ClampFns.None(), SfnOpts.AccumFns.Over())
+local ImplicitSampler2d1dAD = ImplicitSampler(SampledFunction2d1dAD, shapes.ImplicitShape(Vec2ad, Color1ad))
+local testScenes = 4
+-- (Enough shapes that many samples are covered by more than overChainLength fields)
+local testSceneShapes = 12
+local testSceneRes = 24
+-- Every shape has 7 parameters (bot, top, radius, color, alpha; spheres only use
+--    'bot'), followed by the smoothing parameter.
+local testSceneParams = 7*testSceneShapes + 1
+local testSceneTol = 1e-9
+-- Render the scene with parameters 'x' and return its error components against
+--    'target', with the gradient of a weighted sum of the two in 'grad'.
+local renderTestScene = templatize(function(fused, aggregated, frontToBack)
+	return terra(x: &double, grad: &double, pattern: &ImgGridPattern, target: &SampledFunction2d1d) : {double, double}
+		var sfn = SampledFunction2d1dAD.stackAlloc()
+		var sampler = ImplicitSampler2d1dAD.stackAlloc(&sfn)
+		var params : ad.num[testSceneParams]
+		for i=0,testSceneParams do params[i] = x[i] end
+		for s=0,testSceneShapes do
+			var q = &params[7*s]
+			var bot = Vec2ad.stackAlloc(q[0], q[1])
+			var color = Color1ad.stackAlloc(q[5])
+			if s % 2 == 0 then
+				sampler:addSphere(bot, q[4], color, q[6])
+			else
+				sampler:addCapsule(bot, Vec2ad.stackAlloc(q[2], q[3]), q[4], color, q[6])
+			end
+		end
+		-- (A nonzero background, so that the bottom of every compositing chain matters)
+		sfn:setSamplingPattern(pattern:getSamplePattern())
+		for i=0,sfn:numSamples() do sfn:setSample(i, Color1ad.stackAlloc(0.25)) end
+		sfn:setAggregatedAccumulation(aggregated)
+		sampler:setFrontToBack(frontToBack, 1.0)
+		sampler:setFusedScoring(fused)
+		sampler:sampleSmooth(pattern:getSamplePattern(), params[testSceneParams-1])
+		var zeroErr : ad.num
+		var nonZeroErr : ad.num
+		[fused and quote
+			zeroErr, nonZeroErr = [ImplicitSampler2d1dAD.fusedMseComps(SampledFunction2d1d)](&sampler, target)
+		end or quote
+			zeroErr, nonZeroErr = mseComps(&sfn, target)
+		end]
+		-- (Weight the components differently, so that a mix-up between them shows)
+		var l = zeroErr + 3.0*nonZeroErr
+		l:grad()
+		for i=0,testSceneParams do grad[i] = params[i]:adj() end
+		var zeroVal = ad.val(zeroErr)
+		var nonZeroVal = ad.val(nonZeroErr)
+		m.destruct(sampler)
+		m.destruct(sfn)
+		ad.recoverMemory()
+		return zeroVal, nonZeroVal
+	end
+end)
+-- Check that two ways of rendering give the same error components and gradients
+--    on a few random scenes and targets
+local function compareSceneRenders(name, renderA, renderB)
+	return terra() : bool
+		var pattern = ImgGridPattern.stackAlloc(Vec2d.stackAlloc(0.0), Vec2d.stackAlloc(1.0),
+			Vec2u.stackAlloc(testSceneRes, testSceneRes))
+		var target = SampledFunction2d1d.stackAlloc()
+		target:setSamplingPattern(pattern:getSamplePattern())
+		C.srand(11)
+		var ok = true
+		for scene=0,testScenes do
+			-- Random target, a third of it zero
+			for i=0,target:numSamples() do
+				var t = 0.0
+				if C.rand() % 3 ~= 0 then t = C.rand()/[double](C.RAND_MAX) end
+				target:setSample(i, Color1d.stackAlloc(t))
+			end
+			var x : double[testSceneParams]
+			for s=0,testSceneShapes do
+				var q = &x[7*s]
+				for d=0,4 do q[d] = C.rand()/[double](C.RAND_MAX) end
+				q[4] = 0.05 + 0.1*C.rand()/[double](C.RAND_MAX)
+				q[5] = C.rand()/[double](C.RAND_MAX)
+				q[6] = 0.3 + 0.6*C.rand()/[double](C.RAND_MAX)
+			end
+			x[testSceneParams-1] = 0.002
+			var gradA : double[testSceneParams]
+			var gradB : double[testSceneParams]
+			var zeroA, nonZeroA = renderA(x, gradA, &pattern, &target)
+			var zeroB, nonZeroB = renderB(x, gradB, &pattern, &target)
+			if not (C.fabs(zeroA - zeroB) <= testSceneTol*(1.0 + C.fabs(zeroB)) and
+					C.fabs(nonZeroA - nonZeroB) <= testSceneTol*(1.0 + C.fabs(nonZeroB))) then
+				C.printf("  %s, scene %d: errors (%g, %g) vs. (%g, %g)\n",
+					name, scene, zeroA, nonZeroA, zeroB, nonZeroB)
+				ok = false
+			end
+			for i=0,testSceneParams do
+				if not (C.fabs(gradA[i] - gradB[i]) <= testSceneTol*(1.0 + C.fabs(gradB[i]))) then
+					C.printf("  %s, scene %d: d/dx[%d] = %g vs. %g\n", name, scene, i, gradA[i], gradB[i])
+					ok = false
+				end
+			end
+		end
+		m.destruct(target)
+		m.destruct(pattern)
+		return ok
+	end
+end
+local renderPlain = renderTestScene(false, false, false)
+
+-- Fused smooth rendering + scoring (ImplicitSampler:fusedMseComps) vs. sampleSmooth + mseComps
+assert(compareSceneRenders("fused scoring", renderTestScene(true, false, false), renderPlain)())
+-- Aggregated 'over' compositing (SampledFunction:setAggregatedAccumulation) vs. one
+--    tape node per contribution, back-to-front and front-to-back
+assert(compareSceneRenders("aggregated compositing", renderTestScene(false, true, false), renderPlain)())
+assert(compareSceneRenders("aggregated front-to-back", renderTestScene(false, true, true), renderPlain)())
+
+-- Check the specialized error kernels behind mseComps against the generic lockstep
+--    version: AD samples (values and the gradient w.r.t. every sample channel), and
+--    double samples in SoA layout.
+local mseCompsLockstep = require("inference.targetImageLikelihood").mseCompsLockstep
+local SampledImgSoA = SampledFunction(Vec2d, Color3d, SfnOpts.ClampFns.None(), SfnOpts.AccumFns.Replace(),
+	SfnOpts.Layouts.SoA())
+local Color3ad = Color(ad.num, 3)
+local SampledImgAD = SampledFunction(Vec2d, Color3ad)
+-- (Not a multiple of the SIMD width, so that the scalar leftovers are covered too)
+local mseTestWidth = 11
+local mseTestHeight = 9
+local mseTestValues = mseTestWidth*mseTestHeight*3
+local mseTestTol = 1e-12
+local mseCompsGradient = templatize(function(lockstep)
+	return terra(src: &SampledImgSoA, target: &SampledImgSoA, grad: &double) : {double, double}
+		var srcAD = SampledImgAD.stackAlloc()
+		srcAD:setSamplingPattern(src.samplingPattern)
+		for i=0,src:numSamples() do
+			var s = src:getSample(i)
+			srcAD:setSample(i, Color3ad.stackAlloc(s.entries[0], s.entries[1], s.entries[2]))
+		end
+		var zeroErr : ad.num
+		var nonZeroErr : ad.num
+		[lockstep and quote
+			zeroErr, nonZeroErr = mseCompsLockstep(&srcAD, target)
+		end or quote
+			zeroErr, nonZeroErr = mseComps(&srcAD, target)
+		end]
+		var l = zeroErr + 3.0*nonZeroErr
+		l:grad()
+		for i=0,src:numSamples() do
+			var s = srcAD:getSample(i)
+			for c=0,3 do grad[3*i + c] = s.entries[c]:adj() end
+		end
+		var zeroVal = ad.val(zeroErr)
+		var nonZeroVal = ad.val(nonZeroErr)
+		m.destruct(srcAD)
+		ad.recoverMemory()
+		return zeroVal, nonZeroVal
+	end
+end)
+local mseClose = macro(function(a, b)
+	return `C.fabs([a] - [b]) <= mseTestTol*(1.0 + C.fabs([b]))
+end)
+local terra testMseKernels() : bool
+	var pattern = ImgGridPattern.stackAlloc(Vec2d.stackAlloc(0.0), Vec2d.stackAlloc(1.0),
+		Vec2u.stackAlloc(mseTestWidth, mseTestHeight))
+	var src = SampledImgSoA.stackAlloc()
+	var target = SampledImgSoA.stackAlloc()
+	src:setSamplingPattern(pattern:getSamplePattern())
+	target:setSamplingPattern(pattern:getSamplePattern())
+	C.srand(5)
+	for i=0,target:numSamples() do
+		-- A third of the targets are zero; some others are zero in some channels only
+		var t = Color3d.stackAlloc(0.0)
+		if C.rand() % 3 ~= 0 then
+			for c=0,3 do
+				if C.rand() % 4 ~= 0 then t.entries[c] = C.rand()/[double](C.RAND_MAX) end
+			end
+		end
+		target:setSample(i, t)
+		src:setSample(i, Color3d.stackAlloc(C.rand()/[double](C.RAND_MAX), C.rand()/[double](C.RAND_MAX),
+			C.rand()/[double](C.RAND_MAX)))
+	end
+	var ok = true
+	-- SoA doubles
+	var zeroSIMD, nonZeroSIMD = mseComps(&src, &target)
+	var zeroRef, nonZeroRef = mseCompsLockstep(&src, &target)
+	if not (mseClose(zeroSIMD, zeroRef) and mseClose(nonZeroSIMD, nonZeroRef)) then
+		C.printf("  SoA doubles: errors (%g, %g), lockstep (%g, %g)\n", zeroSIMD, nonZeroSIMD, zeroRef, nonZeroRef)
+		ok = false
+	end
+	-- AD
+	var gradAD : double[mseTestValues]
+	var gradRef : double[mseTestValues]
+	var zeroAD, nonZeroAD = [mseCompsGradient(false)](&src, &target, gradAD)
+	zeroRef, nonZeroRef = [mseCompsGradient(true)](&src, &target, gradRef)
+	if not (mseClose(zeroAD, zeroRef) and mseClose(nonZeroAD, nonZeroRef)) then
+		C.printf("  AD: errors (%g, %g), lockstep (%g, %g)\n", zeroAD, nonZeroAD, zeroRef, nonZeroRef)
+		ok = false
+	end
+	for k=0,mseTestValues do
+		if not mseClose(gradAD[k], gradRef[k]) then
+			C.printf("  AD: d/dsample[%d] = %g, lockstep %g\n", k, gradAD[k], gradRef[k])
+			ok = false
+		end
+	end
+	m.destruct(src)
+	m.destruct(target)
+	m.destruct(pattern)
+	return ok
+end
+assert(testMseKernels())
+
+-- Check that the bulk row kernels for dimension match functions give the same results
+--    as the scalar dimension match functions, for every pair of supported channel types.
+-- Source values include NaN, infinities and out-of-range values.
+local rowKernelTestValues = {0.0, 1.0, 0.5, 0.2, 1.0/3.0, 0.999, 1e-6, -0.25, 1.5, -1e30, 1e30,
+	0.0/0.0, 1.0/0.0, -1.0/0.0, 2.0, 37.0, 255.0, 65535.0, 70000.0}
+local checkRowKernel = templatize(function(SrcT, DstT, srcDim, dstDim, dimMatchFn)
+	local SrcColor = Color(SrcT, srcDim)
+	local DstColor = Color(DstT, dstDim)
+	local rowKernel = SfnOpts.DimensionMatchFns.rowKernel(dimMatchFn, SrcColor, DstColor)
+	assert(rowKernel)
+	local numValues = #rowKernelTestValues
+	-- (Enough colors to cover both the vector loop and the leftovers)
+	local n = numValues + 3
+	local values = terralib.new(double[numValues], rowKernelTestValues)
+	return terra() : bool
+		var src : SrcColor[n]
+		var bulk : DstColor[n]
+		var scalar : DstColor[n]
+		for i=0,n do
+			for c=0,srcDim do
+				var x = values[(i*srcDim + c) % numValues]
+				escape
+					if SrcT:isintegral() then
+						-- Keep integer sources in range (float->int casts of NaN etc. are undefined)
+						local intmax = 2 ^ (terralib.sizeof(SrcT)*8) - 1
+						emit quote
+							if not (x >= 0.0) then x = 0.0 end
+							if x > intmax then x = intmax end
+							if x <= 1.0 then x = x*intmax end
+						end
+					end
+				end
+				src[i].entries[c] = [SrcT](x)
+			end
+		end
+		rowKernel(&src[0], &bulk[0], n)
+		for i=0,n do dimMatchFn(src[i], &scalar[i]) end
+		var ok = true
+		for i=0,n do
+			for c=0,dstDim do
+				var a = bulk[i].entries[c]
+				var b = scalar[i].entries[c]
+				if not (a == b or (a ~= a and b ~= b)) then
+					C.printf("    color %u, channel %u: bulk %g, scalar %g\n", i, c, [double](a), [double](b))
+					ok = false
+				end
+			end
+		end
+		return ok
+	end
+end)
+local function testRowKernels()
+	local types = {uint8, uint16, float, double}
+	local dims = { {3, 3}, {1, 3}, {4, 3}, {3, 4} }
+	local allOk = true
+	for _,channelName in ipairs({"Quantize", "None"}) do
+		for _,dimName in ipairs({"RepeatLast", "Zeros"}) do
+			local dimMatchFn = SfnOpts.DimensionMatchFns[dimName](SfnOpts.ChannelFns[channelName]())
+			for _,SrcT in ipairs(types) do
+				for _,DstT in ipairs(types) do
+					-- (ChannelFns.None does not clamp, so only check it between float types)
+					if channelName == "Quantize" or (SrcT:isfloat() and DstT:isfloat()) then
+						for _,d in ipairs(dims) do
+							local ok = checkRowKernel(SrcT, DstT, d[1], d[2], dimMatchFn)()
+							if not ok then
+								print(string.format("  row kernel %s/%s, %s%d -> %s%d: FAILED",
+									channelName, dimName, tostring(SrcT), d[1], tostring(DstT), d[2]))
+							end
+							allOk = ok and allOk
+						end
+					end
+				end
+			end
+		end
+	end
+	-- Dimension match functions with custom extra channels have no row kernel
+	local custom = SfnOpts.DimensionMatchFns.makeNew(function(src, srcDim, dstDim, currIndex)
+		return `0.5
+	end)()
+	allOk = (SfnOpts.DimensionMatchFns.rowKernel(custom, Color(float, 1), Color(uint8, 3)) == nil) and allOk
+	return allOk
+end
+assert(testRowKernels())
+
+-- Check that reconstruction filters turn a constant-colored jittered pattern (one
+--    sample per pixel) back into a constant image, without holes.
+local reconstructionSize = 32
+local reconstructionColor = {0.2, 0.5, 0.9}
+local FloatRGBImage = im.Image(float, 3)
+local checkReconstruction = templatize(function(filter)
+	local saveFn = SampledImg.saveToImage(FloatRGBImage, filter)
+	return terra() : bool
+		var zeros = Vec2d.stackAlloc(0.0)
+		var ones = Vec2d.stackAlloc(1.0)
+		var size = reconstructionSize
+		var pattern = JitteredPattern.stackAlloc(zeros, ones, Vec2u.stackAlloc(size, size), 7)
+		var sfn = SampledImg.stackAlloc()
+		sfn:setSamplingPattern(pattern:getSamplePattern())
+		var color = Color3d.stackAlloc([reconstructionColor])
+		for i=0,sfn:numSamples() do sfn:setSample(i, color) end
+		var image = FloatRGBImage.stackAlloc(size, size)
+		saveFn(&sfn, &image, zeros, ones)
+		var ok = true
+		for x=0,size do
+			for y=0,size do
+				var pixel = image:getPixelColor(x, y)
+				for c=0,3 do
+					if not (C.fabs(pixel.entries[c] - color.entries[c]) < 1e-5) then ok = false end
+				end
+			end
+		end
+		m.destruct(image)
+		m.destruct(sfn)
+		m.destruct(pattern)
+		return ok
+	end
+end)
+local function testReconstructionFilters()
+	local filters =
+	{
+		{ "Tent", SfnOpts.SampleInterpFns.Tent() },
+		{ "Gaussian", SfnOpts.SampleInterpFns.Gaussian() },
+		{ "Mitchell", SfnOpts.SampleInterpFns.Mitchell() }
+	}
+	local allOk = true
+	for _,f in ipairs(filters) do
+		local ok = checkReconstruction(f[2])()
+		if not ok then print(string.format("  %s reconstruction: FAILED", f[1])) end
+		allOk = ok and allOk
+	end
+	return allOk
+end
+assert(testReconstructionFilters())
+
+-- Renders of a random scene of spheres and capsules, for checking the sampler's
+--    alternative render paths against its default one (see compareRenders)
+local SceneSfn = SampledFunction(Vec2d, Color1d, SfnOpts.ClampFns.None(), SfnOpts.AccumFns.Over())
+local SceneSampler = ImplicitSampler(SceneSfn, Shape2d1d)
+local sceneNumShapes = 300
+local sceneRes = 160
+local sceneSmoothParam = 0.001
+-- Add the scene's shapes to 'sampler'; shape number 'moved' (if any) is displaced a bit
+local terra addSceneShapes(sampler: &SceneSampler, moved: int) : {}
+	C.srand(42)
+	for i=0,sceneNumShapes do
+		var p = Vec2d.stackAlloc(C.rand()/[double](C.RAND_MAX), C.rand()/[double](C.RAND_MAX))
+		if i == moved then p = p + Vec2d.stackAlloc(0.05, 0.03) end
+		var color = Color1d.stackAlloc(C.rand()/[double](C.RAND_MAX))
+		var alpha = 0.3 + 0.7*C.rand()/[double](C.RAND_MAX)
+		if i % 2 == 0 then
+			sampler:addSphere(p, 0.01 + 0.04*C.rand()/[double](C.RAND_MAX), color, alpha)
+		else
+			var dir = Vec2d.stackAlloc(C.rand()/[double](C.RAND_MAX) - 0.5, C.rand()/[double](C.RAND_MAX) - 0.5)
+			sampler:addCapsule(p, p + 0.2*dir, 0.005 + 0.01*C.rand()/[double](C.RAND_MAX), color, alpha)
+		end
+	end
+end
+-- Render with 'sampler' into a cleared 'sfn'
+local terra renderScene(sampler: &SceneSampler, sfn: &SceneSfn, pattern: &SceneSfn.SamplingPattern, smooth: bool) : {}
+	sfn:setSamplingPattern(pattern)
+	for i=0,sfn:numSamples() do sfn:setSample(i, Color1d.stackAlloc(0.0)) end
+	if smooth then
+		sampler:sampleSmooth(pattern, sceneSmoothParam)
+	else
+		sampler:sampleSharp(pattern)
+	end
+end
+-- 'configure(sampler)' generates code to set up the sampler before it renders
+local function sceneRenderer(configure)
+	return terra(sfn: &SceneSfn, pattern: &SceneSfn.SamplingPattern, smooth: bool, moved: int) : {}
+		var sampler = SceneSampler.stackAlloc(sfn)
+		[configure(sampler)]
+		addSceneShapes(&sampler, moved)
+		renderScene(&sampler, sfn, pattern, smooth)
+		m.destruct(sampler)
+	end
+end
+local renderSceneDefault = sceneRenderer(function(sampler) return quote end end)
+local terra maxSampleDifference(a: &SceneSfn, b: &SceneSfn) : double
+	var maxDiff = 0.0
+	for i=0,a:numSamples() do
+		var d = C.fabs(a:getSample(i).entries[0] - b:getSample(i).entries[0])
+		-- (NaNs count as differences)
+		if not (d <= maxDiff) then maxDiff = d end
+	end
+	return maxDiff
+end
+-- Check that 'render' gives the same samples as the default render path, smooth and
+--    sharp, on a grid pattern and on a jittered one. Samples may differ by at most
+--    'tolerance' (0 demands bit-identical results).
+local function compareRenders(name, render, tolerance)
+	return terra() : bool
+		var zeros = Vec2d.stackAlloc(0.0)
+		var ones = Vec2d.stackAlloc(1.0)
+		var grid = ImgGridPattern.stackAlloc(zeros, ones, Vec2u.stackAlloc(sceneRes, sceneRes))
+		var jittered = JitteredPattern.stackAlloc(zeros, ones, Vec2u.stackAlloc(sceneRes, sceneRes), 3)
+		var a = SceneSfn.stackAlloc()
+		var b = SceneSfn.stackAlloc()
+		var ok = true
+		for p=0,2 do
+			var pattern = grid:getSamplePattern()
+			var patternName = "grid"
+			if p == 1 then
+				pattern = jittered:getSamplePattern()
+				patternName = "jittered"
+			end
+			for s=0,2 do
+				var smooth = (s == 1)
+				renderSceneDefault(&a, pattern, smooth, -1)
+				render(&b, pattern, smooth, -1)
+				var maxDiff = maxSampleDifference(&a, &b)
+				if not (maxDiff <= tolerance) then
+					var mode = "sharp"
+					if smooth then mode = "smooth" end
+					C.printf("  %s, %s %s render: max sample difference %g\n", name, mode, patternName, maxDiff)
+					ok = false
+				end
+			end
+		end
+		m.destruct(a)
+		m.destruct(b)
+		m.destruct(grid)
+		m.destruct(jittered)
+		return ok
+	end
+end
+
+-- Multithreaded rendering must give exactly the same samples as single-threaded rendering
+for _,n in ipairs({2, 4, 7}) do
+	local render = sceneRenderer(function(sampler) return quote [sampler]:setNumThreads(n) end end)
+	assert(compareRenders(string.format("%d threads", n), render, 0.0)())
+end
+
+-- Front-to-back compositing must match back-to-front compositing up to rounding when
+--    only opaque samples are skipped, and to within 1 - saturation otherwise
+local frontToBackTolerance = 1e-12
+for _,saturation in ipairs({1.0, 0.99}) do
+	local render = sceneRenderer(function(sampler) return quote [sampler]:setFrontToBack(true, saturation) end end)
+	local tolerance = (1.0 - saturation) + frontToBackTolerance
+	assert(compareRenders(string.format("front-to-back, saturation %g", saturation), render, tolerance)())
+end
+
+-- BVH-driven sample-major traversal must give exactly the same samples as shape-major
+--    traversal (and front-to-back, the same samples up to rounding)
+local renderBVH = sceneRenderer(function(sampler) return quote [sampler]:setUseBVH(true) end end)
+assert(compareRenders("BVH traversal", renderBVH, 0.0)())
+local renderBVHFrontToBack = sceneRenderer(function(sampler) return quote
+	[sampler]:setUseBVH(true)
+	[sampler]:setFrontToBack(true, 1.0)
+end end)
+assert(compareRenders("BVH front-to-back traversal", renderBVHFrontToBack, frontToBackTolerance)())
+
+-- Check that parallelFor runs every task exactly once, for any number of threads
+local threadPool = require("threadPool")
+local struct TaskCounts { counts: &uint }
+local terra countTask(ctx: &TaskCounts, task: uint) : {}
+	ctx.counts[task] = ctx.counts[task] + 1
+end
+local runCountTasks = threadPool.parallelFor(TaskCounts, countTask)
+local maxTestTasks = 1000
+local terra testParallelFor() : bool
+	var counts : uint[maxTestTasks]
+	var ctx = TaskCounts { &counts[0] }
+	var numTasks = arrayof(uint, 0, 1, 7, maxTestTasks)
+	var ok = true
+	for t=0,4 do
+		var n = numTasks[t]
+		for numThreads=1,10 do
+			for i=0,n do counts[i] = 0 end
+			runCountTasks(&ctx, n, numThreads)
+			for i=0,n do
+				if counts[i] ~= 1 then
+					C.printf("  parallelFor, %u tasks on %u threads: task %u ran %u times\n",
+						n, numThreads, i, counts[i])
+					ok = false
+				end
+			end
+		end
+	end
+	return ok
+end
+assert(testParallelFor())
+
+-- Check incremental re-rendering (ImplicitSampler:setIncremental): render the scene,
+--    move one shape, render again with the same sampler, and so on; every frame must
+--    match a full render of the same scene bit for bit.
+-- (-1 renders the original scene; a repeated index re-renders an unchanged scene)
+local incrementalFrames = {-1, 17, 17, 120, -1}
+local terra testIncrementalRendering() : bool
+	var zeros = Vec2d.stackAlloc(0.0)
+	var ones = Vec2d.stackAlloc(1.0)
+	var grid = ImgGridPattern.stackAlloc(zeros, ones, Vec2u.stackAlloc(sceneRes, sceneRes))
+	var pattern = grid:getSamplePattern()
+	var full = SceneSfn.stackAlloc()
+	var incremental = SceneSfn.stackAlloc()
+	var sampler = SceneSampler.stackAlloc(&incremental)
+	sampler:setIncremental(true)
+	var frames = arrayof(int, [incrementalFrames])
+	var ok = true
+	for s=0,2 do
+		var smooth = (s == 1)
+		for f=0,[#incrementalFrames] do
+			sampler:clear()
+			addSceneShapes(&sampler, frames[f])
+			renderScene(&sampler, &incremental, pattern, smooth)
+			renderSceneDefault(&full, pattern, smooth, frames[f])
+			var maxDiff = maxSampleDifference(&full, &incremental)
+			if not (maxDiff <= 0.0) then
+				C.printf("  incremental rendering, frame %d (smooth = %d): max sample difference %g\n",
+					f, [int](smooth), maxDiff)
+				ok = false
+			end
+		end
+	end
+	m.destruct(sampler)
+	m.destruct(incremental)
+	m.destruct(full)
+	m.destruct(grid)
+	return ok
+end
+assert(testIncrementalRendering())
+
+-- Check the sampler's grid-based paths against the per-sample scan it uses for other
+--    patterns: render 'pattern', and a copy of it with its samples in reverse order
+--    (which is never recognized as a grid), and demand bit-identical samples.
+local SceneSamplePattern = SceneSfn.SamplingPattern
+local terra compareWithScan(name: rawstring, pattern: &SceneSamplePattern) : bool
+	var n = pattern.size
+	var reversed = SceneSamplePattern.stackAlloc()
+	reversed:resize(n)
+	for i=0,n do reversed:set(i, pattern(n-1-i)) end
+	var a = SceneSfn.stackAlloc()
+	var b = SceneSfn.stackAlloc()
+	var ok = true
+	for s=0,2 do
+		var smooth = (s == 1)
+		renderSceneDefault(&a, pattern, smooth, -1)
+		renderSceneDefault(&b, &reversed, smooth, -1)
+		var maxDiff = 0.0
+		for i=0,n do
+			var d = C.fabs(a:getSample(i).entries[0] - b:getSample(n-1-i).entries[0])
+			if not (d <= maxDiff) then maxDiff = d end
+		end
+		if not (maxDiff <= 0.0) then
+			C.printf("  %s (smooth = %d): max sample difference %g\n", name, [int](smooth), maxDiff)
+			ok = false
+		end
+	end
+	m.destruct(a)
+	m.destruct(b)
+	m.destruct(reversed)
+	return ok
+end
+
+-- Grid culling (visiting only the cells covered by each shape's bounds) vs. scanning
+--    every sample. The samples are nudged off their cell centers by much less than
+--    RegularGrid:detect tolerates, so the grid is still detected but its rows are not
+--    evaluated in bulk.
+local terra testGridCulling() : bool
+	var grid = ImgGridPattern.stackAlloc(Vec2d.stackAlloc(0.0), Vec2d.stackAlloc(1.0),
+		Vec2u.stackAlloc(sceneRes, sceneRes))
+	var nudged = m.copy(@grid:getSamplePattern())
+	for i=0,nudged.size do
+		var offset = (1e-3/sceneRes) * ([int]((i*7919) % 13) - 6) / 6.0
+		nudged(i) = nudged(i) + Vec2d.stackAlloc(offset, -offset)
+	end
+	var ok = compareWithScan("grid culling", &nudged)
+	m.destruct(nudged)
+	m.destruct(grid)
+	return ok
+end
+assert(testGridCulling())
+
+-- Vectorized row isovalue kernels (used on grids whose samples sit exactly on the grid's
+--    per-dimension coordinates) vs. scanning every sample with the scalar isovalues.
+-- (Rows are neither a multiple of the SIMD width nor of the row chunk size)
+local terra testRowIsovalueKernels() : bool
+	var grid = ImgGridPattern.stackAlloc(Vec2d.stackAlloc(0.0), Vec2d.stackAlloc(1.0),
+		Vec2u.stackAlloc(sceneRes-3, sceneRes+3))
+	var ok = compareWithScan("row isovalue kernels", grid:getSamplePattern())
+	m.destruct(grid)
+	return ok
+end
+assert(testRowIsovalueKernels())
+
+-- Interned sample patterns (SharedSamplePattern) vs. private copies: identical grids
+--    and functions that own equal patterns must share one copy of the samples, and
+--    scoring a render against a target on a different but equal pattern (which
+--    mseComps accepts by fingerprint) must give the same errors as on the same pattern.
+local terra testSharedPatterns() : bool
+	var zeros = Vec2d.stackAlloc(0.0)
+	var ones = Vec2d.stackAlloc(1.0)
+	var grid = ImgGridPattern.stackAlloc(zeros, ones, Vec2u.stackAlloc(sceneRes, sceneRes))
+	var sameGrid = ImgGridPattern.stackAlloc(zeros, ones, Vec2u.stackAlloc(sceneRes, sceneRes))
+	var pattern = grid:getSamplePattern()
+	var copy = m.copy(@pattern)
+	var ok = true
+	if sameGrid:getSamplePattern() ~= pattern then
+		C.printf("  shared patterns: identical grids store their samples twice\n")
+		ok = false
+	end
+	var owner = SceneSfn.stackAlloc()
+	owner:ownSamplingPattern(&copy)
+	if owner.samplingPattern ~= pattern then
+		C.printf("  shared patterns: an owned copy of a grid's samples is stored again\n")
+		ok = false
+	end
+	var render = SceneSfn.stackAlloc()
+	var target = SceneSfn.stackAlloc()
+	var sameTarget = SceneSfn.stackAlloc()
+	renderSceneDefault(&render, pattern, true, -1)
+	renderSceneDefault(&target, &copy, true, 17)
+	renderSceneDefault(&sameTarget, pattern, true, 17)
+	var zeroErr, nonZeroErr = mseComps(&render, &target)
+	var zeroRef, nonZeroRef = mseComps(&render, &sameTarget)
+	if zeroErr ~= zeroRef or nonZeroErr ~= nonZeroRef then
+		C.printf("  shared patterns: errors (%g, %g) against an equal pattern, (%g, %g) against the same one\n",
+			zeroErr, nonZeroErr, zeroRef, nonZeroRef)
+		ok = false
+	end
+	m.destruct(sameTarget)
+	m.destruct(target)
+	m.destruct(render)
+	m.destruct(owner)
+	m.destruct(copy)
+	m.destruct(sameGrid)
+	m.destruct(grid)
+	return ok
+end
+assert(testSharedPatterns())
+
+-- Mini-batch rendering (StratifiedSubsetPattern, as used by the MSE likelihood) vs. a
+--    full render: every subset sample must match the full render at its source index
+--    bit for bit, over several draws rendered by the same sampler, and come from its
+--    own stratum of source indices.
+local SubsetPattern = patterns.StratifiedSubsetPattern(Vec2d)
+local miniBatchDraws = 3
+local terra testMiniBatchSubsets() : bool
+	var grid = ImgGridPattern.stackAlloc(Vec2d.stackAlloc(0.0), Vec2d.stackAlloc(1.0),
+		Vec2u.stackAlloc(sceneRes, sceneRes))
+	var pattern = grid:getSamplePattern()
+	var N = pattern.size
+	var n = N / 7
+	var subset = SubsetPattern.stackAlloc(7)
+	var full = SceneSfn.stackAlloc()
+	var batch = SceneSfn.stackAlloc()
+	var sampler = SceneSampler.stackAlloc(&batch)
+	addSceneShapes(&sampler, -1)
+	var ok = true
+	for s=0,2 do
+		var smooth = (s == 1)
+		renderSceneDefault(&full, pattern, smooth, -1)
+		for draw=0,miniBatchDraws do
+			subset:draw(pattern, n)
+			sampler:patternChanged()
+			renderScene(&sampler, &batch, subset:getSamplePattern(), smooth)
+			for k=0,n do
+				var index = subset:getSourceIndex(k)
+				if index < (k*N)/n or index >= ((k+1)*N)/n then
+					C.printf("  mini-batch, draw %d: sample %u comes from outside its stratum\n", draw, k)
+					ok = false
+				end
+				if batch:getSample(k).entries[0] ~= full:getSample(index).entries[0] then
+					C.printf("  mini-batch, draw %d (smooth = %d): sample %u differs from the full render\n",
+						draw, [int](smooth), k)
+					ok = false
+				end
+			end
+		end
+	end
+	m.destruct(sampler)
+	m.destruct(batch)
+	m.destruct(full)
+	m.destruct(subset)
+	m.destruct(grid)
+	return ok
+end
+assert(testMiniBatchSubsets())
+
+-- Lazily generated grid samples (RegularGridSamplingPattern) vs. the samples the grid
+--    pattern used to store up front: the same cell centroids, computed the same way,
+--    in the same order (last dimension varying fastest). Renders on the grid's own
+--    samples (whose grid structure the sampler takes from the pattern) must also
+--    match renders on a copy of them (whose grid structure it has to detect).
+local terra testLazyGrid() : bool
+	var mins = Vec2d.stackAlloc(-0.3, 0.1)
+	var maxs = Vec2d.stackAlloc(1.7, 0.9)
+	var numCells = Vec2u.stackAlloc(37, 23)
+	var grid = ImgGridPattern.stackAlloc(mins, maxs, numCells)
+	var pattern = grid:getSamplePattern()
+	var ok = (pattern.size == numCells(0)*numCells(1))
+	for i=0,numCells(0) do
+		var tx = (i+0.5)/numCells(0)
+		var x = (1.0-tx)*mins(0) + tx*maxs(0)
+		for j=0,numCells(1) do
+			var ty = (j+0.5)/numCells(1)
+			var y = (1.0-ty)*mins(1) + ty*maxs(1)
+			var p = pattern(i*numCells(1) + j)
+			if p(0) ~= x or p(1) ~= y then
+				C.printf("  lazy grid: sample (%u, %u) is at (%g, %g), not (%g, %g)\n", i, j, p(0), p(1), x, y)
+				ok = false
+			end
+		end
+	end
+	var unitGrid = ImgGridPattern.stackAlloc(Vec2d.stackAlloc(0.0), Vec2d.stackAlloc(1.0),
+		Vec2u.stackAlloc(sceneRes, sceneRes))
+	var copy = m.copy(@unitGrid:getSamplePattern())
+	var a = SceneSfn.stackAlloc()
+	var b = SceneSfn.stackAlloc()
+	for s=0,2 do
+		var smooth = (s == 1)
+		renderSceneDefault(&a, unitGrid:getSamplePattern(), smooth, -1)
+		renderSceneDefault(&b, &copy, smooth, -1)
+		var maxDiff = maxSampleDifference(&a, &b)
+		if not (maxDiff <= 0.0) then
+			C.printf("  lazy grid (smooth = %d): max sample difference %g from a detected grid\n",
+				[int](smooth), maxDiff)
+			ok = false
+		end
+	end
+	m.destruct(b)
+	m.destruct(a)
+	m.destruct(copy)
+	m.destruct(unitGrid)
+	m.destruct(grid)
+	return ok
+end
+assert(testLazyGrid())
+
+-- Off-grid target patterns, and the bilinear image lookups that load targets onto them
+--    (see loadTargetImage). At pixel centers, bilinear lookups must give exactly the
+--    pixels, as the nearest neighbor lookups used for grid targets do. Jittered samples
+--    must stay in their own cells, and Halton and Poisson-disk samples inside the box,
+--    with Poisson-disk samples at least one radius apart.
+local patternTestSize = 31
+local terra fillTestImage(image: &RGBImage, seed: uint) : {}
+	C.srand(seed)
+	for i=0,image:width() do
+		for j=0,image:height() do
+			image:setPixelColor(i, j, RGBImage.ColorVec.stackAlloc([uint8](C.rand() % 256),
+				[uint8](C.rand() % 256), [uint8](C.rand() % 256)))
+		end
+	end
+end
+local loadNearest = SampledImg.loadFromImage(RGBImage)
+local loadBilinear = SampledImg.loadFromImage(RGBImage, SfnOpts.ImageInterpFns.Bilinear())
+local terra testOffGridPatterns() : bool
+	var zeros = Vec2d.stackAlloc(0.0)
+	var ones = Vec2d.stackAlloc(1.0)
+	var size = patternTestSize
+	var ok = true
+	var image = RGBImage.stackAlloc(size, size)
+	fillTestImage(&image, 11)
+	var grid = ImgGridPattern.stackAlloc(zeros, ones, Vec2u.stackAlloc(size, size))
+	-- (A private copy of the grid's samples, so that neither load streams scanlines)
+	var pixelCenters = m.copy(@grid:getSamplePattern())
+	var nearest = SampledImg.stackAlloc()
+	var bilinear = SampledImg.stackAlloc()
+	nearest:setSamplingPattern(&pixelCenters)
+	bilinear:setSamplingPattern(&pixelCenters)
+	loadNearest(&nearest, &image, zeros, ones)
+	loadBilinear(&bilinear, &image, zeros, ones)
+	for i=0,nearest:numSamples() do
+		if not (nearest:getSample(i) == bilinear:getSample(i)) then
+			C.printf("  bilinear lookup at pixel center %u differs from the pixel\n", i)
+			ok = false
+		end
+	end
+	var jittered = JitteredPattern.stackAlloc(zeros, ones, Vec2u.stackAlloc(size, size), 3)
+	var jitteredSamples = jittered:getSamplePattern()
+	for i=0,jitteredSamples.size do
+		var p = jitteredSamples(i)
+		var cell = [uint](p(0)*size)*size + [uint](p(1)*size)
+		if not (p(0) >= 0.0 and p(1) >= 0.0) or cell ~= i then
+			C.printf("  jittered sample %u lies outside its cell\n", i)
+			ok = false
+		end
+	end
+	var halton = HaltonPattern.stackAlloc(zeros, ones, size*size, 5)
+	var haltonSamples = halton:getSamplePattern()
+	if haltonSamples.size ~= size*size then ok = false end
+	for i=0,haltonSamples.size do
+		var p = haltonSamples(i)
+		if not (p(0) >= 0.0 and p(0) < 1.0 and p(1) >= 0.0 and p(1) < 1.0) then
+			C.printf("  Halton sample %u lies outside the box\n", i)
+			ok = false
+		end
+	end
+	var radius = PoissonDiskPattern.radiusFor(1.0, size*size)
+	var poisson = PoissonDiskPattern.stackAlloc(zeros, ones, radius, 5)
+	var poissonSamples = poisson:getSamplePattern()
+	for i=0,poissonSamples.size do
+		var p = poissonSamples(i)
+		if not (p(0) >= 0.0 and p(0) < 1.0 and p(1) >= 0.0 and p(1) < 1.0) then
+			C.printf("  Poisson-disk sample %u lies outside the box\n", i)
+			ok = false
+		end
+		for j=i+1,poissonSamples.size do
+			if p:distSq(poissonSamples(j)) < radius*radius then
+				C.printf("  Poisson-disk samples %u and %u are closer than the radius\n", i, j)
+				ok = false
+			end
+		end
+	end
+	m.destruct(poisson)
+	m.destruct(halton)
+	m.destruct(jittered)
+	m.destruct(bilinear)
+	m.destruct(nearest)
+	m.destruct(pixelCenters)
+	m.destruct(grid)
+	m.destruct(image)
+	return ok
+end
+assert(testOffGridPatterns())
+
+-- Image conversions that stream whole scanlines (for functions sampled at exactly an
+--    image's pixel centers) vs. the per-sample conversions used for other patterns:
+--    loads and saves on a grid's shared samples take the scanline path, and on a
+--    private copy of them, the per-sample one. Both must give identical results.
+local checkScanlineIO = templatize(function(SfnT)
+	local load = SfnT.loadFromImage(RGBImage)
+	local save = SfnT.saveToImage(RGBImage)
+	return terra() : bool
+		var zeros = Vec2d.stackAlloc(0.0)
+		var ones = Vec2d.stackAlloc(1.0)
+		-- (Not square, so that rows and columns can't be mixed up)
+		var w = patternTestSize
+		var h = patternTestSize + 6
+		var image = RGBImage.stackAlloc(w, h)
+		fillTestImage(&image, 13)
+		var grid = ImgGridPattern.stackAlloc(zeros, ones, Vec2u.stackAlloc(w, h))
+		var copy = m.copy(@grid:getSamplePattern())
+		var scanline = SfnT.stackAlloc()
+		var perSample = SfnT.stackAlloc()
+		scanline:setSamplingPattern(grid:getSamplePattern())
+		perSample:setSamplingPattern(&copy)
+		load(&scanline, &image, zeros, ones)
+		load(&perSample, &image, zeros, ones)
+		var ok = true
+		for i=0,scanline:numSamples() do
+			if not (scanline:getSample(i) == perSample:getSample(i)) then
+				C.printf("  scanline load: sample %u differs\n", i)
+				ok = false
+			end
+		end
+		var scanlineImage = RGBImage.stackAlloc(w, h)
+		var perSampleImage = RGBImage.stackAlloc(w, h)
+		save(&scanline, &scanlineImage, zeros, ones)
+		save(&perSample, &perSampleImage, zeros, ones)
+		for i=0,w do
+			for j=0,h do
+				if not (scanlineImage:getPixelColor(i, j) == perSampleImage:getPixelColor(i, j)) then
+					C.printf("  scanline save: pixel (%d, %d) differs\n", i, j)
+					ok = false
+				end
+			end
+		end
+		m.destruct(perSampleImage)
+		m.destruct(scanlineImage)
+		m.destruct(perSample)
+		m.destruct(scanline)
+		m.destruct(copy)
+		m.destruct(grid)
+		m.destruct(image)
+		return ok
+	end
+end)
+local function testScanlineIO()
+	local types =
+	{
+		{ "RGB doubles", SampledImg },
+		{ "RGB doubles (SoA)", SampledImgSoA },
+		{ "grayscale doubles", SceneSfn }
+	}
+	local allOk = true
+	for _,t in ipairs(types) do
+		local ok = checkScanlineIO(t[2])()
+		if not ok then print(string.format("  %s scanline I/O: FAILED", t[1])) end
+		allOk = ok and allOk
+	end
+	return allOk
+end
+assert(testScanlineIO())
+
 -- local terra testImageLoadAndSave()
 -- 	var flowerPic = RGBImage.stackAlloc(im.Format.JPEG, "flowers.jpg")
 -- 	var zeros = Vec2d.stackAlloc(0.0)
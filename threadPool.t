@@ -0,0 +1,156 @@
+local m = require("mem")
+local Vector = require("vector")
+
+local C = terralib.includecstring [[
+#include <pthread.h>
+#include <unistd.h>
+static inline unsigned int atomicFetchAndAdd(unsigned int* ptr, unsigned int val)
+{
+	return __sync_fetch_and_add(ptr, val);
+}
+static inline unsigned int numHardwareThreads()
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (unsigned int)n : 1;
+}
+]]
+
+
+-- Persistent worker threads, shared by every parallelFor function. Workers sleep
+--    between jobs, and are only created as jobs ask for more of them.
+-- There is one job at a time: a job posted while another one is running does not
+--    get any helpers (its caller does all of the work).
+local JobFn = {&opaque} -> {}
+local struct Pool
+{
+	mutex: C.pthread_mutex_t,
+	-- Signalled when a job wants helpers
+	wake: C.pthread_cond_t,
+	-- Signalled when the last helper leaves a job
+	done: C.pthread_cond_t,
+	threads: Vector(C.pthread_t),
+	busy: bool,
+	jobFn: JobFn,
+	jobArg: &opaque,
+	-- Helpers the current job still wants, and helpers working on it
+	wantedHelpers: uint,
+	activeHelpers: uint
+}
+local pool = global(Pool)
+
+local terra initPool() : {}
+	C.pthread_mutex_init(&pool.mutex, nil)
+	C.pthread_cond_init(&pool.wake, nil)
+	C.pthread_cond_init(&pool.done, nil)
+	m.init(pool.threads)
+	pool.busy = false
+	pool.jobFn = nil
+	pool.jobArg = nil
+	pool.wantedHelpers = 0
+	pool.activeHelpers = 0
+end
+initPool()
+
+local terra poolWorker(arg: &opaque) : &opaque
+	C.pthread_mutex_lock(&pool.mutex)
+	while true do
+		while pool.wantedHelpers == 0 do
+			C.pthread_cond_wait(&pool.wake, &pool.mutex)
+		end
+		pool.wantedHelpers = pool.wantedHelpers - 1
+		pool.activeHelpers = pool.activeHelpers + 1
+		var fn = pool.jobFn
+		var jobArg = pool.jobArg
+		C.pthread_mutex_unlock(&pool.mutex)
+		fn(jobArg)
+		C.pthread_mutex_lock(&pool.mutex)
+		pool.activeHelpers = pool.activeHelpers - 1
+		if pool.activeHelpers == 0 then C.pthread_cond_broadcast(&pool.done) end
+	end
+	return nil
+end
+
+-- Run 'fn(arg)' on the calling thread and on up to 'numHelpers' pool threads at once,
+--    and return once all of them have finished. 'fn' must cope with being run by any
+--    number of threads (including just the calling one).
+-- Pool threads are created as needed; if the system refuses to create more, the job
+--    runs with the ones there are.
+local terra runOnPool(fn: JobFn, arg: &opaque, numHelpers: uint) : {}
+	C.pthread_mutex_lock(&pool.mutex)
+	if pool.busy then
+		C.pthread_mutex_unlock(&pool.mutex)
+		fn(arg)
+		return
+	end
+	pool.busy = true
+	while pool.threads.size < numHelpers do
+		var thread : C.pthread_t
+		if C.pthread_create(&thread, nil, poolWorker, nil) ~= 0 then break end
+		pool.threads:push(thread)
+	end
+	if numHelpers > pool.threads.size then numHelpers = pool.threads.size end
+	pool.jobFn = fn
+	pool.jobArg = arg
+	pool.wantedHelpers = numHelpers
+	if numHelpers > 0 then C.pthread_cond_broadcast(&pool.wake) end
+	C.pthread_mutex_unlock(&pool.mutex)
+	fn(arg)
+	C.pthread_mutex_lock(&pool.mutex)
+	-- Helpers that have not picked up the job by now are not needed any more
+	pool.wantedHelpers = 0
+	while pool.activeHelpers > 0 do
+		C.pthread_cond_wait(&pool.done, &pool.mutex)
+	end
+	pool.busy = false
+	C.pthread_mutex_unlock(&pool.mutex)
+end
+
+
+-- Build a function which runs 'taskFn(ctx, taskIndex)' for every task index in
+--    [0, numTasks) using up to numThreads threads (the calling thread included).
+-- Threads claim tasks dynamically from a shared counter, so tasks of uneven cost
+--    still balance out across threads, and the calling thread finishes any tasks
+--    that no other thread gets to.
+-- 'taskFn' is a Terra function of type {&ContextType, uint} -> {}
+local parallelForCache = {}
+local function parallelFor(ContextType, taskFn)
+	parallelForCache[ContextType] = parallelForCache[ContextType] or {}
+	local cached = parallelForCache[ContextType][taskFn]
+	if cached then return cached end
+
+	local struct Job
+	{
+		ctx: &ContextType,
+		numTasks: uint,
+		nextTask: uint
+	}
+
+	local terra worker(arg: &opaque) : {}
+		var job = [&Job](arg)
+		while true do
+			var task = C.atomicFetchAndAdd(&job.nextTask, 1)
+			if task >= job.numTasks then break end
+			taskFn(job.ctx, task)
+		end
+	end
+
+	local terra run(ctx: &ContextType, numTasks: uint, numThreads: uint) : {}
+		var job = Job { ctx, numTasks, 0 }
+		if numThreads > numTasks then numThreads = numTasks end
+		if numThreads <= 1 then
+			worker(&job)
+			return
+		end
+		runOnPool(worker, &job, numThreads-1)
+	end
+
+	parallelForCache[ContextType][taskFn] = run
+	return run
+end
+
+
+return
+{
+	parallelFor = parallelFor,
+	numHardwareThreads = C.numHardwareThreads
+}